@@ -1,6 +1,25 @@
 import typing
 
 from hyperscan._hs_ext import *  # noqa: F403
+from hyperscan._hs_ext import (
+    HS_CPU_FEATURES_AVX2,
+    HS_CPU_FEATURES_AVX512,
+    HS_CPU_FEATURES_AVX512VBMI,
+    HS_TUNE_FAMILY_GENERIC,
+    Database,
+    populate_platform,
+    serialized_database_info,
+)
+from hyperscan._analyze import ExpressionInfo, analyze_expressions
+from hyperscan._dbcache import DatabaseCache
+from hyperscan._handle import DatabaseHandle
+from hyperscan._intern import InternRegistry
+from hyperscan._mixed import MixedDatabase, as_literal
+from hyperscan._planner import Partition, PlannedDatabase
+from hyperscan._registry import DatabaseRegistry
+from hyperscan._sharded import ShardedDatabase, ShardedStream
+from hyperscan._shared import SharedDatabase
+from hyperscan._streamstore import StreamStore
 
 try:
     from hyperscan._version import __version__  # pyright: ignore
@@ -15,3 +34,43 @@ class ExpressionExt(typing.NamedTuple):
     min_length: int = 0
     edit_distance: int = 0
     hamming_distance: int = 0
+
+
+_FEATURES = {
+    b"AVX2": HS_CPU_FEATURES_AVX2,
+    b"AVX512": HS_CPU_FEATURES_AVX2 | HS_CPU_FEATURES_AVX512,
+    b"AVX512VBMI": (
+        HS_CPU_FEATURES_AVX2
+        | HS_CPU_FEATURES_AVX512
+        | HS_CPU_FEATURES_AVX512VBMI
+    ),
+}
+
+
+class Platform(typing.NamedTuple):
+    tune: int = HS_TUNE_FAMILY_GENERIC
+    cpu_features: int = 0
+
+    @classmethod
+    def host(cls) -> "Platform":
+        return cls(*populate_platform())
+
+    @classmethod
+    def of(
+        cls, database: typing.Union[Database, typing.ByteString]
+    ) -> "Platform":
+        if isinstance(database, Database):
+            info = database.info()
+        else:
+            info = serialized_database_info(database)
+        words = info.split()
+        try:
+            start = words.index(b"Features:") + 1
+            features = words[start : words.index(b"Mode:")]
+        except ValueError:
+            raise ValueError(f"unrecognized database info: {info!r}") from None
+        cpu_features = 0
+        for feature in features:
+            cpu_features |= _FEATURES.get(feature, 0)
+        # The tuning family is not recorded in the database.
+        return cls(HS_TUNE_FAMILY_GENERIC, cpu_features)
@@ -1,10 +1,19 @@
+from concurrent.futures import Future
+from os import PathLike
 from typing import (
+    Any,
     AnyStr,
     ByteString,
     Callable,
+    Dict,
+    Hashable,
+    Iterable,
+    List,
+    NamedTuple,
     Optional,
     Self,
     Sequence,
+    SupportsIndex,
     Tuple,
     TypeAlias,
     Union,
@@ -33,6 +42,8 @@ CH_SCAN_TERMINATED = -3
 CH_SCRATCH_IN_USE = -10
 CH_SUCCESS = 0
 HS_CPU_FEATURES_AVX2 = 4
+HS_CPU_FEATURES_AVX512 = 8
+HS_CPU_FEATURES_AVX512VBMI = 16
 HS_EXT_FLAG_EDIT_DISTANCE = 8
 HS_EXT_FLAG_HAMMING_DISTANCE = 16
 HS_EXT_FLAG_MAX_OFFSET = 2
@@ -63,6 +74,8 @@ HS_TUNE_FAMILY_BDW = 5
 HS_TUNE_FAMILY_GENERIC = 0
 HS_TUNE_FAMILY_GLM = 8
 HS_TUNE_FAMILY_HSW = 3
+HS_TUNE_FAMILY_ICL = 9
+HS_TUNE_FAMILY_ICX = 10
 HS_TUNE_FAMILY_IVB = 2
 HS_TUNE_FAMILY_SKL = 6
 HS_TUNE_FAMILY_SKX = 7
@@ -71,6 +84,20 @@ HS_TUNE_FAMILY_SNB = 1
 
 match_event_callback = Callable[[int, int, int, int, object], Optional[bool]]
 
+def allocator_stats() -> Dict[str, Union[int, str]]:
+    """Returns memory held by Hyperscan, by allocation category.
+
+    Returns:
+        dict: Bytes currently allocated for **database**, **scratch**,
+        **stream** and **misc** memory, their **total** and **peak**,
+        the configured **backend** and **limit**, and the number of
+        allocation **failures**. **huge_pages** is the configured mode,
+        **huge_page_bytes** the size of huge page mappings, and
+        **huge_page_fallbacks** the number of explicit huge page
+        mappings that fell back to transparent huge pages.
+
+    """
+
 def dumpb(database: "Database") -> bytes:
     """Serializes a Hyperscan database.
 
@@ -82,18 +109,281 @@ def dumpb(database: "Database") -> bytes:
 
     """
 
-def loadb(buf: ByteString, mode: int) -> "Database":
+def loadb(
+    buf: ByteString,
+    mode: int,
+    into: Optional[ByteString] = None,
+    warmup: bool = False,
+) -> "Database":
     """Deserializes a Hyperscan database.
 
     Args:
-        buf (bytes): A serialized Hyperscan database.
+        buf (bytes-like): A serialized Hyperscan database, e.g.
+            :obj:`bytes` or an :class:`mmap.mmap` of a file.
         mode (int): The expected mode of the database.
+        into (writable bytes-like, optional): 8-byte aligned region of
+            at least :func:`serialized_database_size` bytes to
+            deserialize into instead of allocating. It stays exported,
+            and so cannot be resized or closed, until the database is
+            released or recompiled.
+        warmup (bool, optional): Calls :meth:`Database.warmup` on the
+            database before returning it.
 
     Returns:
         :class:`Database`: The deserialized database instance.
 
     """
 
+def memory_stats() -> Dict[str, int]:
+    """Returns the number and size of live Hyperscan objects.
+
+    Sizes are those reported by ``hs_database_size``,
+    ``hs_scratch_size`` and ``hs_stream_size``, so unlike
+    :func:`allocator_stats` they exclude allocator overhead.
+
+    Returns:
+        dict: **databases**, **scratches** and **streams** currently
+        alive, and their total **database_bytes**, **scratch_bytes**
+        and **stream_bytes**.
+
+    """
+
+def attach(buf: ByteString, mode: int) -> "Database":
+    """Wraps a database already deserialized into memory.
+
+    Unlike :func:`loadb`, nothing is copied: the returned database scans
+    **buf** directly, typically a shared memory region that another
+    process filled with ``loadb(..., into=region)``. The region is never
+    written to and may be mapped read-only.
+
+    Args:
+        buf (bytes-like): An 8-byte aligned deserialized database.
+        mode (int): The mode of the database.
+
+    Returns:
+        :class:`Database`: A database backed by **buf**.
+
+    """
+
+def serialized_database_size(buf: ByteString) -> int:
+    """Returns the size a serialized database needs once loaded.
+
+    Args:
+        buf (bytes-like): A serialized Hyperscan database.
+
+    Returns:
+        int: Size in bytes of the region :func:`loadb` needs for
+        **into**.
+
+    """
+
+def serialized_database_info(buf: ByteString) -> bytes:
+    """Describes a serialized database without deserializing it.
+
+    Args:
+        buf (bytes-like): A serialized Hyperscan database.
+
+    Returns:
+        bytes: Version, platform and mode information, in the format of
+        :meth:`Database.info`.
+
+    """
+
+def expression_info(
+    expressions: Sequence[AnyStr],
+    flags: Union[Sequence[int], int] = 0,
+    ext: Optional[Sequence[Optional[Tuple[int, ...]]]] = None,
+) -> List[
+    Tuple[
+        Optional[int],
+        Optional[int],
+        Optional[bool],
+        Optional[bool],
+        Optional[bool],
+        Optional[str],
+    ]
+]:
+    """Analyzes a batch of expressions without compiling a database.
+
+    Calls ``hs_expression_ext_info`` for every expression with the GIL
+    released once for the whole batch, so batches may be analyzed in
+    parallel from several threads.
+
+    Args:
+        expressions (sequence of str): The expressions to analyze.
+        flags (sequence of int or int, optional): Flags for each
+            expression, or a single value applied to all of them.
+        ext (sequence of tuple, optional): Extended parameters for each
+            expression, as in :meth:`Database.compile`, or None for
+            expressions without any.
+
+    Returns:
+        list of tuple: For each expression, its **min_width**,
+        **max_width** (None if unbounded), **unordered_matches**,
+        **matches_at_eod**, **matches_only_at_eod** and **error**.
+        Expressions that fail to compile have only **error** set, to
+        the compiler's message.
+
+    """
+
+class ExpressionInfo(NamedTuple):
+    """Properties of an expression reported by
+    :func:`analyze_expressions`.
+
+    Attributes:
+        min_width (int): Minimum length in bytes of a match.
+        max_width (int): Maximum length in bytes of a match, or None if
+            unbounded.
+        unordered_matches (bool): Whether matches may be reported out of
+            offset order.
+        matches_at_eod (bool): Whether the expression can match at end
+            of data.
+        matches_only_at_eod (bool): Whether the expression only matches
+            at end of data.
+        error (str): The compiler's message if the expression is
+            invalid, in which case every other field is None.
+
+    """
+
+    min_width: Optional[int]
+    max_width: Optional[int]
+    unordered_matches: Optional[bool]
+    matches_at_eod: Optional[bool]
+    matches_only_at_eod: Optional[bool]
+    error: Optional[str] = None
+
+def analyze_expressions(
+    expressions: Sequence[AnyStr],
+    flags: Union[Sequence[int], int] = 0,
+    ext: Optional[Sequence[Optional[Tuple[int, ...]]]] = None,
+    workers: Optional[int] = None,
+) -> List[ExpressionInfo]:
+    """Analyzes expressions in parallel without compiling a database.
+
+    The expressions are split into contiguous batches that are passed to
+    :func:`expression_info` on separate threads, which release the GIL
+    while Hyperscan analyzes them. Invalid expressions do not stop the
+    batch; their :attr:`ExpressionInfo.error` is set instead, so a whole
+    rule set can be validated in one call.
+
+    Args:
+        expressions (sequence of str): The expressions to analyze.
+        flags (sequence of int or int, optional): Flags for each
+            expression, or a single value applied to all of them.
+        ext (sequence of tuple, optional): Extended parameters for each
+            expression, or None for expressions without any.
+        workers (int, optional): Number of threads. Defaults to the
+            number of CPUs.
+
+    Returns:
+        list of :class:`ExpressionInfo`: One result per expression, in
+        order.
+
+    """
+
+def populate_platform() -> Tuple[int, int]:
+    """Describes the platform of the current host.
+
+    Returns:
+        tuple: The **tune** family (one of the ``HS_TUNE_FAMILY_*``
+        constants) and the **cpu_features** bitmask
+        (``HS_CPU_FEATURES_*``). See also :meth:`Platform.host`.
+
+    """
+
+class Platform(NamedTuple):
+    """The CPU a database is compiled for.
+
+    Pass one to :meth:`Database.compile` to build databases on one
+    machine for another, e.g. for an AVX-512 fleet on a generic build
+    server.
+
+    Attributes:
+        tune (int): Tuning family, one of the ``HS_TUNE_FAMILY_*``
+            constants.
+        cpu_features (int): Bitmask of ``HS_CPU_FEATURES_*`` constants
+            the database may use.
+
+    """
+
+    tune: int = ...
+    cpu_features: int = ...
+    @classmethod
+    def host(cls) -> "Platform":
+        """Returns the platform of the current host, as reported by
+        :func:`populate_platform`."""
+    @classmethod
+    def of(cls, database: Union["Database", ByteString]) -> "Platform":
+        """Returns the platform a database was compiled for.
+
+        Args:
+            database (:class:`Database` or bytes-like): A database, or
+                a serialized database as returned by :func:`dumpb`.
+
+        Returns:
+            :class:`Platform`: The CPU features the database uses. The
+            tuning family is not recorded in databases and is always
+            reported as :const:`HS_TUNE_FAMILY_GENERIC`.
+
+        """
+
+def scan_streams(
+    pairs: Sequence[Tuple["Stream", ByteString]],
+    flags: int = 0,
+    scratch: Optional["Scratch"] = None,
+) -> List[Tuple["Stream", int, int, int, int]]:
+    """Scans a batch of chunks across many open streams.
+
+    All buffers are pinned and the GIL is released once for the whole
+    batch. Chunks are fed to their streams in order, and matches are
+    collected natively rather than passed to the streams' match event
+    handlers.
+
+    Args:
+        pairs (sequence of tuple): A sequence of ``(stream, data)``
+            tuples, where **stream** is an open :class:`Stream` and
+            **data** is a bytes-like object.
+        flags (int, optional): Currently unused.
+        scratch (:class:`Scratch`, optional): Scratch space used for
+            every stream. Defaults to the scratch space of each
+            stream's database.
+
+    Returns:
+        list: ``(stream, id, from, to, flags)`` tuples, in the order
+        the matches were reported.
+
+    """
+
+def set_allocator(
+    backend: str = "malloc",
+    limit: int = 0,
+    huge_pages: str = "off",
+    huge_page_threshold: int = 1048576,
+) -> None:
+    """Selects where Hyperscan allocates memory.
+
+    Blocks already allocated are released by the backend that
+    allocated them, so the backend may be switched at any time.
+
+    Args:
+        backend (str, optional): ``'malloc'`` for the C library
+            allocator, or ``'pymem'`` for Python's raw allocator, which
+            makes Hyperscan memory visible to :mod:`tracemalloc`.
+        limit (int, optional): If non-zero, allocations that would
+            raise the total above this many bytes fail, and the
+            operation needing them raises :class:`error`.
+        huge_pages (str, optional): Places database and scratch
+            allocations of at least **huge_page_threshold** bytes in
+            their own mappings backed by huge pages to reduce TLB
+            misses while scanning. ``'transparent'`` advises the kernel
+            to use transparent huge pages; ``'explicit'`` uses
+            preallocated huge pages (``MAP_HUGETLB``), falling back to
+            transparent ones. Not supported on Windows.
+        huge_page_threshold (int, optional): Minimum allocation size
+            placed in huge pages.
+
+    """
+
 class error(Exception):
     """Base exception class for Hyperscan errors."""
 
@@ -164,6 +454,21 @@ class Scratch:
             :obj:`database`: A hyperscan Database.
 
         """
+    def extend(self, database: "Database") -> None:
+        """Grows the scratch space so it can also be used with another
+        database, as if allocated for each database in turn.
+
+        Args:
+            database (:class:`Database`): A compiled database.
+
+        """
+    def size(self) -> int:
+        """Returns the size of the scratch space in bytes.
+
+        Returns:
+            int: The size in bytes, or 0 if nothing is allocated.
+
+        """
 
 class Stream:
     """Provides a context manager for scanning streams of text.
@@ -176,6 +481,13 @@ class Stream:
             which is invoked for each match result, and passed the
             expression id, start offset, end offset, flags, and a
             context object.
+        coalesce_size (int, optional): If non-zero, writes shorter
+            than this many bytes are buffered and scanned together
+            once the buffer fills. Match offsets are unaffected.
+        coalesce_writes (int, optional): If non-zero, the buffer is
+            also scanned after this many buffered writes.
+        scratch (:class:`Scratch`, optional): Scratch space used by
+            calls that do not pass their own.
 
     """
 
@@ -187,11 +499,12 @@ class Stream:
     ) -> None:
         """Closes the stream.
 
+        If neither this call nor the stream has a match handler, the
+        stream is released without reporting end-of-data matches.
+
         Args:
             scratch (:class:`Scratch`, optional): Scratch space.
-                If a **match_event_handler** is provided and a scratch
-                space is not, the scratch space of the associated
-                database will be used.
+                Defaults to the stream's, or else the database's.
             match_event_handler (callable, optional): The match
                 callback, which is invoked for each match result, and
                 passed the expression id, start offset, end offset,
@@ -199,6 +512,44 @@ class Stream:
             context (:obj:`object`, optional): A context object passed
                 as the last arg to **match_event_handler**.
 
+        """
+    def compress(self) -> bytes:
+        """Compresses the stream state.
+
+        Returns:
+            bytes: A compact representation of the stream state, which
+            can be restored with :meth:`expand`.
+
+        """
+    def expand(self, buf: ByteString) -> None:
+        """Restores a stream state produced by :meth:`compress`.
+
+        If the stream is open, its current state is discarded without
+        reporting end-of-data matches. Otherwise the stream is opened
+        with the restored state.
+
+        Args:
+            buf (bytes): A compressed stream state for a stream of the
+                same database.
+
+        """
+    def flush(
+        self,
+        scratch: Optional[Scratch] = None,
+        match_event_handler: Optional[match_event_callback] = None,
+        context: Optional[object] = None,
+    ) -> None:
+        """Scans any data held in the coalescing buffer.
+
+        Args:
+            scratch (:obj:`Scratch`, optional): Scratch space.
+            match_event_handler (callable, optional): The match
+                callback, which is invoked for each match result, and
+                passed the expression id, start offset, end offset,
+                flags, and a context object.
+            context (object, optional): A context object passed
+                as the last arg to **match_event_handler**.
+
         """
     def scan(
         self,
@@ -210,6 +561,10 @@ class Stream:
     ) -> None:
         """Scans streaming text.
 
+        If the stream coalesces small writes, data shorter than
+        **coalesce_size** is buffered, and matches in it are reported
+        to the handler of the call that flushes the buffer.
+
         Args:
             data (str): The block of text to scan.
             flags (int, optional): Currently unused.
@@ -232,6 +587,86 @@ class Stream:
         exc_traceback: Optional[TracebackType],
     ) -> None: ...
 
+class StreamEngine:
+    """Scans many streams in parallel on native worker threads.
+
+    Each flow is pinned to one worker by hashing its identifier, so
+    its chunks are scanned in order by a single thread with that
+    worker's own scratch space. Matches are collected in a
+    completion queue drained with :meth:`poll`, and failed work in a
+    list of errors drained with :meth:`errors`.
+
+    Args:
+        database (:class:`Database`): A database compiled with
+            :const:`HS_MODE_STREAM`. It must not be recompiled while
+            the engine is running.
+        workers (int): Number of worker threads.
+        queue_size (int, optional): Capacity of each worker's queue.
+
+    """
+
+    database: "Database"
+    workers: int
+
+    def __init__(
+        self, database: "Database", workers: int, queue_size: int = 1024
+    ) -> None: ...
+    def scan(self, flow: int, data: ByteString) -> None:
+        """Queues a chunk of data for the stream of a flow.
+
+        The data is copied, so the buffer may be reused immediately.
+        Blocks while the owning worker's queue is full.
+
+        Args:
+            flow (int): Unsigned 64-bit flow identifier. A stream is
+                opened the first time a flow is seen.
+            data (bytes): The chunk of data to scan.
+
+        """
+    def end(self, flow: int) -> None:
+        """Queues closing the stream of a flow, reporting end-of-data
+        matches.
+
+        Args:
+            flow (int): Flow identifier.
+
+        """
+    def flush(self) -> None:
+        """Blocks until all queued work has been processed."""
+    def poll(self) -> List[Tuple[int, int, int, int, int]]:
+        """Drains the completion queue.
+
+        Errors do not discard matches; see :meth:`errors`.
+
+        Returns:
+            list: ``(flow, id, from, to, flags)`` tuples for matches
+            reported since the last call.
+
+        """
+    def errors(self) -> List[Tuple[int, int]]:
+        """Drains the errors of failed work. A flow keeps its stream
+        after an error, and its later chunks are still scanned.
+
+        Returns:
+            list: ``(flow, error)`` tuples, where **error** is the
+            Hyperscan error code, e.g. :const:`HS_NOMEM`, for work that
+            failed since the last call.
+
+        Raises:
+            error: If errors were lost for lack of memory.
+
+        """
+    def close(self) -> None:
+        """Processes queued work, stops the workers, and releases all
+        streams without reporting end-of-data matches."""
+    def __enter__(self) -> Self: ...
+    def __exit__(
+        self,
+        exc_type: Optional[Type[BaseException]],
+        exc_value: Optional[BaseException],
+        exc_traceback: Optional[TracebackType],
+    ) -> None: ...
+
 class Database:
     """Represents a Hyperscan database.
 
@@ -245,13 +680,14 @@ class Database:
     Attributes:
         mode (int): Scanning mode.
         chimera (bool): Indicates if Chimera support is enabled.
-        scratch (:class:`Scratch`): Scratch space.
+        scratch (:class:`Scratch`): Scratch space, allocated on first
+            use if not provided, and again in forked child processes.
 
     """
 
     mode: int
     chimera: bool
-    scratch: Scratch
+    scratch: Optional[Scratch]
 
     def __init__(
         self,
@@ -267,6 +703,8 @@ class Database:
         flags: Union[Optional[Sequence[int]], int] = 0,
         literal: bool = False,
         ext: Optional[Sequence[Tuple[int, int, int, int, int, int]]] = None,
+        platform: Optional[Tuple[int, int]] = None,
+        fold_duplicates: bool = False,
     ) -> None:
         """Compiles regular expressions
         Args:
@@ -280,7 +718,9 @@ class Database:
                 Sequence of flags associated with each expression, or a
                 single value which is applied to all expressions.
             literal (bool, optional): If True, uses the pure literal
-                expression compiler introduced in Hyperscan 5.2.0
+                expression compiler introduced in Hyperscan 5.2.0.
+                Literals are matched byte for byte and may contain NUL
+                bytes.
             ext (sequence of tuple, optional): A list of tuples used to
                 define extended behavior for each pattern. Tuples must
                 contain **flags**, **min_offset**, **max_offset**,
@@ -288,6 +728,31 @@ class Database:
                 **hamming_distance**. See hyperscan documentation for
                 more information. **Note:** this parameter if
                 **literal** is True
+            platform (tuple, optional): The **tune** family and
+                **cpu_features** bitmask of the CPU the database will
+                run on, e.g. a :class:`Platform`. Defaults to the
+                current host. Scratch space for a database compiled for
+                another platform is only allocated on first scan, unless
+                one is assigned: compiling then fails, leaving the
+                database unchanged, if this host cannot scan the result.
+            fold_duplicates (bool, optional): If True, compiles each
+                distinct expression (by bytes, flags and **ext**) once
+                and reports its matches under the ids of all of its
+                duplicates, in order. Ignored for sets using
+                :const:`HS_FLAG_COMBINATION`. Folded databases cannot be
+                serialized.
+
+        """
+    def __reduce_ex__(
+        self, protocol: SupportsIndex
+    ) -> Tuple[Callable[..., "Database"], Tuple[object, ...]]:
+        """Supports pickling compiled block, stream and vectored
+        databases.
+
+        The database is serialized with ``hs_serialize_database``. With
+        pickle protocol 5 the serialized bytes are wrapped in a
+        :class:`pickle.PickleBuffer` so they can be transferred
+        out-of-band. Compiled Chimera databases cannot be pickled.
 
         """
     def info(self) -> str:
@@ -329,15 +794,68 @@ class Database:
                 last arg to **match_event_handler**.
             scratch (:class:`Scratch`, optional): A scratch object.
 
+        """
+    def warmup(self, scratch: Optional[Scratch] = None) -> None:
+        """Prepares the database for low-latency scanning.
+
+        Faults in the pages of the database and of the scratch space,
+        which are otherwise loaded lazily by the first scans after
+        :func:`loadb` or :meth:`compile`, then scans a synthetic block
+        (or stream) to bring the matching engine into the CPU caches.
+        No matches are reported.
+
+        Args:
+            scratch (:class:`Scratch`, optional): Scratch space to warm
+                up instead of the database's own, e.g. the one a worker
+                thread will scan with.
+
+        """
+    def share(self) -> "Database":
+        """Returns a new database that uses the same compiled database.
+
+        The compiled bytes are held once, and freed when neither this
+        database nor any of its shares uses them any more. The new
+        database has its own scratch space and stream arena, and
+        recompiling either database leaves the other unchanged.
+
+        Returns:
+            :class:`Database`: A database of the same type and mode.
+
+        """
+    def set_stream_arena(self, capacity: int) -> None:
+        """Preallocates stream state for streams opened on this database.
+
+        Stream state is carved from a slab of **capacity** fixed-size
+        blocks instead of a heap allocation per stream. Streams opened
+        while the slab is exhausted fall back to the heap.
+
+        Args:
+            capacity (int): Number of stream states to preallocate, or
+                0 to remove the arena.
+
+        """
+    def stream_arena_stats(self) -> Optional[Dict[str, int]]:
+        """Returns stream arena usage statistics.
+
+        Returns:
+            dict: **capacity**, **block_size**, **in_use**, **peak**, and
+            **fallbacks** (heap allocations made because the arena was
+            full), or None if no arena is set.
+
         """
     def stream(
         self,
         match_event_handler: match_event_callback,
         flags: int = 0,
         context: Optional[object] = None,
+        coalesce_size: int = 0,
+        coalesce_writes: int = 0,
+        scratch: Optional[Scratch] = None,
     ) -> Stream:
         """Returns a new stream context manager.
 
+        The database cannot be recompiled while the stream is open.
+
         Args:
             match_event_handler (callable, optional): The match callback,
                 which is invoked for each match result, and passed the
@@ -348,5 +866,741 @@ class Database:
             flags (int): Currently unused.
             context (object): A context object passed as the last
                 arg to **match_event_handler**
+            coalesce_size (int, optional): If non-zero, writes shorter
+                than this many bytes are buffered and scanned together
+                once the buffer fills.
+            coalesce_writes (int, optional): If non-zero, the buffer is
+                also scanned after this many buffered writes.
+            scratch (:class:`Scratch`, optional): Scratch space used by
+                calls on the stream that do not pass their own.
+
+        """
+
+class StreamStore:
+    """Holds many long-lived streams, spilling idle ones to disk.
+
+    Up to **hot_capacity** streams are kept open in memory. When that is
+    exceeded, the least recently used stream is compressed with
+    :meth:`Stream.compress` into a fixed-size slot of a memory-mapped
+    file and closed; it is expanded again the next time its key is
+    scanned. States that do not fit in a slot are kept in memory.
+
+    Args:
+        database (:class:`Database`): A database compiled with
+            :const:`HS_MODE_STREAM`.
+        path (str): Path of the spill file, which is created or
+            truncated.
+        hot_capacity (int, optional): Maximum number of open streams.
+        slot_size (int, optional): Bytes reserved per spilled stream.
+            Defaults to the uncompressed stream state size.
+        match_event_handler (callable, optional): Default match
+            callback for :meth:`scan` and :meth:`end`.
+        context (object, optional): Default context object passed to
+            **match_event_handler**.
+
+    """
+
+    database: Database
+    hot_capacity: int
+    slot_size: int
+
+    def __init__(
+        self,
+        database: Database,
+        path: Union[str, PathLike],
+        hot_capacity: int = 1024,
+        slot_size: Optional[int] = None,
+        match_event_handler: Optional[match_event_callback] = None,
+        context: Optional[object] = None,
+    ) -> None: ...
+    def __enter__(self) -> Self: ...
+    def __exit__(
+        self,
+        exc_type: Optional[Type[BaseException]],
+        exc_value: Optional[BaseException],
+        exc_traceback: Optional[TracebackType],
+    ) -> None: ...
+    def __len__(self) -> int: ...
+    def __contains__(self, key: Hashable) -> bool: ...
+    def scan(
+        self,
+        key: Hashable,
+        data: ByteString,
+        match_event_handler: Optional[match_event_callback] = None,
+        context: Optional[object] = None,
+    ) -> None:
+        """Scans the next chunk of the stream identified by **key**.
+
+        The stream is opened if **key** has not been seen before, or
+        expanded from the spill file if it was evicted.
+
+        Args:
+            key (hashable): Flow identifier.
+            data (bytes): The chunk of data to scan.
+            match_event_handler (callable, optional): Overrides the
+                store's match callback.
+            context (object, optional): Overrides the store's context.
+
+        """
+    def end(
+        self,
+        key: Hashable,
+        match_event_handler: Optional[match_event_callback] = None,
+        context: Optional[object] = None,
+    ) -> None:
+        """Closes the stream identified by **key**, reporting
+        end-of-data matches, and forgets it.
+
+        Args:
+            key (hashable): Flow identifier.
+            match_event_handler (callable, optional): Overrides the
+                store's match callback.
+            context (object, optional): Overrides the store's context.
+
+        """
+    def discard(self, key: Hashable) -> None:
+        """Forgets the stream identified by **key** without reporting
+        end-of-data matches."""
+    def stats(self) -> Dict[str, int]:
+        """Returns store occupancy.
+
+        Returns:
+            dict: **hot** (open streams), **spilled** (streams in the
+            spill file), **overflow** (spilled streams held in memory),
+            and **file_size** in bytes.
+
+        """
+    def close(self) -> None:
+        """Closes all streams without reporting matches and releases the
+        spill file."""
+
+class DatabaseCache:
+    """Caches compiled databases on disk, keyed by their inputs.
+
+    The key hashes the expressions, ids, flags, extended parameters,
+    mode and literal setting together with the Hyperscan version and
+    the host platform. On a hit, the entry is checked with
+    :func:`serialized_database_info` and deserialized with
+    :func:`loadb`; entries that fail either step are recompiled and
+    overwritten.
+
+    Args:
+        directory (str): Directory holding the cache entries, created
+            if missing.
+
+    """
+
+    directory: str
+
+    def __init__(self, directory: Union[str, PathLike]) -> None: ...
+    def key(
+        self,
+        expressions: Sequence[AnyStr],
+        ids: Optional[Sequence[int]] = None,
+        flags: Union[Sequence[int], int] = 0,
+        literal: bool = False,
+        ext: Optional[Sequence[Tuple[int, ...]]] = None,
+        mode: int = ...,
+    ) -> str:
+        """Returns the cache key for a set of :meth:`Database.compile`
+        arguments, as a hex digest."""
+    def compile(
+        self,
+        expressions: Sequence[AnyStr],
+        ids: Optional[Sequence[int]] = None,
+        flags: Union[Sequence[int], int] = 0,
+        literal: bool = False,
+        ext: Optional[Sequence[Tuple[int, ...]]] = None,
+        mode: int = ...,
+    ) -> Database:
+        """Returns a database for the given patterns, compiling and
+        storing it only if no valid cache entry exists.
+
+        Arguments mirror :meth:`Database.compile`, plus the database
+        **mode**.
+
+        """
+    def stats(self) -> Dict[str, int]:
+        """Returns cache effectiveness counters.
+
+        Returns:
+            dict: **hits**, **misses** and **stale** (entries that
+            existed but failed validation and were recompiled).
+
+        """
+    def clear(self) -> None:
+        """Removes all cache entries."""
+
+class InternRegistry:
+    """Shares one compiled database between every caller that compiles
+    the same inputs.
+
+    :meth:`compile` keys its arguments the way :class:`DatabaseCache`
+    does. The first call for a key compiles the database; later calls
+    return a new :class:`Database` created with :meth:`Database.share`,
+    so the compiled bytes are held once no matter how many modules ask
+    for them. An entry is dropped once every database returned for it
+    has been garbage collected.
+
+    """
+
+    def __init__(self) -> None: ...
+    @classmethod
+    def default(cls) -> "InternRegistry":
+        """Returns the process-wide registry."""
+    def compile(
+        self,
+        expressions: Sequence[AnyStr],
+        ids: Optional[Sequence[int]] = None,
+        flags: Union[Sequence[int], int] = 0,
+        literal: bool = False,
+        ext: Optional[Sequence[Tuple[int, ...]]] = None,
+        mode: int = ...,
+        **kwargs: Any,
+    ) -> Database:
+        """Returns a database for the given patterns, compiling them
+        only if no live database was compiled from the same inputs.
+
+        Arguments mirror :meth:`Database.compile`, plus the database
+        **mode**. Concurrent calls for the same inputs compile once.
+
+        """
+    def __len__(self) -> int: ...
+    def stats(self) -> Dict[str, int]:
+        """Returns registry statistics.
+
+        Returns:
+            dict: **entries** (distinct compiled databases held),
+            **live** (databases handed out and still alive), **hits**
+            and **misses**.
+
+        """
+
+class DatabaseRegistry:
+    """Serves many serialized databases, keeping only the recently used
+    ones deserialized.
+
+    Databases are registered by name as serialized bytes or as the path
+    of a file holding them, and are deserialized with their scratch
+    space on first use. Once the resident databases and scratch spaces
+    exceed **budget** bytes, the least recently used are dropped until
+    the total fits again.
+
+    Args:
+        budget (int): Memory budget in bytes for resident databases
+            and their scratch spaces.
+        warmup (bool, optional): Calls :meth:`Database.warmup` on each
+            database as it is loaded.
+
+    """
+
+    budget: int
+    warmup: bool
+
+    def __init__(self, budget: int, warmup: bool = False) -> None: ...
+    def register(
+        self,
+        name: str,
+        source: Union[str, PathLike, ByteString],
+        mode: int = ...,
+    ) -> None:
+        """Registers a serialized database under **name**, replacing
+        any previous registration.
+
+        Args:
+            name (str): Name to look the database up by.
+            source (bytes or str): Serialized database, or the path of
+                a file holding one. Files are read on each load.
+            mode (int, optional): Mode the database was compiled with.
+
+        """
+    def unregister(self, name: str) -> None:
+        """Removes a registration and its resident database."""
+    def get(self, name: str) -> Database:
+        """Returns the named database, loading it if it is not
+        resident.
+
+        Raises:
+            KeyError: If no database is registered under **name**.
+
+        """
+    def scan(self, name: str, data: Any, **kwargs: Any) -> None:
+        """Scans data with the named database, loading it if needed.
+
+        Keyword arguments are passed to :meth:`Database.scan`.
+
+        """
+    def resident(self) -> List[str]:
+        """Returns the names of the resident databases, least recently
+        used first."""
+    def __contains__(self, name: object) -> bool: ...
+    def __len__(self) -> int: ...
+    def stats(self) -> Dict[str, int]:
+        """Returns registry statistics.
+
+        Returns:
+            dict: **registered** and **resident** database counts,
+            **resident_bytes** held by resident databases and their
+            scratch spaces, the **budget**, and the number of **hits**,
+            **loads** and **evictions**.
 
         """
+
+class SharedDatabase:
+    """A database deserialized once into shared memory.
+
+    The database is deserialized with :func:`loadb` directly into a
+    :class:`multiprocessing.shared_memory.SharedMemory` block, so
+    processes forked afterwards, or attached by name with
+    :meth:`attach`, all scan the same physical pages. Each process
+    lazily allocates its own scratch space on first scan, including
+    after :func:`os.fork`.
+
+    Attributes:
+        database (:class:`Database`): The shared database.
+        name (str): Name of the shared memory block.
+
+    """
+
+    database: Database
+    name: str
+
+    @classmethod
+    def create(
+        cls, buf: ByteString, mode: int, name: Optional[str] = None
+    ) -> "SharedDatabase":
+        """Deserializes **buf** into a new shared memory block.
+
+        Args:
+            buf (bytes-like): A serialized database, as returned by
+                :func:`dumpb`.
+            mode (int): The mode of the database.
+            name (str, optional): Name of the shared memory block.
+                Defaults to a random name.
+
+        """
+    @classmethod
+    def attach(cls, name: str, mode: int) -> "SharedDatabase":
+        """Attaches read-only to a block created with :meth:`create` in
+        another process, without copying the database.
+
+        Args:
+            name (str): Name of the shared memory block.
+            mode (int): The mode of the database.
+
+        """
+    def close(self) -> None:
+        """Releases this process's mapping, and removes the block if
+        this process created it (forked children never remove it).
+
+        All other references to :attr:`database` must be dropped
+        first.
+
+        """
+    def __enter__(self) -> Self: ...
+    def __exit__(
+        self,
+        exc_type: Optional[Type[BaseException]],
+        exc_value: Optional[BaseException],
+        exc_traceback: Optional[TracebackType],
+    ) -> None: ...
+
+def as_literal(
+    expression: AnyStr, flags: int = 0
+) -> Optional[Tuple[bytes, int]]:
+    """Returns the string a regular expression matches literally.
+
+    Args:
+        expression (str): A regular expression.
+        flags (int, optional): Its compile flags.
+
+    Returns:
+        tuple: The literal bytes and the flags to compile them with, or
+        None if the expression uses any regular expression syntax or a
+        flag the literal compiler does not support.
+
+    """
+
+class MixedDatabase:
+    """Literal and regular expressions compiled behind one scan.
+
+    :meth:`compile` takes a per-expression **literal** setting and
+    builds up to two databases: the literals with the pure literal
+    compiler, which matches them byte for byte (including NUL bytes)
+    and compiles and scans them faster than escaped regular expressions,
+    and the remaining expressions with the regular expression compiler.
+    Both share one :class:`Scratch`, and :meth:`scan` and :meth:`stream`
+    run them together, reporting matches with the original ids.
+
+    With **auto_literal**, regular expressions that are really plain
+    strings, such as ``foo\\.bar``, are detected with :func:`as_literal`
+    and moved to the literal database as well.
+
+    Matches from the literal database are reported before those from
+    the regular expression database, rather than in overall offset
+    order.
+
+    Args:
+        mode (int, optional): Mode of the databases.
+
+    """
+
+    mode: int
+    def __init__(self, mode: int = ...) -> None: ...
+    @property
+    def databases(self) -> List[Database]:
+        """The compiled databases."""
+    @property
+    def scratch(self) -> Optional[Scratch]:
+        """Scratch space shared by the databases."""
+    def compile(
+        self,
+        expressions: Sequence[AnyStr],
+        ids: Optional[Sequence[int]] = None,
+        flags: Union[Sequence[int], int] = 0,
+        literal: Union[Sequence[bool], bool] = False,
+        ext: Optional[Sequence[Optional[Tuple[int, ...]]]] = None,
+        auto_literal: bool = False,
+    ) -> None:
+        """Compiles the expressions, replacing any previous set.
+
+        Arguments mirror :meth:`Database.compile`, except that
+        **literal** may be a sequence giving the setting for each
+        expression, and **ext** entries may be None. Literal expressions
+        cannot have extended parameters.
+
+        Args:
+            auto_literal (bool, optional): Also compile regular
+                expressions without extended parameters that match a
+                plain string, honoring :const:`HS_FLAG_CASELESS`, with
+                the literal compiler.
+
+        """
+    def scan(
+        self,
+        data: Union[ByteString, List[ByteString]],
+        match_event_handler: Optional[Callable] = None,
+        flags: int = 0,
+        context: Optional[Any] = None,
+        scratch: Optional[Scratch] = None,
+    ) -> None:
+        """Scans data against every database.
+
+        Arguments mirror :meth:`Database.scan`. A **scratch** passed in
+        must fit both databases, e.g. ``mixed.scratch.clone()``.
+
+        """
+    def stream(
+        self,
+        match_event_handler: Optional[Callable] = None,
+        flags: int = 0,
+        context: Optional[Any] = None,
+    ) -> "ShardedStream":
+        """Returns a stream spanning every database.
+
+        Requires :const:`HS_MODE_STREAM`. Arguments mirror
+        :meth:`Database.stream`.
+
+        """
+    def size(self) -> int:
+        """Returns the combined size of the databases in bytes."""
+
+class Partition(NamedTuple):
+    """One database built by :class:`PlannedDatabase`.
+
+    Attributes:
+        som (bool): Whether start of match offsets are tracked.
+        single_match (bool): Whether only the first match of each
+            expression is reported per scan or stream.
+        ids (list of int): Ids of the expressions in the partition.
+        database (:class:`Database`): The compiled partition.
+
+    """
+
+    som: bool
+    single_match: bool
+    ids: List[int]
+    database: Database
+
+class PlannedDatabase:
+    """Partitions expressions by what their matches must report.
+
+    Start of match tracking (:const:`HS_FLAG_SOM_LEFTMOST`) slows down
+    every expression in a database, and reporting every match costs more
+    than reporting the first (:const:`HS_FLAG_SINGLEMATCH`).
+    :meth:`compile` takes these requirements per expression and builds
+    one database for each combination actually used, so expressions that
+    need neither are compiled without either overhead. Scans run every
+    partition with a shared :class:`Scratch` and report matches with the
+    original ids, as :class:`ShardedDatabase` does.
+
+    Expressions without **som** report a start offset of 0. Hyperscan
+    does not support single-match with start of match tracking, so for
+    expressions that need both, repeated matches are filtered out in
+    Python instead.
+
+    Args:
+        mode (int, optional): :const:`HS_MODE_BLOCK`,
+            :const:`HS_MODE_STREAM` or :const:`HS_MODE_VECTORED`.
+        som_horizon (int, optional): ``HS_MODE_SOM_HORIZON_*`` mode used
+            for the streaming partitions that track start of match.
+
+    """
+
+    mode: int
+    som_horizon: int
+    def __init__(self, mode: int = ..., som_horizon: int = ...) -> None: ...
+    @property
+    def partitions(self) -> List[Partition]:
+        """The compiled partitions."""
+    @property
+    def databases(self) -> List[Database]:
+        """The database of every partition."""
+    @property
+    def scratch(self) -> Optional[Scratch]:
+        """Scratch space shared by the partitions."""
+    def compile(
+        self,
+        expressions: Sequence[AnyStr],
+        ids: Optional[Sequence[int]] = None,
+        flags: Union[Sequence[int], int] = 0,
+        ext: Optional[Sequence[Optional[Tuple[int, ...]]]] = None,
+        som: Union[Sequence[bool], bool] = False,
+        all_matches: Union[Sequence[bool], bool] = True,
+    ) -> None:
+        """Plans and compiles the expressions, replacing any previous set.
+
+        Arguments mirror :meth:`Database.compile`, except that **ext**
+        entries may be None. :const:`HS_FLAG_SOM_LEFTMOST` and
+        :const:`HS_FLAG_SINGLEMATCH` in **flags** are treated as the
+        corresponding requirements.
+
+        Args:
+            som (sequence of bool or bool, optional): Whether each
+                expression needs start of match offsets.
+            all_matches (sequence of bool or bool, optional): Whether
+                each expression needs every match, rather than only its
+                first.
+
+        """
+    def scan(
+        self,
+        data: Union[ByteString, List[ByteString]],
+        match_event_handler: Optional[Callable] = None,
+        flags: int = 0,
+        context: Optional[Any] = None,
+        scratch: Optional[Scratch] = None,
+    ) -> None:
+        """Scans data against every partition.
+
+        Arguments mirror :meth:`Database.scan`. A **scratch** passed in
+        must fit every partition, e.g. ``planned.scratch.clone()``.
+
+        """
+    def stream(
+        self,
+        match_event_handler: Optional[Callable] = None,
+        flags: int = 0,
+        context: Optional[Any] = None,
+    ) -> "ShardedStream":
+        """Returns a stream spanning every partition.
+
+        Requires :const:`HS_MODE_STREAM`. Arguments mirror
+        :meth:`Database.stream`; a handler passed to
+        :meth:`ShardedStream.scan` instead bypasses first-match
+        filtering.
+
+        """
+    def size(self) -> int:
+        """Returns the combined size of the partitions in bytes."""
+
+class ShardedDatabase:
+    """A pattern set compiled as several databases in parallel.
+
+    :meth:`compile` partitions the expressions into **shards** groups
+    and compiles each into its own :class:`Database` on a separate
+    thread. Scanning runs every shard over the data with one
+    :class:`Scratch` grown to fit all of them, and reports matches with
+    the original ids, shard by shard.
+
+    :meth:`add_patterns` and :meth:`remove_patterns` update the set by
+    recompiling only the shards they touch. With a **cache**, every
+    shard is compiled through :meth:`DatabaseCache.compile`, so
+    unchanged shards are also reused across restarts.
+
+    Args:
+        mode (int, optional): Mode of the shard databases.
+        shards (int, optional): Number of shards. Defaults to the
+            number of CPUs.
+        cache (:class:`DatabaseCache`, optional): Cache used to compile
+            shards.
+
+    Attributes:
+        databases (list of :class:`Database`): The compiled shards.
+        scratch (:class:`Scratch`): Scratch space shared by all shards.
+
+    """
+
+    mode: int
+    shards: int
+    cache: Optional[DatabaseCache]
+    literal: bool
+    databases: List[Database]
+    scratch: Optional[Scratch]
+
+    def __init__(
+        self,
+        mode: int = ...,
+        shards: Optional[int] = None,
+        cache: Optional[DatabaseCache] = None,
+    ) -> None: ...
+    def compile(
+        self,
+        expressions: Sequence[AnyStr],
+        ids: Optional[Sequence[int]] = None,
+        flags: Union[Sequence[int], int] = 0,
+        literal: bool = False,
+        ext: Optional[Sequence[Tuple[int, ...]]] = None,
+    ) -> None:
+        """Compiles the expressions across shards, replacing any
+        previous pattern set.
+
+        Arguments mirror :meth:`Database.compile`. As there, missing
+        **ids** default to each expression's index.
+
+        """
+    def add_patterns(
+        self,
+        expressions: Sequence[AnyStr],
+        ids: Sequence[int],
+        flags: Union[Sequence[int], int] = 0,
+        ext: Optional[Sequence[Tuple[int, ...]]] = None,
+    ) -> None:
+        """Adds expressions, recompiling only the shards they are
+        assigned to.
+
+        Arguments mirror :meth:`Database.compile`, except that **ids**
+        are required and must be distinct from each other and from the
+        ids already in the set.
+
+        Raises:
+            ValueError: If an id is repeated or already in use.
+
+        """
+    def remove_patterns(self, ids: Iterable[int]) -> None:
+        """Removes every expression with one of the given ids,
+        recompiling only the shards that held them."""
+    def scan(
+        self,
+        data: Union[ByteString, List[ByteString]],
+        match_event_handler: Optional[match_event_callback] = None,
+        flags: int = 0,
+        context: Optional[object] = None,
+        scratch: Optional[Scratch] = None,
+    ) -> None:
+        """Scans data against every shard.
+
+        Arguments mirror :meth:`Database.scan`. A **scratch** passed in
+        must have been extended to fit every shard, e.g. with
+        ``sharded.scratch.clone()``.
+
+        """
+    def stream(
+        self,
+        match_event_handler: Optional[match_event_callback] = None,
+        flags: int = 0,
+        context: Optional[object] = None,
+    ) -> "ShardedStream":
+        """Returns a stream spanning every shard.
+
+        Requires :const:`HS_MODE_STREAM`. Arguments mirror
+        :meth:`Database.stream`.
+
+        """
+    def size(self) -> int:
+        """Returns the combined size of all shards in bytes."""
+
+class ShardedStream:
+    """A stream opened on every shard of a :class:`ShardedDatabase`."""
+
+    streams: List[Stream]
+
+    def __enter__(self) -> Self: ...
+    def __exit__(
+        self,
+        exc_type: Optional[Type[BaseException]],
+        exc_value: Optional[BaseException],
+        exc_traceback: Optional[TracebackType],
+    ) -> None: ...
+    def scan(self, data: ByteString, **kwargs: object) -> None:
+        """Scans the next chunk on every shard. Keyword arguments are
+        passed to :meth:`Stream.scan`."""
+    def close(self, **kwargs: object) -> None:
+        """Closes every shard's stream. Keyword arguments are passed to
+        :meth:`Stream.close`."""
+
+class DatabaseHandle:
+    """Publishes a :class:`Database` that can be replaced while scans
+    continue.
+
+    :meth:`recompile_async` compiles a new database, and its scratch
+    space, on a background thread and then swaps it in atomically.
+    Scans started through the handle keep a reference to the database
+    they began with, so the previous version is only freed once the
+    last of them completes.
+
+    Args:
+        database (:class:`Database`, optional): Initially published
+            database.
+        mode (int, optional): Mode of databases compiled by the handle.
+            Defaults to the mode of **database**, or
+            :const:`HS_MODE_BLOCK`.
+
+    """
+
+    mode: int
+
+    def __init__(
+        self, database: Optional[Database] = None, mode: Optional[int] = None
+    ) -> None: ...
+    @property
+    def database(self) -> Optional[Database]:
+        """The currently published database."""
+    @property
+    def version(self) -> int:
+        """Number of databases published so far."""
+    def compile(self, **kwargs: Any) -> Database:
+        """Compiles and publishes a new database, blocking until done.
+
+        Keyword arguments are passed to :meth:`Database.compile`.
+
+        """
+    def recompile_async(self, **kwargs: Any) -> "Future[Database]":
+        """Compiles a new database in the background and publishes it
+        once ready.
+
+        Keyword arguments are passed to :meth:`Database.compile`. If
+        compilation fails, the current database stays published and the
+        error is raised by the returned future.
+
+        Returns:
+            :class:`concurrent.futures.Future`: Resolves to the newly
+            published database.
+
+        """
+    def scan(self, data: Union[ByteString, List[ByteString]], **kwargs: Any) -> None:
+        """Scans data with the currently published database.
+
+        Keyword arguments are passed to :meth:`Database.scan`.
+
+        """
+    def close(self) -> None:
+        """Waits for pending recompiles and stops the background
+        thread."""
+    def __enter__(self) -> Self: ...
+    def __exit__(
+        self,
+        exc_type: Optional[Type[BaseException]],
+        exc_value: Optional[BaseException],
+        exc_traceback: Optional[TracebackType],
+    ) -> None: ...
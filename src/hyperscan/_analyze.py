@@ -0,0 +1,87 @@
+import os
+import typing
+from concurrent.futures import ThreadPoolExecutor
+
+from hyperscan._hs_ext import expression_info
+
+# Below this many expressions per thread, dispatch costs more than the
+# analysis itself.
+_MIN_BATCH = 64
+
+
+class ExpressionInfo(typing.NamedTuple):
+    """Properties of an expression reported by
+    :func:`analyze_expressions`.
+
+    Attributes:
+        min_width (int): Minimum length in bytes of a match.
+        max_width (int): Maximum length in bytes of a match, or None if
+            unbounded.
+        unordered_matches (bool): Whether matches may be reported out of
+            offset order.
+        matches_at_eod (bool): Whether the expression can match at end
+            of data.
+        matches_only_at_eod (bool): Whether the expression only matches
+            at end of data.
+        error (str): The compiler's message if the expression is
+            invalid, in which case every other field is None.
+
+    """
+
+    min_width: typing.Optional[int]
+    max_width: typing.Optional[int]
+    unordered_matches: typing.Optional[bool]
+    matches_at_eod: typing.Optional[bool]
+    matches_only_at_eod: typing.Optional[bool]
+    error: typing.Optional[str] = None
+
+
+def analyze_expressions(
+    expressions: typing.Sequence[typing.AnyStr],
+    flags: typing.Union[typing.Sequence[int], int] = 0,
+    ext: typing.Optional[
+        typing.Sequence[typing.Optional[typing.Tuple[int, ...]]]
+    ] = None,
+    workers: typing.Optional[int] = None,
+) -> typing.List[ExpressionInfo]:
+    """Analyzes expressions in parallel without compiling a database.
+
+    The expressions are split into contiguous batches that are passed
+    to :func:`expression_info` on separate threads, which release the
+    GIL while Hyperscan analyzes them. Invalid expressions do not stop
+    the batch; their :attr:`ExpressionInfo.error` is set instead, so a
+    whole rule set can be validated in one call.
+
+    Args:
+        expressions (sequence of str): The expressions to analyze.
+        flags (sequence of int or int, optional): Flags for each
+            expression, or a single value applied to all of them.
+        ext (sequence of tuple, optional): Extended parameters for each
+            expression, or None for expressions without any.
+        workers (int, optional): Number of threads. Defaults to the
+            number of CPUs.
+
+    Returns:
+        list of :class:`ExpressionInfo`: One result per expression, in
+        order.
+
+    """
+    count = len(expressions)
+    workers = max(1, min(workers or os.cpu_count() or 1, count // _MIN_BATCH))
+    size = -(-count // workers) if count else 0
+    batches = []
+    for start in range(0, count, size or 1):
+        end = start + size
+        batches.append(
+            (
+                expressions[start:end],
+                flags if isinstance(flags, int) else flags[start:end],
+                None if ext is None else ext[start:end],
+            )
+        )
+    if len(batches) <= 1:
+        results = [expression_info(*batch) for batch in batches]
+    else:
+        with ThreadPoolExecutor(max_workers=len(batches)) as pool:
+            results = list(pool.map(lambda b: expression_info(*b), batches))
+    return [ExpressionInfo._make(item) for batch in results for item in batch]
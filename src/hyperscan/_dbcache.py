@@ -0,0 +1,187 @@
+import hashlib
+import mmap
+import os
+import platform
+import tempfile
+import typing
+
+from hyperscan import _hs_ext
+from hyperscan._hs_ext import (
+    HS_MODE_BLOCK,
+    HS_MODE_STREAM,
+    HS_MODE_VECTORED,
+    Database,
+    dumpb,
+    error,
+    loadb,
+    populate_platform,
+    serialized_database_info,
+)
+
+_SUFFIX = ".hsdb"
+
+
+def _mode_name(mode: int) -> bytes:
+    if mode & HS_MODE_STREAM:
+        return b"STREAM"
+    if mode & HS_MODE_VECTORED:
+        return b"VECTORED"
+    return b"BLOCK"
+
+
+def _hash_inputs(
+    header: tuple,
+    expressions: typing.Sequence[typing.AnyStr],
+    ids: typing.Optional[typing.Sequence[int]],
+    flags: typing.Union[typing.Sequence[int], int],
+    ext: typing.Optional[typing.Sequence[typing.Tuple[int, ...]]],
+) -> str:
+    h = hashlib.sha256()
+    h.update(repr(header).encode())
+    for expression in expressions:
+        if isinstance(expression, str):
+            expression = expression.encode("utf-8")
+        h.update(len(expression).to_bytes(8, "little"))
+        h.update(expression)
+    trailer = (
+        None if ids is None else [int(i) for i in ids],
+        flags if isinstance(flags, int) else [int(f) for f in flags],
+        None if ext is None else [tuple(e) for e in ext],
+    )
+    h.update(repr(trailer).encode())
+    return h.hexdigest()
+
+
+class DatabaseCache:
+    """Caches compiled databases on disk, keyed by their inputs.
+
+    The key hashes the expressions, ids, flags, extended parameters,
+    mode and literal setting together with the Hyperscan version and
+    the host platform, so upgrading the library or moving the cache to
+    a different CPU never yields a mismatched database. On a hit, the
+    entry is checked with :func:`serialized_database_info` and
+    deserialized with :func:`loadb`; entries that fail either step are
+    recompiled and overwritten.
+
+    Chimera databases cannot be serialized and are not supported.
+
+    Args:
+        directory (str): Directory holding the cache entries, created
+            if missing.
+
+    """
+
+    def __init__(self, directory: typing.Union[str, os.PathLike]) -> None:
+        self.directory = os.fspath(directory)
+        os.makedirs(self.directory, exist_ok=True)
+        self._version = _hs_ext.__version__.split()[0]
+        self._platform = (platform.machine(), populate_platform())
+        self._hits = 0
+        self._misses = 0
+        self._stale = 0
+
+    def key(
+        self,
+        expressions: typing.Sequence[typing.AnyStr],
+        ids: typing.Optional[typing.Sequence[int]] = None,
+        flags: typing.Union[typing.Sequence[int], int] = 0,
+        literal: bool = False,
+        ext: typing.Optional[typing.Sequence[typing.Tuple[int, ...]]] = None,
+        mode: int = HS_MODE_BLOCK,
+    ) -> str:
+        """Returns the cache key for a set of :meth:`Database.compile`
+        arguments, as a hex digest."""
+        header = (self._version, self._platform, mode, bool(literal))
+        return _hash_inputs(header, expressions, ids, flags, ext)
+
+    def compile(
+        self,
+        expressions: typing.Sequence[typing.AnyStr],
+        ids: typing.Optional[typing.Sequence[int]] = None,
+        flags: typing.Union[typing.Sequence[int], int] = 0,
+        literal: bool = False,
+        ext: typing.Optional[typing.Sequence[typing.Tuple[int, ...]]] = None,
+        mode: int = HS_MODE_BLOCK,
+    ) -> Database:
+        """Returns a database for the given patterns, compiling and
+        storing it only if no valid cache entry exists.
+
+        Arguments mirror :meth:`Database.compile`, plus the database
+        **mode**.
+
+        """
+        path = os.path.join(
+            self.directory,
+            self.key(expressions, ids, flags, literal, ext, mode) + _SUFFIX,
+        )
+        db = self._load(path, mode)
+        if db is not None:
+            self._hits += 1
+            return db
+        self._misses += 1
+        db = Database(mode=mode)
+        db.compile(
+            expressions=expressions,
+            ids=ids,
+            flags=flags,
+            literal=literal,
+            ext=ext,
+        )
+        self._store(path, dumpb(db))
+        return db
+
+    def stats(self) -> typing.Dict[str, int]:
+        """Returns cache effectiveness counters.
+
+        Returns:
+            dict: **hits**, **misses** and **stale** (entries that
+            existed but failed validation and were recompiled).
+
+        """
+        return {
+            "hits": self._hits,
+            "misses": self._misses,
+            "stale": self._stale,
+        }
+
+    def clear(self) -> None:
+        """Removes all cache entries."""
+        for name in os.listdir(self.directory):
+            if name.endswith(_SUFFIX):
+                os.unlink(os.path.join(self.directory, name))
+
+    def _load(self, path: str, mode: int) -> typing.Optional[Database]:
+        try:
+            f = open(path, "rb")
+        except FileNotFoundError:
+            return None
+        try:
+            # Deserialize straight from the page cache rather than
+            # reading the entry into an intermediate bytes object.
+            with f, mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as buf:
+                info = serialized_database_info(buf).split()
+                if (
+                    info[1].decode() != self._version
+                    or info[-1] != _mode_name(mode)
+                ):
+                    raise error("stale database")
+                return loadb(buf, mode)
+        except (error, IndexError, ValueError):
+            self._stale += 1
+            try:
+                os.unlink(path)
+            except FileNotFoundError:
+                pass
+            return None
+
+    def _store(self, path: str, buf: bytes) -> None:
+        # Write to a temporary file first so that concurrent readers
+        # never see a partial entry.
+        fd, tmp = tempfile.mkstemp(dir=self.directory, suffix=".tmp")
+        try:
+            with os.fdopen(fd, "wb") as f:
+                f.write(buf)
+            os.replace(tmp, path)
+        except BaseException:
+            os.unlink(tmp)
+            raise
@@ -0,0 +1,100 @@
+import threading
+import typing
+from concurrent.futures import Future, ThreadPoolExecutor
+
+from hyperscan._hs_ext import HS_MODE_BLOCK, Database
+
+
+class DatabaseHandle:
+    """Publishes a :class:`Database` that can be replaced while scans
+    continue.
+
+    :meth:`recompile_async` compiles a new database, and its scratch
+    space, on a background thread and then swaps it in atomically.
+    Scans started through the handle keep a reference to the database
+    they began with, so the previous version is only freed once the
+    last of them completes. Rule updates therefore never block or
+    interrupt traffic.
+
+    Args:
+        database (:class:`Database`, optional): Initially published
+            database.
+        mode (int, optional): Mode of databases compiled by the handle.
+            Defaults to the mode of **database**, or
+            :const:`HS_MODE_BLOCK`.
+
+    """
+
+    def __init__(
+        self,
+        database: typing.Optional[Database] = None,
+        mode: typing.Optional[int] = None,
+    ) -> None:
+        if mode is None:
+            mode = database.mode if database is not None else HS_MODE_BLOCK
+        self.mode = mode
+        self._database = database
+        self._version = 0 if database is None else 1
+        self._lock = threading.Lock()
+        # A single worker publishes updates in submission order.
+        self._executor = ThreadPoolExecutor(max_workers=1)
+
+    @property
+    def database(self) -> typing.Optional[Database]:
+        """The currently published database."""
+        return self._database
+
+    @property
+    def version(self) -> int:
+        """Number of databases published so far."""
+        return self._version
+
+    def compile(self, **kwargs: typing.Any) -> Database:
+        """Compiles and publishes a new database, blocking until done.
+
+        Keyword arguments are passed to :meth:`Database.compile`.
+
+        """
+        db = Database(mode=self.mode)
+        db.compile(**kwargs)
+        with self._lock:
+            self._database = db
+            self._version += 1
+        return db
+
+    def recompile_async(self, **kwargs: typing.Any) -> "Future[Database]":
+        """Compiles a new database in the background and publishes it
+        once ready.
+
+        Keyword arguments are passed to :meth:`Database.compile`. If
+        compilation fails, the current database stays published and the
+        error is raised by the returned future.
+
+        Returns:
+            :class:`concurrent.futures.Future`: Resolves to the newly
+            published database.
+
+        """
+        return self._executor.submit(self.compile, **kwargs)
+
+    def scan(self, data: typing.Any, **kwargs: typing.Any) -> None:
+        """Scans data with the currently published database.
+
+        Keyword arguments are passed to :meth:`Database.scan`.
+
+        """
+        db = self._database
+        if db is None:
+            raise RuntimeError("no database has been published")
+        db.scan(data, **kwargs)
+
+    def close(self) -> None:
+        """Waits for pending recompiles and stops the background
+        thread."""
+        self._executor.shutdown(wait=True)
+
+    def __enter__(self) -> "DatabaseHandle":
+        return self
+
+    def __exit__(self, *exc_info) -> None:
+        self.close()
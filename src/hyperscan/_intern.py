@@ -0,0 +1,132 @@
+import threading
+import typing
+import weakref
+
+from hyperscan._dbcache import _hash_inputs
+from hyperscan._hs_ext import HS_MODE_BLOCK, Database
+
+
+class _Entry:
+    __slots__ = ("prototype", "live", "lock")
+
+    def __init__(self) -> None:
+        self.prototype: typing.Optional[Database] = None
+        # Databases handed out, plus compiles in progress.
+        self.live = 0
+        self.lock = threading.Lock()
+
+
+class InternRegistry:
+    """Shares one compiled database between every caller that compiles
+    the same inputs.
+
+    :meth:`compile` keys its arguments the way :class:`DatabaseCache`
+    does. The first call for a key compiles the database; later calls
+    return a new :class:`Database` created with :meth:`Database.share`,
+    so the compiled bytes are held once no matter how many modules ask
+    for them. Each returned database has its own scratch space and can
+    be used, or recompiled, independently. An entry is dropped once
+    every database returned for it has been garbage collected, and the
+    compiled bytes are freed when the last of them is.
+
+    :meth:`default` returns a registry shared by the whole process.
+    Chimera databases cannot be shared and are not supported.
+
+    """
+
+    _default: typing.Optional["InternRegistry"] = None
+    _default_lock = threading.Lock()
+
+    def __init__(self) -> None:
+        self._entries: typing.Dict[str, _Entry] = {}
+        self._lock = threading.Lock()
+        self._hits = 0
+        self._misses = 0
+
+    @classmethod
+    def default(cls) -> "InternRegistry":
+        """Returns the process-wide registry."""
+        with cls._default_lock:
+            if cls._default is None:
+                cls._default = cls()
+            return cls._default
+
+    def compile(
+        self,
+        expressions: typing.Sequence[typing.AnyStr],
+        ids: typing.Optional[typing.Sequence[int]] = None,
+        flags: typing.Union[typing.Sequence[int], int] = 0,
+        literal: bool = False,
+        ext: typing.Optional[typing.Sequence[typing.Tuple[int, ...]]] = None,
+        mode: int = HS_MODE_BLOCK,
+        **kwargs: typing.Any,
+    ) -> Database:
+        """Returns a database for the given patterns, compiling them
+        only if no live database was compiled from the same inputs.
+
+        Arguments mirror :meth:`Database.compile`, plus the database
+        **mode**. Concurrent calls for the same inputs compile once.
+
+        """
+        header = ("intern", mode, bool(literal), sorted(kwargs.items()))
+        key = _hash_inputs(header, expressions, ids, flags, ext)
+        with self._lock:
+            entry = self._entries.get(key)
+            if entry is None:
+                entry = self._entries[key] = _Entry()
+            entry.live += 1
+        try:
+            with entry.lock:
+                if entry.prototype is None:
+                    db = Database(mode=mode)
+                    db.compile(
+                        expressions=expressions,
+                        ids=ids,
+                        flags=flags,
+                        literal=literal,
+                        ext=ext,
+                        **kwargs,
+                    )
+                    # Only the shares scan, each with its own scratch.
+                    db.scratch = None
+                    entry.prototype = db
+                    hit = False
+                else:
+                    hit = True
+                shared = entry.prototype.share()
+        except BaseException:
+            self._release(key, entry)
+            raise
+        with self._lock:
+            if hit:
+                self._hits += 1
+            else:
+                self._misses += 1
+        weakref.finalize(shared, self._release, key, entry)
+        return shared
+
+    def _release(self, key: str, entry: _Entry) -> None:
+        with self._lock:
+            entry.live -= 1
+            if entry.live == 0 and self._entries.get(key) is entry:
+                del self._entries[key]
+
+    def __len__(self) -> int:
+        return len(self._entries)
+
+    def stats(self) -> typing.Dict[str, int]:
+        """Returns registry statistics.
+
+        Returns:
+            dict: **entries** (distinct compiled databases held),
+            **live** (databases handed out and still alive), **hits**
+            and **misses**.
+
+        """
+        with self._lock:
+            return {
+                "entries": len(self._entries),
+                "live": sum(e.live for e in self._entries.values()),
+                "hits": self._hits,
+                "misses": self._misses,
+            }
@@ -0,0 +1,257 @@
+import re
+import typing
+
+from hyperscan._hs_ext import (
+    HS_FLAG_CASELESS,
+    HS_FLAG_DOTALL,
+    HS_FLAG_MULTILINE,
+    HS_FLAG_SINGLEMATCH,
+    HS_FLAG_SOM_LEFTMOST,
+    HS_FLAG_UCP,
+    HS_FLAG_UTF8,
+    HS_MODE_BLOCK,
+    HS_MODE_STREAM,
+    Database,
+    Scratch,
+)
+from hyperscan._sharded import ShardedStream
+
+# Flags the literal compiler understands.
+_LITERAL_FLAGS = (
+    HS_FLAG_CASELESS | HS_FLAG_SINGLEMATCH | HS_FLAG_SOM_LEFTMOST
+)
+# Flags that cannot change what a plain string matches, provided it is
+# ASCII (the Unicode flags alter caseless matching of other characters).
+_NEUTRAL_FLAGS = (
+    HS_FLAG_DOTALL | HS_FLAG_MULTILINE | HS_FLAG_UTF8 | HS_FLAG_UCP
+)
+
+_PLAIN = re.compile(
+    rb"(?:[^\\^$.|?*+()\[\]{}]"
+    rb"|\\[^0-9A-Za-z]"
+    rb"|\\x[0-9A-Fa-f]{2}"
+    rb"|\\[aefnrt])+"
+)
+_ESCAPES = {
+    b"a": b"\a",
+    b"e": b"\x1b",
+    b"f": b"\f",
+    b"n": b"\n",
+    b"r": b"\r",
+    b"t": b"\t",
+}
+_ESCAPE = re.compile(rb"\\(x[0-9A-Fa-f]{2}|.)", re.DOTALL)
+
+
+def _unescape(match: "re.Match[bytes]") -> bytes:
+    escape = match.group(1)
+    if escape[:1] == b"x" and len(escape) == 3:
+        return bytes([int(escape[1:], 16)])
+    return _ESCAPES.get(escape, escape)
+
+
+def as_literal(
+    expression: typing.AnyStr, flags: int = 0
+) -> typing.Optional[typing.Tuple[bytes, int]]:
+    """Returns the string a regular expression matches literally.
+
+    Args:
+        expression (str): A regular expression.
+        flags (int, optional): Its compile flags.
+
+    Returns:
+        tuple: The literal bytes and the flags to compile them with, or
+        None if the expression uses any regular expression syntax or a
+        flag the literal compiler does not support.
+
+    """
+    if isinstance(expression, str):
+        expression = expression.encode("utf-8")
+    if flags & ~(_LITERAL_FLAGS | _NEUTRAL_FLAGS):
+        return None
+    if not _PLAIN.fullmatch(expression):
+        return None
+    literal = _ESCAPE.sub(_unescape, expression)
+    if flags & (HS_FLAG_UTF8 | HS_FLAG_UCP) and not literal.isascii():
+        return None
+    return literal, flags & _LITERAL_FLAGS
+
+
+class MixedDatabase:
+    """Literal and regular expressions compiled behind one scan.
+
+    :meth:`compile` takes a per-expression **literal** setting and
+    builds up to two databases: the literals with the pure literal
+    compiler, which matches them byte for byte (including NUL bytes)
+    and compiles and scans them faster than escaped regular
+    expressions, and the remaining expressions with the regular
+    expression compiler. Both share one :class:`Scratch`, and
+    :meth:`scan` and :meth:`stream` run them together, reporting matches
+    with the original ids.
+
+    With **auto_literal**, regular expressions that are really plain
+    strings, such as ``foo\\.bar``, are detected with :func:`as_literal`
+    and moved to the literal database as well.
+
+    Matches from the literal database are reported before those from
+    the regular expression database, rather than in overall offset
+    order.
+
+    Args:
+        mode (int, optional): Mode of the databases.
+
+    Attributes:
+        databases (list of :class:`Database`): The compiled databases.
+        scratch (:class:`Scratch`): Scratch space shared by them.
+
+    """
+
+    def __init__(self, mode: int = HS_MODE_BLOCK) -> None:
+        self.mode = mode
+        # Swapped as a whole, as in ShardedDatabase.
+        self._state: typing.Tuple[
+            typing.List[Database], typing.Optional[Scratch]
+        ] = ([], None)
+
+    @property
+    def databases(self) -> typing.List[Database]:
+        return self._state[0]
+
+    @property
+    def scratch(self) -> typing.Optional[Scratch]:
+        return self._state[1]
+
+    def compile(
+        self,
+        expressions: typing.Sequence[typing.AnyStr],
+        ids: typing.Optional[typing.Sequence[int]] = None,
+        flags: typing.Union[typing.Sequence[int], int] = 0,
+        literal: typing.Union[typing.Sequence[bool], bool] = False,
+        ext: typing.Optional[
+            typing.Sequence[typing.Optional[typing.Tuple[int, ...]]]
+        ] = None,
+        auto_literal: bool = False,
+    ) -> None:
+        """Compiles the expressions, replacing any previous set.
+
+        Arguments mirror :meth:`Database.compile`, except that
+        **literal** may be a sequence giving the setting for each
+        expression, and **ext** entries may be None. Literal
+        expressions cannot have extended parameters.
+
+        Args:
+            auto_literal (bool, optional): Also compile regular
+                expressions without extended parameters that match a
+                plain string, honoring :const:`HS_FLAG_CASELESS`, with
+                the literal compiler.
+
+        """
+        count = len(expressions)
+        if ids is None:
+            ids = range(count)
+        if isinstance(literal, bool):
+            literal = [literal] * count
+        groups: typing.Dict[bool, typing.Tuple[list, list, list, list]] = {
+            True: ([], [], [], []),
+            False: ([], [], [], []),
+        }
+        for i in range(count):
+            expression = expressions[i]
+            expr_flags = flags if isinstance(flags, int) else flags[i]
+            expr_ext = None if ext is None else ext[i]
+            is_literal = bool(literal[i])
+            if auto_literal and not is_literal and expr_ext is None:
+                plain = as_literal(expression, expr_flags)
+                if plain is not None:
+                    expression, expr_flags = plain
+                    is_literal = True
+            group = groups[is_literal]
+            group[0].append(expression)
+            group[1].append(ids[i])
+            group[2].append(expr_flags)
+            group[3].append(expr_ext)
+
+        databases = []
+        for is_literal, group in groups.items():
+            exprs, group_ids, group_flags, group_ext = group
+            if not exprs:
+                continue
+            if all(e is None for e in group_ext):
+                group_ext = None
+            elif is_literal:
+                raise ValueError(
+                    "literal expressions do not support extended parameters"
+                )
+            else:
+                group_ext = [(0,) * 6 if e is None else e for e in group_ext]
+            db = Database(mode=self.mode)
+            db.compile(
+                expressions=exprs,
+                ids=group_ids,
+                flags=group_flags,
+                literal=is_literal,
+                ext=group_ext,
+            )
+            databases.append(db)
+
+        scratch = None
+        if databases:
+            scratch = Scratch(databases[0])
+            for db in databases[1:]:
+                scratch.extend(db)
+            for db in databases:
+                db.scratch = scratch
+        self._state = (databases, scratch)
+
+    def scan(
+        self,
+        data: typing.Union[typing.ByteString, typing.List[typing.ByteString]],
+        match_event_handler: typing.Optional[typing.Callable] = None,
+        flags: int = 0,
+        context: typing.Optional[object] = None,
+        scratch: typing.Optional[Scratch] = None,
+    ) -> None:
+        """Scans data against every database.
+
+        Arguments mirror :meth:`Database.scan`. A **scratch** passed in
+        must fit both databases, e.g. ``mixed.scratch.clone()``.
+
+        """
+        databases, shared = self._state
+        for db in databases:
+            db.scan(
+                data,
+                match_event_handler=match_event_handler,
+                flags=flags,
+                context=context,
+                scratch=scratch or shared,
+            )
+
+    def stream(
+        self,
+        match_event_handler: typing.Optional[typing.Callable] = None,
+        flags: int = 0,
+        context: typing.Optional[object] = None,
+    ) -> ShardedStream:
+        """Returns a stream spanning every database.
+
+        Requires :const:`HS_MODE_STREAM`. Arguments mirror
+        :meth:`Database.stream`.
+
+        """
+        if not self.mode & HS_MODE_STREAM:
+            raise ValueError("database was not compiled for streaming")
+        return ShardedStream(
+            [
+                db.stream(
+                    match_event_handler=match_event_handler,
+                    flags=flags,
+                    context=context,
+                )
+                for db in self.databases
+            ]
+        )
+
+    def size(self) -> int:
+        """Returns the combined size of the databases in bytes."""
+        return sum(db.size() for db in self.databases)
@@ -0,0 +1,250 @@
+import typing
+
+from hyperscan._hs_ext import (
+    HS_FLAG_SINGLEMATCH,
+    HS_FLAG_SOM_LEFTMOST,
+    HS_MODE_BLOCK,
+    HS_MODE_SOM_HORIZON_LARGE,
+    HS_MODE_STREAM,
+    Database,
+    Scratch,
+)
+from hyperscan._sharded import ShardedStream
+
+
+class Partition(typing.NamedTuple):
+    """One database built by :class:`PlannedDatabase`.
+
+    Attributes:
+        som (bool): Whether start of match offsets are tracked.
+        single_match (bool): Whether only the first match of each
+            expression is reported per scan or stream.
+        ids (list of int): Ids of the expressions in the partition.
+        database (:class:`Database`): The compiled partition.
+
+    """
+
+    som: bool
+    single_match: bool
+    ids: typing.List[int]
+    database: Database
+
+
+def _first_only(
+    callback: typing.Callable, seen: typing.Set[int]
+) -> typing.Callable:
+    # Single-match without HS_FLAG_SINGLEMATCH, which Hyperscan does not
+    # allow together with HS_FLAG_SOM_LEFTMOST.
+    def on_match(id, *args):
+        if id in seen:
+            return None
+        seen.add(id)
+        return callback(id, *args)
+
+    return on_match
+
+
+class PlannedDatabase:
+    """Partitions expressions by what their matches must report.
+
+    Start of match tracking (:const:`HS_FLAG_SOM_LEFTMOST`) slows down
+    every expression in a database, and reporting every match costs
+    more than reporting the first (:const:`HS_FLAG_SINGLEMATCH`).
+    :meth:`compile` takes these requirements per expression and builds
+    one database for each combination actually used, so expressions
+    that need neither are compiled without either overhead. Scans run
+    every partition with a shared :class:`Scratch` and report matches
+    with the original ids, as :class:`ShardedDatabase` does.
+
+    Expressions without **som** report a start offset of 0. Hyperscan
+    does not support single-match with start of match tracking, so for
+    expressions that need both, repeated matches are filtered out in
+    Python instead.
+
+    Args:
+        mode (int, optional): :const:`HS_MODE_BLOCK`,
+            :const:`HS_MODE_STREAM` or :const:`HS_MODE_VECTORED`.
+        som_horizon (int, optional): ``HS_MODE_SOM_HORIZON_*`` mode
+            used for the streaming partitions that track start of
+            match.
+
+    Attributes:
+        partitions (list of :class:`Partition`): The compiled
+            partitions.
+
+    """
+
+    def __init__(
+        self,
+        mode: int = HS_MODE_BLOCK,
+        som_horizon: int = HS_MODE_SOM_HORIZON_LARGE,
+    ) -> None:
+        self.mode = mode
+        self.som_horizon = som_horizon
+        # Swapped as a whole, as in ShardedDatabase.
+        self._state: typing.Tuple[
+            typing.List[Partition], typing.Optional[Scratch]
+        ] = ([], None)
+
+    @property
+    def partitions(self) -> typing.List[Partition]:
+        return self._state[0]
+
+    @property
+    def databases(self) -> typing.List[Database]:
+        return [partition.database for partition in self._state[0]]
+
+    @property
+    def scratch(self) -> typing.Optional[Scratch]:
+        return self._state[1]
+
+    def compile(
+        self,
+        expressions: typing.Sequence[typing.AnyStr],
+        ids: typing.Optional[typing.Sequence[int]] = None,
+        flags: typing.Union[typing.Sequence[int], int] = 0,
+        ext: typing.Optional[
+            typing.Sequence[typing.Optional[typing.Tuple[int, ...]]]
+        ] = None,
+        som: typing.Union[typing.Sequence[bool], bool] = False,
+        all_matches: typing.Union[typing.Sequence[bool], bool] = True,
+    ) -> None:
+        """Plans and compiles the expressions, replacing any previous
+        set.
+
+        Arguments mirror :meth:`Database.compile`, except that **ext**
+        entries may be None. :const:`HS_FLAG_SOM_LEFTMOST` and
+        :const:`HS_FLAG_SINGLEMATCH` in **flags** are treated as the
+        corresponding requirements.
+
+        Args:
+            som (sequence of bool or bool, optional): Whether each
+                expression needs start of match offsets.
+            all_matches (sequence of bool or bool, optional): Whether
+                each expression needs every match, rather than only its
+                first.
+
+        """
+        count = len(expressions)
+        if ids is None:
+            ids = range(count)
+        if isinstance(som, bool):
+            som = [som] * count
+        if isinstance(all_matches, bool):
+            all_matches = [all_matches] * count
+
+        planned: typing.Dict[typing.Tuple[bool, bool], list] = {}
+        for i in range(count):
+            expr_flags = flags if isinstance(flags, int) else flags[i]
+            need_som = bool(som[i] or expr_flags & HS_FLAG_SOM_LEFTMOST)
+            single = not all_matches[i] or bool(
+                expr_flags & HS_FLAG_SINGLEMATCH
+            )
+            expr_flags &= ~(HS_FLAG_SOM_LEFTMOST | HS_FLAG_SINGLEMATCH)
+            if need_som:
+                expr_flags |= HS_FLAG_SOM_LEFTMOST
+            elif single:
+                expr_flags |= HS_FLAG_SINGLEMATCH
+            entry = (
+                ids[i],
+                expressions[i],
+                expr_flags,
+                None if ext is None else ext[i],
+            )
+            planned.setdefault((need_som, single), []).append(entry)
+
+        partitions = []
+        for (need_som, single), entries in sorted(planned.items()):
+            group_ids, exprs, group_flags, group_ext = (
+                list(column) for column in zip(*entries)
+            )
+            if all(e is None for e in group_ext):
+                group_ext = None
+            else:
+                group_ext = [(0,) * 6 if e is None else e for e in group_ext]
+            mode = self.mode
+            if need_som and mode & HS_MODE_STREAM:
+                mode |= self.som_horizon
+            db = Database(mode=mode)
+            db.compile(
+                expressions=exprs,
+                ids=group_ids,
+                flags=group_flags,
+                ext=group_ext,
+            )
+            partitions.append(Partition(need_som, single, group_ids, db))
+
+        scratch = None
+        if partitions:
+            scratch = Scratch(partitions[0].database)
+            for partition in partitions[1:]:
+                scratch.extend(partition.database)
+            for partition in partitions:
+                partition.database.scratch = scratch
+        self._state = (partitions, scratch)
+
+    def _handler(
+        self,
+        partition: Partition,
+        callback: typing.Optional[typing.Callable],
+    ) -> typing.Optional[typing.Callable]:
+        if callback is not None and partition.som and partition.single_match:
+            return _first_only(callback, set())
+        return callback
+
+    def scan(
+        self,
+        data: typing.Union[typing.ByteString, typing.List[typing.ByteString]],
+        match_event_handler: typing.Optional[typing.Callable] = None,
+        flags: int = 0,
+        context: typing.Optional[object] = None,
+        scratch: typing.Optional[Scratch] = None,
+    ) -> None:
+        """Scans data against every partition.
+
+        Arguments mirror :meth:`Database.scan`. A **scratch** passed in
+        must fit every partition, e.g. ``planned.scratch.clone()``.
+
+        """
+        partitions, shared = self._state
+        for partition in partitions:
+            partition.database.scan(
+                data,
+                match_event_handler=self._handler(partition, match_event_handler),
+                flags=flags,
+                context=context,
+                scratch=scratch or shared,
+            )
+
+    def stream(
+        self,
+        match_event_handler: typing.Optional[typing.Callable] = None,
+        flags: int = 0,
+        context: typing.Optional[object] = None,
+    ) -> ShardedStream:
+        """Returns a stream spanning every partition.
+
+        Requires :const:`HS_MODE_STREAM`. Arguments mirror
+        :meth:`Database.stream`; a handler passed to
+        :meth:`ShardedStream.scan` instead bypasses first-match
+        filtering.
+
+        """
+        if not self.mode & HS_MODE_STREAM:
+            raise ValueError("database was not compiled for streaming")
+        return ShardedStream(
+            [
+                partition.database.stream(
+                    match_event_handler=self._handler(
+                        partition, match_event_handler
+                    ),
+                    flags=flags,
+                    context=context,
+                )
+                for partition in self.partitions
+            ]
+        )
+
+    def size(self) -> int:
+        """Returns the combined size of the partitions in bytes."""
+        return sum(db.size() for db in self.databases)
@@ -0,0 +1,190 @@
+import collections
+import mmap
+import os
+import threading
+import typing
+
+from hyperscan._hs_ext import HS_MODE_BLOCK, Database, Scratch, loadb
+
+_Source = typing.Union[str, os.PathLike, bytes, bytearray, memoryview]
+
+
+class _Registration(typing.NamedTuple):
+    source: _Source
+    mode: int
+    lock: threading.Lock
+
+
+class DatabaseRegistry:
+    """Serves many serialized databases, keeping only the recently used
+    ones deserialized.
+
+    Databases are registered by name as serialized bytes (see
+    :func:`dumpb`) or as the path of a file holding them, and are only
+    deserialized, together with their scratch space, by the first
+    :meth:`get` or :meth:`scan` that needs them. Once the resident
+    databases and scratch spaces exceed **budget** bytes, the least
+    recently used are dropped until the total fits again; the next use
+    loads them anew. A database larger than the budget on its own is
+    still loaded, and evicts every other.
+
+    Evicting a database only drops the registry's reference, so scans
+    already holding it complete normally.
+
+    Args:
+        budget (int): Memory budget in bytes for resident databases
+            and their scratch spaces.
+        warmup (bool, optional): Calls :meth:`Database.warmup` on each
+            database as it is loaded, so its first scan runs at full
+            speed.
+
+    """
+
+    def __init__(self, budget: int, warmup: bool = False) -> None:
+        if budget < 0:
+            raise ValueError("budget must not be negative")
+        self.budget = budget
+        self.warmup = warmup
+        self._sources: typing.Dict[str, _Registration] = {}
+        # Least recently used first, mapped to (database, bytes held).
+        self._resident: (
+            "collections.OrderedDict[str, typing.Tuple[Database, int]]"
+        ) = collections.OrderedDict()
+        self._resident_bytes = 0
+        self._lock = threading.Lock()
+        self._hits = 0
+        self._loads = 0
+        self._evictions = 0
+
+    def register(
+        self, name: str, source: _Source, mode: int = HS_MODE_BLOCK
+    ) -> None:
+        """Registers a serialized database under **name**, replacing
+        any previous registration.
+
+        Args:
+            name (str): Name to look the database up by.
+            source (bytes or str): Serialized database, or the path of
+                a file holding one. Files are read on each load.
+            mode (int, optional): Mode the database was compiled with.
+
+        """
+        if isinstance(source, (bytearray, memoryview)):
+            source = bytes(source)
+        with self._lock:
+            self._sources[name] = _Registration(
+                source, mode, threading.Lock()
+            )
+            self._drop(name)
+
+    def unregister(self, name: str) -> None:
+        """Removes a registration and its resident database."""
+        with self._lock:
+            del self._sources[name]
+            self._drop(name)
+
+    def get(self, name: str) -> Database:
+        """Returns the named database, loading it if it is not
+        resident.
+
+        Raises:
+            KeyError: If no database is registered under **name**.
+
+        """
+        with self._lock:
+            db = self._touch(name)
+            if db is not None:
+                return db
+            registration = self._sources[name]
+        # Loads of different databases proceed in parallel; concurrent
+        # loads of the same one wait for the first.
+        with registration.lock:
+            with self._lock:
+                db = self._touch(name)
+                if db is not None:
+                    return db
+            db = self._load(registration.source, registration.mode)
+            scratch = Scratch(db)
+            db.scratch = scratch
+            if self.warmup:
+                db.warmup()
+            cost = db.size() + scratch.size()
+            with self._lock:
+                self._loads += 1
+                # Skip caching if unregistered or replaced meanwhile.
+                if self._sources.get(name) is registration:
+                    self._resident[name] = (db, cost)
+                    self._resident_bytes += cost
+                    self._evict()
+        return db
+
+    def scan(self, name: str, data: typing.Any, **kwargs: typing.Any) -> None:
+        """Scans data with the named database, loading it if needed.
+
+        Keyword arguments are passed to :meth:`Database.scan`.
+
+        """
+        self.get(name).scan(data, **kwargs)
+
+    def resident(self) -> typing.List[str]:
+        """Returns the names of the resident databases, least recently
+        used first."""
+        with self._lock:
+            return list(self._resident)
+
+    def __contains__(self, name: object) -> bool:
+        return name in self._sources
+
+    def __len__(self) -> int:
+        return len(self._sources)
+
+    def stats(self) -> typing.Dict[str, int]:
+        """Returns registry statistics.
+
+        Returns:
+            dict: **registered** and **resident** database counts,
+            **resident_bytes** held by resident databases and their
+            scratch spaces, the **budget**, and the number of **hits**,
+            **loads** and **evictions**.
+
+        """
+        with self._lock:
+            return {
+                "registered": len(self._sources),
+                "resident": len(self._resident),
+                "resident_bytes": self._resident_bytes,
+                "budget": self.budget,
+                "hits": self._hits,
+                "loads": self._loads,
+                "evictions": self._evictions,
+            }
+
+    def _touch(self, name: str) -> typing.Optional[Database]:
+        entry = self._resident.get(name)
+        if entry is None:
+            return None
+        self._resident.move_to_end(name)
+        self._hits += 1
+        return entry[0]
+
+    def _drop(self, name: str) -> None:
+        entry = self._resident.pop(name, None)
+        if entry is not None:
+            self._resident_bytes -= entry[1]
+
+    def _evict(self) -> None:
+        # The most recently loaded database always stays.
+        while self._resident_bytes > self.budget and len(self._resident) > 1:
+            _, (_, cost) = self._resident.popitem(last=False)
+            self._resident_bytes -= cost
+            self._evictions += 1
+
+    @staticmethod
+    def _load(source: _Source, mode: int) -> Database:
+        if not isinstance(source, (str, os.PathLike)):
+            return loadb(source, mode)
+        # Deserialize straight from the page cache, as DatabaseCache does.
+        with open(source, "rb") as f, mmap.mmap(
+            f.fileno(), 0, access=mmap.ACCESS_READ
+        ) as buf:
+            return loadb(buf, mode)
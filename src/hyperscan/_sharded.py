@@ -0,0 +1,314 @@
+import heapq
+import os
+import typing
+from concurrent.futures import ThreadPoolExecutor
+
+from hyperscan._dbcache import DatabaseCache
+from hyperscan._hs_ext import (
+    HS_MODE_BLOCK,
+    HS_MODE_STREAM,
+    Database,
+    Scratch,
+)
+
+
+_Entry = typing.Tuple[int, typing.AnyStr, int, typing.Optional[tuple]]
+
+
+def _make_entries(
+    expressions: typing.Sequence[typing.AnyStr],
+    ids: typing.Optional[typing.Sequence[int]],
+    flags: typing.Union[typing.Sequence[int], int],
+    ext: typing.Optional[typing.Sequence[typing.Tuple[int, ...]]],
+) -> typing.List[_Entry]:
+    if ids is None:
+        ids = range(len(expressions))
+    return [
+        (
+            ids[i],
+            expressions[i],
+            flags if isinstance(flags, int) else flags[i],
+            None if ext is None else tuple(ext[i]),
+        )
+        for i in range(len(expressions))
+    ]
+
+
+def _cost(entries: typing.Iterable[_Entry]) -> int:
+    # Expression length is a rough proxy for compile cost.
+    return sum(len(entry[1]) + 1 for entry in entries)
+
+
+class ShardedDatabase:
+    """A pattern set compiled as several databases in parallel.
+
+    :meth:`compile` partitions the expressions into **shards** groups
+    and compiles each into its own :class:`Database` on a separate
+    thread; the GIL is released while Hyperscan compiles, so compile
+    time scales with the number of cores. Scanning runs every shard over
+    the data with one :class:`Scratch` that is grown to fit all of them,
+    and reports matches with the original ids.
+
+    Matches are reported shard by shard rather than in overall offset
+    order, and each scan costs roughly one pass per shard.
+
+    :meth:`add_patterns` and :meth:`remove_patterns` update the set by
+    recompiling only the shards they touch. With a **cache**, every
+    shard is compiled through :meth:`DatabaseCache.compile`, so
+    unchanged shards are also reused across restarts.
+
+    Args:
+        mode (int, optional): Mode of the shard databases.
+        shards (int, optional): Number of shards. Defaults to the
+            number of CPUs.
+        cache (:class:`DatabaseCache`, optional): Cache used to compile
+            shards.
+
+    Attributes:
+        databases (list of :class:`Database`): The compiled shards.
+        scratch (:class:`Scratch`): Scratch space shared by all shards.
+
+    """
+
+    def __init__(
+        self,
+        mode: int = HS_MODE_BLOCK,
+        shards: typing.Optional[int] = None,
+        cache: typing.Optional[DatabaseCache] = None,
+    ) -> None:
+        self.mode = mode
+        self.shards = shards or os.cpu_count() or 1
+        if self.shards < 1:
+            raise ValueError("shards must be positive")
+        self.cache = cache
+        self.literal = False
+        self._entries: typing.List[typing.List[_Entry]] = [
+            [] for _ in range(self.shards)
+        ]
+        self._compiled: typing.List[typing.Optional[Database]] = [
+            None
+        ] * self.shards
+        # Swapped as a whole so that concurrent scans always see shards
+        # and a scratch that belong together.
+        self._state: typing.Tuple[
+            typing.List[Database], typing.Optional[Scratch]
+        ] = ([], None)
+
+    @property
+    def databases(self) -> typing.List[Database]:
+        return self._state[0]
+
+    @property
+    def scratch(self) -> typing.Optional[Scratch]:
+        return self._state[1]
+
+    def compile(
+        self,
+        expressions: typing.Sequence[typing.AnyStr],
+        ids: typing.Optional[typing.Sequence[int]] = None,
+        flags: typing.Union[typing.Sequence[int], int] = 0,
+        literal: bool = False,
+        ext: typing.Optional[typing.Sequence[typing.Tuple[int, ...]]] = None,
+    ) -> None:
+        """Compiles the expressions across shards, replacing any
+        previous pattern set.
+
+        Arguments mirror :meth:`Database.compile`. As there, missing
+        **ids** default to each expression's index.
+
+        """
+        entries = _make_entries(expressions, ids, flags, ext)
+        previous = self._entries, self.literal
+        self._entries = [[] for _ in range(self.shards)]
+        self.literal = literal
+        self._assign(entries)
+        try:
+            self._rebuild(set(range(self.shards)))
+        except BaseException:
+            self._entries, self.literal = previous
+            raise
+
+    def add_patterns(
+        self,
+        expressions: typing.Sequence[typing.AnyStr],
+        ids: typing.Sequence[int],
+        flags: typing.Union[typing.Sequence[int], int] = 0,
+        ext: typing.Optional[typing.Sequence[typing.Tuple[int, ...]]] = None,
+    ) -> None:
+        """Adds expressions, recompiling only the shards they are
+        assigned to.
+
+        Arguments mirror :meth:`Database.compile`, except that **ids**
+        are required and must be distinct from each other and from the
+        ids already in the set, so that :meth:`remove_patterns` can tell
+        the expressions apart.
+
+        Raises:
+            ValueError: If an id is repeated or already in use.
+
+        """
+        entries = _make_entries(expressions, ids, flags, ext)
+        existing = {entry[0] for shard in self._entries for entry in shard}
+        added: typing.Set[int] = set()
+        for entry in entries:
+            if entry[0] in existing or entry[0] in added:
+                raise ValueError(f"expression id {entry[0]} is already in use")
+            added.add(entry[0])
+        previous = [list(entries) for entries in self._entries]
+        try:
+            self._rebuild(self._assign(entries))
+        except BaseException:
+            self._entries = previous
+            raise
+
+    def remove_patterns(self, ids: typing.Iterable[int]) -> None:
+        """Removes every expression with one of the given ids,
+        recompiling only the shards that held them."""
+        ids = set(ids)
+        previous = list(self._entries)
+        changed = set()
+        for shard, entries in enumerate(self._entries):
+            kept = [entry for entry in entries if entry[0] not in ids]
+            if len(kept) != len(entries):
+                self._entries[shard] = kept
+                changed.add(shard)
+        try:
+            self._rebuild(changed)
+        except BaseException:
+            self._entries = previous
+            raise
+
+    def _assign(self, entries: typing.List[_Entry]) -> typing.Set[int]:
+        # Longest expressions first onto the lightest shard.
+        heap = [
+            (_cost(shard_entries), shard)
+            for shard, shard_entries in enumerate(self._entries)
+        ]
+        heapq.heapify(heap)
+        changed = set()
+        for entry in sorted(entries, key=lambda e: len(e[1]), reverse=True):
+            load, shard = heapq.heappop(heap)
+            self._entries[shard].append(entry)
+            changed.add(shard)
+            heapq.heappush(heap, (load + len(entry[1]) + 1, shard))
+        return changed
+
+    def _build(self, shard: int) -> typing.Optional[Database]:
+        entries = self._entries[shard]
+        if not entries:
+            return None
+        ids, expressions, flags, ext = (list(c) for c in zip(*entries))
+        if all(e is None for e in ext):
+            ext = None
+        elif any(e is None for e in ext):
+            ext = [(0,) * 6 if e is None else e for e in ext]
+        kwargs = dict(
+            expressions=expressions,
+            ids=ids,
+            flags=flags,
+            literal=self.literal,
+            ext=ext,
+        )
+        if self.cache is not None:
+            return self.cache.compile(mode=self.mode, **kwargs)
+        db = Database(mode=self.mode)
+        db.compile(**kwargs)
+        return db
+
+    def _rebuild(self, changed: typing.Set[int]) -> None:
+        if changed:
+            shards = sorted(changed)
+            with ThreadPoolExecutor(max_workers=len(shards)) as pool:
+                built = list(pool.map(self._build, shards))
+            for shard, db in zip(shards, built):
+                self._compiled[shard] = db
+        databases = [db for db in self._compiled if db is not None]
+        scratch = None
+        if databases:
+            scratch = Scratch(databases[0])
+            for db in databases[1:]:
+                scratch.extend(db)
+            for db in databases:
+                db.scratch = scratch
+        self._state = (databases, scratch)
+
+    def scan(
+        self,
+        data: typing.Union[typing.ByteString, typing.List[typing.ByteString]],
+        match_event_handler: typing.Optional[typing.Callable] = None,
+        flags: int = 0,
+        context: typing.Optional[object] = None,
+        scratch: typing.Optional[Scratch] = None,
+    ) -> None:
+        """Scans data against every shard.
+
+        Arguments mirror :meth:`Database.scan`. A **scratch** passed in
+        must have been extended to fit every shard, e.g. with
+        ``sharded.scratch.clone()``.
+
+        """
+        databases, shared = self._state
+        for db in databases:
+            db.scan(
+                data,
+                match_event_handler=match_event_handler,
+                flags=flags,
+                context=context,
+                scratch=scratch or shared,
+            )
+
+    def stream(
+        self,
+        match_event_handler: typing.Optional[typing.Callable] = None,
+        flags: int = 0,
+        context: typing.Optional[object] = None,
+    ) -> "ShardedStream":
+        """Returns a stream spanning every shard.
+
+        Requires :const:`HS_MODE_STREAM`. Arguments mirror
+        :meth:`Database.stream`.
+
+        """
+        if not self.mode & HS_MODE_STREAM:
+            raise ValueError("database was not compiled for streaming")
+        return ShardedStream(
+            [
+                db.stream(
+                    match_event_handler=match_event_handler,
+                    flags=flags,
+                    context=context,
+                )
+                for db in self.databases
+            ]
+        )
+
+    def size(self) -> int:
+        """Returns the combined size of all shards in bytes."""
+        return sum(db.size() for db in self.databases)
+
+
+class ShardedStream:
+    """A stream opened on every shard of a :class:`ShardedDatabase`."""
+
+    def __init__(self, streams: typing.List[typing.Any]) -> None:
+        self.streams = streams
+
+    def __enter__(self) -> "ShardedStream":
+        for stream in self.streams:
+            stream.__enter__()
+        return self
+
+    def __exit__(self, *exc_info) -> None:
+        self.close()
+
+    def scan(self, data: typing.ByteString, **kwargs: typing.Any) -> None:
+        """Scans the next chunk on every shard. Keyword arguments are
+        passed to :meth:`Stream.scan`."""
+        for stream in self.streams:
+            stream.scan(data, **kwargs)
+
+    def close(self, **kwargs: typing.Any) -> None:
+        """Closes every shard's stream. Keyword arguments are passed to
+        :meth:`Stream.close`."""
+        for stream in self.streams:
+            stream.close(**kwargs)
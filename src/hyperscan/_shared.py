@@ -0,0 +1,142 @@
+import mmap
+import os
+import sys
+import typing
+from multiprocessing import shared_memory
+
+from hyperscan._hs_ext import (
+    Database,
+    attach,
+    loadb,
+    serialized_database_size,
+)
+
+
+class _ReadOnlyMapping:
+    """Maps an existing POSIX shared memory block read-only.
+
+    Unlike :class:`multiprocessing.shared_memory.SharedMemory`, this
+    does not register the block with the resource tracker, which would
+    otherwise unlink it when the attaching process exits.
+    """
+
+    def __init__(self, name: str) -> None:
+        import _posixshmem
+
+        self.name = name
+        fd = _posixshmem.shm_open("/" + name.lstrip("/"), os.O_RDONLY)
+        try:
+            self._mmap = mmap.mmap(
+                fd, os.fstat(fd).st_size, prot=mmap.PROT_READ
+            )
+        finally:
+            os.close(fd)
+        self.buf = memoryview(self._mmap)
+
+    def close(self) -> None:
+        self.buf.release()
+        self._mmap.close()
+
+
+class SharedDatabase:
+    """A database deserialized once into shared memory.
+
+    The database is deserialized with :func:`loadb` directly into a
+    :class:`multiprocessing.shared_memory.SharedMemory` block, so
+    processes forked afterwards, or attached by name with
+    :meth:`attach`, all scan the same physical pages. Each process
+    lazily allocates its own scratch space on first scan, including
+    after :func:`os.fork`.
+
+    Use :meth:`create` or :meth:`attach` rather than the constructor.
+
+    Attributes:
+        database (:class:`Database`): The shared database.
+        name (str): Name of the shared memory block.
+
+    """
+
+    def __init__(
+        self,
+        shm: typing.Any,
+        database: Database,
+        owner: bool,
+    ) -> None:
+        self._shm = shm
+        self.database = database
+        self.name = shm.name
+        # Forked children inherit this object but must not unlink.
+        self._owner_pid = os.getpid() if owner else None
+
+    @classmethod
+    def create(
+        cls,
+        buf: typing.ByteString,
+        mode: int,
+        name: typing.Optional[str] = None,
+    ) -> "SharedDatabase":
+        """Deserializes **buf** into a new shared memory block.
+
+        Args:
+            buf (bytes-like): A serialized database, as returned by
+                :func:`dumpb`.
+            mode (int): The mode of the database.
+            name (str, optional): Name of the shared memory block.
+                Defaults to a random name.
+
+        """
+        size = serialized_database_size(buf)
+        shm = shared_memory.SharedMemory(name=name, create=True, size=size)
+        try:
+            database = loadb(buf, mode, into=shm.buf)
+        except BaseException:
+            shm.close()
+            shm.unlink()
+            raise
+        return cls(shm, database, owner=True)
+
+    @classmethod
+    def attach(cls, name: str, mode: int) -> "SharedDatabase":
+        """Attaches read-only to a block created with :meth:`create` in
+        another process, without copying the database.
+
+        Args:
+            name (str): Name of the shared memory block.
+            mode (int): The mode of the database.
+
+        """
+        if sys.platform == "win32":
+            shm = shared_memory.SharedMemory(name=name)
+            buf = shm.buf.toreadonly()
+        else:
+            shm = _ReadOnlyMapping(name)
+            buf = shm.buf
+        try:
+            database = attach(buf, mode)
+        except BaseException:
+            del buf
+            shm.close()
+            raise
+        return cls(shm, database, owner=False)
+
+    def __enter__(self) -> "SharedDatabase":
+        return self
+
+    def __exit__(self, *exc_info) -> None:
+        self.close()
+
+    def close(self) -> None:
+        """Releases this process's mapping, and removes the block if
+        this process created it (forked children never remove it).
+
+        All other references to :attr:`database` must be dropped
+        first.
+
+        """
+        if self._shm is None:
+            return
+        self.database = None
+        self._shm.close()
+        if self._owner_pid == os.getpid():
+            self._shm.unlink()
+        self._shm = None
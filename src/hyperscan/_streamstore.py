@@ -0,0 +1,224 @@
+import collections
+import mmap
+import os
+import struct
+import typing
+
+from hyperscan._hs_ext import Database, Stream
+
+_LENGTH = struct.Struct("<I")
+
+
+class StreamStore:
+    """Holds many long-lived streams, spilling idle ones to disk.
+
+    Up to **hot_capacity** streams are kept open in memory. When that is
+    exceeded, the least recently used stream is compressed with
+    :meth:`Stream.compress` into a fixed-size slot of a memory-mapped
+    file and closed; it is expanded again the next time its key is
+    scanned. States that do not fit in a slot are kept in memory.
+
+    Args:
+        database (:class:`Database`): A database compiled with
+            :const:`HS_MODE_STREAM`.
+        path (str): Path of the spill file, which is created or
+            truncated.
+        hot_capacity (int, optional): Maximum number of open streams.
+        slot_size (int, optional): Bytes reserved per spilled stream.
+            Defaults to the uncompressed stream state size.
+        match_event_handler (callable, optional): Default match
+            callback for :meth:`scan` and :meth:`end`.
+        context (object, optional): Default context object passed to
+            **match_event_handler**.
+
+    """
+
+    def __init__(
+        self,
+        database: Database,
+        path: typing.Union[str, os.PathLike],
+        hot_capacity: int = 1024,
+        slot_size: typing.Optional[int] = None,
+        match_event_handler: typing.Optional[typing.Callable] = None,
+        context: typing.Optional[object] = None,
+    ) -> None:
+        if hot_capacity < 1:
+            raise ValueError("hot_capacity must be positive")
+        self.database = database
+        self.hot_capacity = hot_capacity
+        self.match_event_handler = match_event_handler
+        self.context = context
+        if slot_size is None:
+            probe = database.stream(match_event_handler=None)
+            slot_size = len(probe)
+        self.slot_size = _LENGTH.size + slot_size
+        self._hot: "collections.OrderedDict[typing.Hashable, Stream]" = (
+            collections.OrderedDict()
+        )
+        self._slots: typing.Dict[typing.Hashable, int] = {}
+        self._overflow: typing.Dict[typing.Hashable, bytes] = {}
+        self._free: typing.List[int] = []
+        self._num_slots = 0
+        self._file = open(path, "w+b")
+        self._map: typing.Optional[mmap.mmap] = None
+
+    def __enter__(self) -> "StreamStore":
+        return self
+
+    def __exit__(self, *exc_info) -> None:
+        self.close()
+
+    def __len__(self) -> int:
+        return len(self._hot) + len(self._slots) + len(self._overflow)
+
+    def __contains__(self, key: typing.Hashable) -> bool:
+        return key in self._hot or key in self._slots or key in self._overflow
+
+    def scan(
+        self,
+        key: typing.Hashable,
+        data: typing.ByteString,
+        match_event_handler: typing.Optional[typing.Callable] = None,
+        context: typing.Optional[object] = None,
+    ) -> None:
+        """Scans the next chunk of the stream identified by **key**.
+
+        The stream is opened if **key** has not been seen before, or
+        expanded from the spill file if it was evicted.
+
+        Args:
+            key (hashable): Flow identifier.
+            data (bytes): The chunk of data to scan.
+            match_event_handler (callable, optional): Overrides the
+                store's match callback.
+            context (object, optional): Overrides the store's context.
+
+        """
+        self._checkout(key).scan(
+            data,
+            match_event_handler=match_event_handler
+            or self.match_event_handler,
+            context=context if context is not None else self.context,
+        )
+
+    def end(
+        self,
+        key: typing.Hashable,
+        match_event_handler: typing.Optional[typing.Callable] = None,
+        context: typing.Optional[object] = None,
+    ) -> None:
+        """Closes the stream identified by **key**, reporting
+        end-of-data matches, and forgets it.
+
+        Args:
+            key (hashable): Flow identifier.
+            match_event_handler (callable, optional): Overrides the
+                store's match callback.
+            context (object, optional): Overrides the store's context.
+
+        """
+        if key not in self:
+            raise KeyError(key)
+        stream = self._checkout(key)
+        del self._hot[key]
+        stream.close(
+            match_event_handler=match_event_handler
+            or self.match_event_handler,
+            context=context if context is not None else self.context,
+        )
+
+    def discard(self, key: typing.Hashable) -> None:
+        """Forgets the stream identified by **key** without reporting
+        end-of-data matches."""
+        stream = self._hot.pop(key, None)
+        if stream is not None:
+            stream.close()
+        elif key in self._slots:
+            self._free.append(self._slots.pop(key))
+        else:
+            self._overflow.pop(key, None)
+
+    def stats(self) -> typing.Dict[str, int]:
+        """Returns store occupancy.
+
+        Returns:
+            dict: **hot** (open streams), **spilled** (streams in the
+            spill file), **overflow** (spilled streams held in memory),
+            and **file_size** in bytes.
+
+        """
+        return {
+            "hot": len(self._hot),
+            "spilled": len(self._slots),
+            "overflow": len(self._overflow),
+            "file_size": self._num_slots * self.slot_size,
+        }
+
+    def close(self) -> None:
+        """Closes all streams without reporting matches and releases the
+        spill file."""
+        while self._hot:
+            self._hot.popitem()[1].close()
+        self._slots.clear()
+        self._overflow.clear()
+        self._free.clear()
+        if self._map is not None:
+            self._map.close()
+            self._map = None
+        self._file.close()
+
+    def _checkout(self, key: typing.Hashable) -> Stream:
+        stream = self._hot.get(key)
+        if stream is not None:
+            self._hot.move_to_end(key)
+            return stream
+        stream = self.database.stream(match_event_handler=None)
+        # Spilled state is only forgotten once expanded, so that a
+        # failure leaves the stream where it was.
+        slot = self._slots.get(key)
+        if slot is not None:
+            offset = slot * self.slot_size
+            (length,) = _LENGTH.unpack_from(self._map, offset)
+            start = offset + _LENGTH.size
+            stream.expand(self._map[start : start + length])
+            del self._slots[key]
+            self._free.append(slot)
+        elif key in self._overflow:
+            stream.expand(self._overflow[key])
+            del self._overflow[key]
+        else:
+            stream.__enter__()
+        self._hot[key] = stream
+        while len(self._hot) > self.hot_capacity:
+            self._spill()
+        return stream
+
+    def _spill(self) -> None:
+        # The least recently used stream stays open until its state has
+        # been stored.
+        key, stream = next(iter(self._hot.items()))
+        state = stream.compress()
+        if _LENGTH.size + len(state) > self.slot_size:
+            self._overflow[key] = state
+        else:
+            if not self._free:
+                self._grow()
+            slot = self._free[-1]
+            offset = slot * self.slot_size
+            _LENGTH.pack_into(self._map, offset, len(state))
+            start = offset + _LENGTH.size
+            self._map[start : start + len(state)] = state
+            self._slots[key] = self._free.pop()
+        del self._hot[key]
+        stream.close()
+
+    def _grow(self) -> None:
+        num_slots = max(self._num_slots * 2, 64)
+        self._file.truncate(num_slots * self.slot_size)
+        if self._map is None:
+            self._map = mmap.mmap(self._file.fileno(), 0)
+        else:
+            self._map.resize(num_slots * self.slot_size)
+        # Hand out low slots first to keep the touched pages compact.
+        self._free.extend(reversed(range(self._num_slots, num_slots)))
+        self._num_slots = num_slots
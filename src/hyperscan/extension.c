@@ -9,6 +9,14 @@
 #include <stdlib.h>
 #include <structmember.h>
 
+#ifndef _WIN32
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#define HS_HAVE_FORK 1
+#define HS_HAVE_MMAP 1
+#endif
+
 #ifdef Py_GIL_DISABLED
 typedef struct {
   PyThread_type_lock lock;
@@ -198,19 +206,186 @@ static PyObject *HyperscanError;
 static PyTypeObject DatabaseType;
 static PyTypeObject ScratchType;
 static PyTypeObject StreamType;
+static PyTypeObject StreamEngineType;
+
+// Maps the ids a folded database reports to the original ids of every
+// duplicate expression: internal id i fans out to
+// ids[offsets[i]] .. ids[offsets[i + 1] - 1].
+typedef struct {
+  uint32_t count;
+  uint32_t *offsets;
+  uint32_t *ids;
+} hs_fanout;
+
+/* Looks up the original ids for a reported id, or returns the id itself
+ * if the database was not folded. */
+static inline const uint32_t *hs_fanout_ids(
+  const hs_fanout *fanout, const uint32_t *id, uint32_t *count)
+{
+  if (fanout == NULL || *id >= fanout->count) {
+    *count = 1;
+    return id;
+  }
+  *count = fanout->offsets[*id + 1] - fanout->offsets[*id];
+  return fanout->ids + fanout->offsets[*id];
+}
 
 typedef struct {
   PyObject *callback;
   PyObject *ctx;
   int success;
+  const hs_fanout *fanout;
 } py_scan_callback_ctx;
 
+typedef struct {
+  unsigned long long key;
+  unsigned int id;
+  unsigned long long from;
+  unsigned long long to;
+  unsigned int flags;
+} hs_match_record;
+
+typedef struct {
+  hs_match_record *records;
+  size_t count;
+  size_t capacity;
+  unsigned long long key;
+  int failed;
+  const hs_fanout *fanout;
+} hs_match_collector;
+
+#if defined(_MSC_VER)
+#define HS_THREAD_LOCAL __declspec(thread)
+#else
+#define HS_THREAD_LOCAL __thread
+#endif
+
+/* Every block handed to Hyperscan is prefixed with a header recording the
+ * backend that allocated it, its accounting category, and either its size
+ * or, for stream state, the arena it was carved from. The header is
+ * padded to 16 bytes to preserve the alignment of the payload. */
+#define HS_ALLOC_HEADER_SIZE 16
+
+enum {
+  HS_ALLOC_DATABASE,
+  HS_ALLOC_SCRATCH,
+  HS_ALLOC_STREAM,
+  HS_ALLOC_MISC,
+  HS_ALLOC_CATEGORIES
+};
+
+enum { HS_BACKEND_MALLOC, HS_BACKEND_PYMEM, HS_BACKEND_ARENA, HS_BACKEND_MMAP };
+
+enum { HS_HUGE_PAGES_OFF, HS_HUGE_PAGES_TRANSPARENT, HS_HUGE_PAGES_EXPLICIT };
+
+#define HS_HUGE_PAGE_SIZE ((size_t)2 << 20)
+#define HS_HUGE_PAGE_ROUND(size) \
+  (((size) + HS_HUGE_PAGE_SIZE - 1) & ~(HS_HUGE_PAGE_SIZE - 1))
+
+typedef union {
+  struct {
+    union {
+      struct hs_stream_arena *arena;
+      size_t size;
+    } owner;
+    uint32_t category;
+    uint32_t backend;
+  } h;
+  char pad[HS_ALLOC_HEADER_SIZE];
+} hs_alloc_header;
+
+typedef struct hs_stream_arena {
+  char *base;
+  void *free_list;
+  size_t payload_size;
+  size_t block_size;
+  size_t capacity;
+  size_t in_use;
+  size_t peak;
+  size_t fallbacks;
+  int orphaned;
+} hs_stream_arena;
+
+// Guards the accounting below and all stream arenas.
+static PyThread_type_lock g_alloc_lock = NULL;
+static int g_alloc_backend = HS_BACKEND_MALLOC;
+static size_t g_alloc_limit = 0;
+static size_t g_alloc_bytes[HS_ALLOC_CATEGORIES] = {0};
+static size_t g_alloc_total = 0;
+static size_t g_alloc_peak = 0;
+static size_t g_alloc_failures = 0;
+static int g_huge_pages = HS_HUGE_PAGES_OFF;
+static size_t g_huge_page_threshold = 0;
+static size_t g_huge_page_bytes = 0;
+static size_t g_huge_page_fallbacks = 0;
+static HS_THREAD_LOCAL hs_stream_arena *g_stream_arena_active = NULL;
+
+enum { HS_OBJ_DATABASE, HS_OBJ_SCRATCH, HS_OBJ_STREAM, HS_OBJ_KINDS };
+
+// Live databases, scratch spaces and streams, also guarded by
+// g_alloc_lock.
+static size_t g_live_count[HS_OBJ_KINDS] = {0};
+static size_t g_live_bytes[HS_OBJ_KINDS] = {0};
+
+// Incremented in the child after every fork, so that state inherited from
+// the parent (scratch that may have been mid-scan, engine threads that no
+// longer exist) can be recognized and replaced.
+static unsigned long g_fork_generation = 0;
+
+// A Hyperscan database held by several Database objects through
+// Database.share(), freed when the last of them lets go. memory_stats()
+// counts it once, here, rather than per holder.
+typedef struct {
+  Py_ssize_t refs; // Guarded by g_alloc_lock.
+  hs_database_t *hs_db;
+  size_t size;
+} hs_shared_db;
+
+// A database or scratch space replaced by a recompile while scans were
+// still using it, freed once the last of them completes.
+typedef struct hs_retired {
+  hs_database_t *hs_db;
+  ch_database_t *ch_db;
+  Py_buffer region;
+  hs_scratch_t *hs_scratch;
+  ch_scratch_t *ch_scratch;
+  hs_fanout *fanout;
+  hs_shared_db *shared;
+  struct hs_retired *next;
+} hs_retired;
+
 typedef struct {
   PyObject_HEAD PyObject *scratch;
   hs_database_t *hs_db;
   ch_database_t *ch_db;
   uint32_t mode;
   uint32_t chimera;
+  hs_stream_arena *stream_arena;
+  // Size accounted in memory_stats(), or 0 if no database is held.
+  size_t tracked_size;
+  // Caller-provided memory hs_db was deserialized into, if any.
+  Py_buffer region;
+  // Set while scratch was allocated by the database itself rather than
+  // passed in, in which case it is private to the fork generation below.
+  int owns_scratch;
+  unsigned long scratch_generation;
+  // Scans running on this database, during which replaced databases and
+  // scratch spaces are kept on the retired list instead of freed. Both
+  // are guarded by g_alloc_lock, as scans pin without the HS lock.
+  Py_ssize_t scans_in_flight;
+  hs_retired *retired;
+  // Set when duplicate expressions were folded at compile time.
+  hs_fanout *fanout;
+  // Set while hs_db is shared with other Database objects.
+  hs_shared_db *shared;
+  PyObject *weakreflist;
+  // Stream engines running on this database, whose worker threads read
+  // it without locking; compile() and set_stream_arena() are refused
+  // while any are. Guarded by g_alloc_lock.
+  Py_ssize_t engines;
+  // Open Stream objects, whose state points into hs_db; compile() is
+  // refused while any are. Guarded by g_alloc_lock.
+  Py_ssize_t streams;
 } Database;
 
 typedef struct {
@@ -219,8 +394,40 @@ typedef struct {
   PyObject *scratch;
   uint32_t flags;
   py_scan_callback_ctx *cctx;
+  // Small writes are buffered here until coalesce_size bytes or
+  // coalesce_writes writes have accumulated.
+  char *coalesce_buf;
+  size_t coalesce_size;
+  size_t coalesce_len;
+  uint32_t coalesce_writes;
+  uint32_t pending_writes;
+  // Size of the open stream state, as accounted in memory_stats().
+  size_t state_bytes;
 } Stream;
 
+/* Scans and empties a stream's coalescing buffer. Safe to call without
+ * the GIL. */
+static hs_error_t Stream_scan_pending(
+  Stream *self,
+  hs_scratch_t *scratch,
+  match_event_handler onEvent,
+  void *context)
+{
+  size_t length = self->coalesce_len;
+  if (length == 0)
+    return HS_SUCCESS;
+  self->coalesce_len = 0;
+  self->pending_writes = 0;
+  return hs_scan_stream(
+    self->identifier,
+    self->coalesce_buf,
+    (unsigned int)length,
+    0,
+    scratch,
+    onEvent,
+    context);
+}
+
 typedef struct {
   PyObject_HEAD PyObject *database;
   hs_scratch_t *hs_scratch;
@@ -235,18 +442,23 @@ static int hs_match_handler(
   void *context)
 {
   py_scan_callback_ctx *cctx = context;
+  uint32_t count;
+  const uint32_t *ids = hs_fanout_ids(cctx->fanout, &id, &count);
   PyGILState_STATE gstate;
   gstate = PyGILState_Ensure();
-  PyObject *rv = PyObject_CallFunction(
-    cctx->callback, "IKKIO", id, from, to, flags, cctx->ctx);
-  int halt = 1;
-  if (rv == NULL) {
-    cctx->success = 0;
-  } else {
-    halt = rv == Py_None ? 0 : PyObject_IsTrue(rv);
-    cctx->success = 1;
+  int halt = 0;
+  for (uint32_t i = 0; i < count && !halt; i++) {
+    PyObject *rv = PyObject_CallFunction(
+      cctx->callback, "IKKIO", ids[i], from, to, flags, cctx->ctx);
+    if (rv == NULL) {
+      cctx->success = 0;
+      halt = 1;
+    } else {
+      halt = rv == Py_None ? 0 : PyObject_IsTrue(rv);
+      cctx->success = 1;
+    }
+    Py_XDECREF(rv);
   }
-  Py_XDECREF(rv);
   PyGILState_Release(gstate);
   return halt;
 }
@@ -271,45 +483,644 @@ static int ch_match_handler(
       "(I, K, K)", captured[i].flags, captured[i].from, captured[i].to);
     PyList_SetItem(ocaptured, i, ocapture);
   }
-  PyObject *rv = PyObject_CallFunction(
-    cctx->callback,
-    "IKKIOO",
-    id,
-    from,
-    to,
-    flags,
-    (PyObject *)ocaptured,
-    cctx->ctx);
-  int halt = 1;
-  if (rv == NULL) {
-    cctx->success = 0;
-  } else {
-    halt = rv == Py_None ? 0 : PyObject_IsTrue(rv);
-    cctx->success = 1;
+  uint32_t count;
+  const uint32_t *ids = hs_fanout_ids(cctx->fanout, &id, &count);
+  int halt = 0;
+  for (uint32_t i = 0; i < count && !halt; i++) {
+    PyObject *rv = PyObject_CallFunction(
+      cctx->callback,
+      "IKKIOO",
+      ids[i],
+      from,
+      to,
+      flags,
+      (PyObject *)ocaptured,
+      cctx->ctx);
+    if (rv == NULL) {
+      cctx->success = 0;
+      halt = 1;
+    } else {
+      halt = rv == Py_None ? 0 : PyObject_IsTrue(rv);
+      cctx->success = 1;
+    }
+    Py_XDECREF(rv);
   }
-  Py_XDECREF(rv);
   Py_XDECREF(ocaptured);
   PyGILState_Release(gstate);
   return halt;
 }
 
-static void Database_dealloc(Database *self)
+/* Records matches without touching the interpreter, so it is safe to use
+ * while the GIL is released. */
+static int hs_collect_handler(
+  unsigned int id,
+  long long unsigned int from,
+  long long unsigned int to,
+  unsigned int flags,
+  void *context)
 {
-  if (self->chimera) {
-    ch_free_database(self->ch_db);
-    if (self->scratch != Py_None && self->scratch != NULL) {
-      ch_scratch_t *scratch = ((Scratch *)self->scratch)->ch_scratch;
-      if (scratch)
-        ch_free_scratch(scratch);
+  hs_match_collector *mc = context;
+  uint32_t count;
+  const uint32_t *ids = hs_fanout_ids(mc->fanout, &id, &count);
+  while (mc->count + count > mc->capacity) {
+    size_t capacity = mc->capacity ? mc->capacity * 2 : 64;
+    hs_match_record *records =
+      PyMem_RawRealloc(mc->records, capacity * sizeof(hs_match_record));
+    if (records == NULL) {
+      mc->failed = 1;
+      return 1;
+    }
+    mc->records = records;
+    mc->capacity = capacity;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    hs_match_record *record = &mc->records[mc->count++];
+    record->key = mc->key;
+    record->id = ids[i];
+    record->from = from;
+    record->to = to;
+    record->flags = flags;
+  }
+  return 0;
+}
+
+static hs_stream_arena *stream_arena_new(size_t payload_size, size_t capacity)
+{
+  hs_stream_arena *arena = PyMem_RawCalloc(1, sizeof(hs_stream_arena));
+  if (arena == NULL)
+    return NULL;
+  arena->payload_size = payload_size;
+  arena->block_size =
+    (HS_ALLOC_HEADER_SIZE + payload_size + HS_ALLOC_HEADER_SIZE - 1) &
+    ~(size_t)(HS_ALLOC_HEADER_SIZE - 1);
+  arena->capacity = capacity;
+  arena->base = PyMem_RawMalloc(arena->block_size * capacity);
+  if (arena->base == NULL) {
+    PyMem_RawFree(arena);
+    return NULL;
+  }
+  // Thread the free list back to front so blocks are handed out in
+  // address order.
+  for (size_t i = capacity; i > 0; i--) {
+    void **block = (void **)(arena->base + (i - 1) * arena->block_size);
+    *block = arena->free_list;
+    arena->free_list = block;
+  }
+  return arena;
+}
+
+static void stream_arena_destroy(hs_stream_arena *arena)
+{
+  PyMem_RawFree(arena->base);
+  PyMem_RawFree(arena);
+}
+
+/* Detaches an arena from its database. The arena is destroyed once the
+ * last stream state carved from it has been freed. */
+static void stream_arena_orphan(hs_stream_arena *arena)
+{
+  if (arena == NULL)
+    return;
+  PyThread_acquire_lock(g_alloc_lock, WAIT_LOCK);
+  int destroy = arena->in_use == 0;
+  arena->orphaned = 1;
+  PyThread_release_lock(g_alloc_lock);
+  if (destroy)
+    stream_arena_destroy(arena);
+}
+
+/* Maps memory backed by huge pages: explicit (hugetlbfs) pages if
+ * requested and available, otherwise a region the kernel is advised to
+ * back with transparent huge pages. */
+static void *huge_page_map(size_t size, int huge_pages)
+{
+#ifdef HS_HAVE_MMAP
+  size_t length = HS_HUGE_PAGE_ROUND(size);
+  void *region = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (huge_pages == HS_HUGE_PAGES_EXPLICIT)
+    region = mmap(
+      NULL,
+      length,
+      PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+      -1,
+      0);
+#endif
+  if (region == MAP_FAILED) {
+    if (huge_pages == HS_HUGE_PAGES_EXPLICIT) {
+      PyThread_acquire_lock(g_alloc_lock, WAIT_LOCK);
+      g_huge_page_fallbacks++;
+      PyThread_release_lock(g_alloc_lock);
+    }
+    region = mmap(
+      NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED)
+      return NULL;
+#ifdef MADV_HUGEPAGE
+    madvise(region, length, MADV_HUGEPAGE);
+#endif
+  }
+  PyThread_acquire_lock(g_alloc_lock, WAIT_LOCK);
+  g_huge_page_bytes += length;
+  PyThread_release_lock(g_alloc_lock);
+  return region;
+#else
+  return NULL;
+#endif
+}
+
+static void huge_page_unmap(void *region, size_t size)
+{
+#ifdef HS_HAVE_MMAP
+  size_t length = HS_HUGE_PAGE_ROUND(size);
+  munmap(region, length);
+  PyThread_acquire_lock(g_alloc_lock, WAIT_LOCK);
+  g_huge_page_bytes -= length;
+  PyThread_release_lock(g_alloc_lock);
+#endif
+}
+
+static void *hs_tracked_alloc(size_t size, uint32_t category)
+{
+  if (size > SIZE_MAX - HS_ALLOC_HEADER_SIZE)
+    return NULL;
+  hs_stream_arena *arena =
+    category == HS_ALLOC_STREAM ? g_stream_arena_active : NULL;
+  char *block = NULL;
+  uint32_t backend;
+
+  PyThread_acquire_lock(g_alloc_lock, WAIT_LOCK);
+  if (arena != NULL) {
+    if (size <= arena->payload_size && arena->free_list != NULL) {
+      block = arena->free_list;
+      arena->free_list = *(void **)block;
+      arena->in_use++;
+      if (arena->in_use > arena->peak)
+        arena->peak = arena->in_use;
+      size = arena->payload_size;
+    } else {
+      arena->fallbacks++;
+    }
+  }
+  backend = block != NULL ? HS_BACKEND_ARENA : (uint32_t)g_alloc_backend;
+  int huge_pages = HS_HUGE_PAGES_OFF;
+  if (
+    block == NULL && g_huge_pages != HS_HUGE_PAGES_OFF &&
+    (category == HS_ALLOC_DATABASE || category == HS_ALLOC_SCRATCH) &&
+    size >= g_huge_page_threshold) {
+    backend = HS_BACKEND_MMAP;
+    huge_pages = g_huge_pages;
+  }
+  if (
+    backend != HS_BACKEND_ARENA && g_alloc_limit != 0 &&
+    g_alloc_total + size > g_alloc_limit) {
+    g_alloc_failures++;
+    PyThread_release_lock(g_alloc_lock);
+    return NULL;
+  }
+  // Charge up front so concurrent allocations cannot overshoot the limit.
+  g_alloc_bytes[category] += size;
+  g_alloc_total += size;
+  if (g_alloc_total > g_alloc_peak)
+    g_alloc_peak = g_alloc_total;
+  PyThread_release_lock(g_alloc_lock);
+
+  if (block == NULL) {
+    if (backend == HS_BACKEND_MMAP)
+      block = huge_page_map(HS_ALLOC_HEADER_SIZE + size, huge_pages);
+    else if (backend == HS_BACKEND_PYMEM)
+      block = PyMem_RawMalloc(HS_ALLOC_HEADER_SIZE + size);
+    else
+      block = malloc(HS_ALLOC_HEADER_SIZE + size);
+    if (block == NULL) {
+      PyThread_acquire_lock(g_alloc_lock, WAIT_LOCK);
+      g_alloc_bytes[category] -= size;
+      g_alloc_total -= size;
+      g_alloc_failures++;
+      PyThread_release_lock(g_alloc_lock);
+      return NULL;
     }
+  }
+
+  hs_alloc_header *header = (hs_alloc_header *)block;
+  if (backend == HS_BACKEND_ARENA)
+    header->h.owner.arena = arena;
+  else
+    header->h.owner.size = size;
+  header->h.category = category;
+  header->h.backend = backend;
+  return block + HS_ALLOC_HEADER_SIZE;
+}
+
+static void hs_tracked_free(void *ptr)
+{
+  if (ptr == NULL)
+    return;
+  char *block = (char *)ptr - HS_ALLOC_HEADER_SIZE;
+  hs_alloc_header *header = (hs_alloc_header *)block;
+  uint32_t backend = header->h.backend;
+  uint32_t category = header->h.category;
+  hs_stream_arena *arena = NULL;
+  size_t size;
+  int destroy = 0;
+
+  PyThread_acquire_lock(g_alloc_lock, WAIT_LOCK);
+  if (backend == HS_BACKEND_ARENA) {
+    arena = header->h.owner.arena;
+    size = arena->payload_size;
+    *(void **)block = arena->free_list;
+    arena->free_list = block;
+    arena->in_use--;
+    destroy = arena->orphaned && arena->in_use == 0;
   } else {
-    hs_free_database(self->hs_db);
-    if (self->scratch != Py_None && self->scratch != NULL) {
-      hs_scratch_t *scratch = ((Scratch *)self->scratch)->hs_scratch;
-      if (scratch)
-        hs_free_scratch(scratch);
+    size = header->h.owner.size;
+  }
+  g_alloc_bytes[category] -= size;
+  g_alloc_total -= size;
+  PyThread_release_lock(g_alloc_lock);
+
+  if (backend == HS_BACKEND_PYMEM)
+    PyMem_RawFree(block);
+  else if (backend == HS_BACKEND_MALLOC)
+    free(block);
+  else if (backend == HS_BACKEND_MMAP)
+    huge_page_unmap(block, HS_ALLOC_HEADER_SIZE + size);
+  else if (destroy)
+    stream_arena_destroy(arena);
+}
+
+static void *hs_database_alloc(size_t size)
+{
+  return hs_tracked_alloc(size, HS_ALLOC_DATABASE);
+}
+
+static void *hs_scratch_alloc(size_t size)
+{
+  return hs_tracked_alloc(size, HS_ALLOC_SCRATCH);
+}
+
+static void *hs_stream_alloc(size_t size)
+{
+  return hs_tracked_alloc(size, HS_ALLOC_STREAM);
+}
+
+static void *hs_misc_alloc(size_t size)
+{
+  return hs_tracked_alloc(size, HS_ALLOC_MISC);
+}
+
+static void memory_stats_update(int kind, int count, size_t added, size_t removed)
+{
+  PyThread_acquire_lock(g_alloc_lock, WAIT_LOCK);
+  g_live_count[kind] += count;
+  g_live_bytes[kind] += added;
+  g_live_bytes[kind] -= removed;
+  PyThread_release_lock(g_alloc_lock);
+}
+
+/* Brings memory_stats() in line with the database currently held. */
+static void Database_track(Database *self)
+{
+  size_t size = 0;
+  int held = 0;
+  if (self->chimera && self->ch_db != NULL) {
+    held = ch_database_size(self->ch_db, &size) == CH_SUCCESS;
+  } else if (!self->chimera && self->hs_db != NULL && self->shared == NULL) {
+    held = hs_database_size(self->hs_db, &size) == HS_SUCCESS;
+  }
+  int was_held = self->tracked_size != 0;
+  memory_stats_update(
+    HS_OBJ_DATABASE, held - was_held, held ? size : 0, self->tracked_size);
+  self->tracked_size = held ? (size ? size : 1) : 0;
+}
+
+static void tracked_free_scratch_pair(hs_scratch_t *, ch_scratch_t *);
+
+static void hs_shared_db_release(hs_shared_db *shared)
+{
+  PyThread_acquire_lock(g_alloc_lock, WAIT_LOCK);
+  Py_ssize_t refs = --shared->refs;
+  PyThread_release_lock(g_alloc_lock);
+  if (refs > 0)
+    return;
+  memory_stats_update(HS_OBJ_DATABASE, -1, 0, shared->size);
+  hs_free_database(shared->hs_db);
+  PyMem_RawFree(shared);
+}
+
+static void hs_retired_free(hs_retired *item)
+{
+  if (item->ch_db != NULL)
+    ch_free_database(item->ch_db);
+  if (item->region.obj != NULL)
+    PyBuffer_Release(&item->region);
+  else if (item->shared != NULL)
+    hs_shared_db_release(item->shared);
+  else if (item->hs_db != NULL)
+    hs_free_database(item->hs_db);
+  tracked_free_scratch_pair(item->hs_scratch, item->ch_scratch);
+  free(item->fanout);
+}
+
+/* Frees a replaced database or scratch space, or defers it until scans
+ * still using it have completed. */
+static void Database_retire(Database *self, hs_retired *item)
+{
+  // Allocated up front: g_alloc_lock must not be held while freeing,
+  // which updates memory_stats().
+  hs_retired *retired = PyMem_RawMalloc(sizeof(hs_retired));
+  PyThread_acquire_lock(g_alloc_lock, WAIT_LOCK);
+  int idle = self->scans_in_flight == 0;
+  if (!idle && retired != NULL) {
+    *retired = *item;
+    retired->next = self->retired;
+    self->retired = retired;
+  }
+  PyThread_release_lock(g_alloc_lock);
+  if (idle) {
+    PyMem_RawFree(retired);
+    hs_retired_free(item);
+  }
+  // Otherwise, if the allocation failed, leaking beats freeing memory a
+  // scan is still reading.
+}
+
+static void Database_pin(Database *self)
+{
+  PyThread_acquire_lock(g_alloc_lock, WAIT_LOCK);
+  self->scans_in_flight++;
+  PyThread_release_lock(g_alloc_lock);
+}
+
+static void Database_unpin(Database *self)
+{
+  hs_retired *retired = NULL;
+  PyThread_acquire_lock(g_alloc_lock, WAIT_LOCK);
+  if (--self->scans_in_flight == 0) {
+    retired = self->retired;
+    self->retired = NULL;
+  }
+  PyThread_release_lock(g_alloc_lock);
+  while (retired != NULL) {
+    hs_retired *next = retired->next;
+    hs_retired_free(retired);
+    PyMem_RawFree(retired);
+    retired = next;
+  }
+}
+
+static void Database_free_db(Database *self)
+{
+  hs_retired item = {
+    self->hs_db,
+    self->ch_db,
+    self->region,
+    NULL,
+    NULL,
+    self->fanout,
+    self->shared};
+  Database_retire(self, &item);
+  memset(&self->region, 0, sizeof(self->region));
+  self->ch_db = NULL;
+  self->hs_db = NULL;
+  self->fanout = NULL;
+  self->shared = NULL;
+  Database_track(self);
+}
+
+/* Returns the database's scratch space, allocating it on first use and
+ * again in a forked child, where the inherited copy may have been in use
+ * by another thread of the parent. */
+static Scratch *Database_scratch(Database *self)
+{
+  if (
+    self->scratch != Py_None && self->scratch != NULL &&
+    (!self->owns_scratch || self->scratch_generation == g_fork_generation))
+    return (Scratch *)self->scratch;
+  if (self->hs_db == NULL && self->ch_db == NULL) {
+    PyErr_SetString(PyExc_RuntimeError, "database is not compiled");
+    return NULL;
+  }
+  PyObject *oscratch =
+    PyObject_CallFunction((PyObject *)&ScratchType, "O", (PyObject *)self);
+  if (oscratch == NULL)
+    return NULL;
+  Py_XSETREF(self->scratch, oscratch);
+  self->owns_scratch = 1;
+  self->scratch_generation = g_fork_generation;
+  return (Scratch *)oscratch;
+}
+
+static size_t hs_scratch_bytes(hs_scratch_t *scratch)
+{
+  size_t size = 0;
+  if (scratch != NULL)
+    hs_scratch_size(scratch, &size);
+  return size;
+}
+
+static size_t ch_scratch_bytes(ch_scratch_t *scratch)
+{
+  size_t size = 0;
+  if (scratch != NULL)
+    ch_scratch_size(scratch, &size);
+  return size;
+}
+
+/* Scratch allocation wrappers keeping memory_stats() up to date. */
+static hs_error_t tracked_alloc_scratch(
+  const hs_database_t *db, hs_scratch_t **scratch)
+{
+  int existed = *scratch != NULL;
+  size_t before = hs_scratch_bytes(*scratch);
+  hs_error_t hs_err = hs_alloc_scratch(db, scratch);
+  if (hs_err == HS_SUCCESS)
+    memory_stats_update(
+      HS_OBJ_SCRATCH, !existed, hs_scratch_bytes(*scratch), before);
+  return hs_err;
+}
+
+static hs_error_t tracked_clone_scratch(
+  const hs_scratch_t *src, hs_scratch_t **dest)
+{
+  hs_error_t hs_err = hs_clone_scratch(src, dest);
+  if (hs_err == HS_SUCCESS)
+    memory_stats_update(HS_OBJ_SCRATCH, 1, hs_scratch_bytes(*dest), 0);
+  return hs_err;
+}
+
+static hs_error_t tracked_free_scratch(hs_scratch_t *scratch)
+{
+  if (scratch == NULL)
+    return HS_SUCCESS;
+  memory_stats_update(HS_OBJ_SCRATCH, -1, 0, hs_scratch_bytes(scratch));
+  return hs_free_scratch(scratch);
+}
+
+static ch_error_t tracked_ch_alloc_scratch(
+  const ch_database_t *db, ch_scratch_t **scratch)
+{
+  int existed = *scratch != NULL;
+  size_t before = ch_scratch_bytes(*scratch);
+  ch_error_t ch_err = ch_alloc_scratch(db, scratch);
+  if (ch_err == CH_SUCCESS)
+    memory_stats_update(
+      HS_OBJ_SCRATCH, !existed, ch_scratch_bytes(*scratch), before);
+  return ch_err;
+}
+
+static ch_error_t tracked_ch_clone_scratch(
+  const ch_scratch_t *src, ch_scratch_t **dest)
+{
+  ch_error_t ch_err = ch_clone_scratch(src, dest);
+  if (ch_err == CH_SUCCESS)
+    memory_stats_update(HS_OBJ_SCRATCH, 1, ch_scratch_bytes(*dest), 0);
+  return ch_err;
+}
+
+static ch_error_t tracked_ch_free_scratch(ch_scratch_t *scratch)
+{
+  if (scratch == NULL)
+    return CH_SUCCESS;
+  memory_stats_update(HS_OBJ_SCRATCH, -1, 0, ch_scratch_bytes(scratch));
+  return ch_free_scratch(scratch);
+}
+
+static void tracked_free_scratch_pair(
+  hs_scratch_t *hs_scratch, ch_scratch_t *ch_scratch)
+{
+  tracked_free_scratch(hs_scratch);
+  tracked_ch_free_scratch(ch_scratch);
+}
+
+static size_t Database_stream_bytes(Database *db)
+{
+  size_t size = 0;
+  if (db->hs_db != NULL)
+    hs_stream_size(db->hs_db, &size);
+  return size;
+}
+
+/* Closes a stream opened with Database_open_stream or
+ * Database_expand_stream, given the size they recorded for it; the
+ * database may have been recompiled since. */
+static hs_error_t tracked_close_stream(
+  hs_stream_t *stream,
+  size_t bytes,
+  hs_scratch_t *scratch,
+  match_event_handler onEvent,
+  void *context)
+{
+  if (stream == NULL)
+    return HS_INVALID;
+  memory_stats_update(HS_OBJ_STREAM, -1, 0, bytes);
+  return hs_close_stream(stream, scratch, onEvent, context);
+}
+
+/* Opens a stream, carving its state from the database's arena if it has
+ * one, and records the size of that state in *bytes. */
+static hs_error_t Database_open_stream(
+  Database *db, unsigned int flags, hs_stream_t **stream, size_t *bytes)
+{
+  g_stream_arena_active = db->stream_arena;
+  hs_error_t err = hs_open_stream(db->hs_db, flags, stream);
+  g_stream_arena_active = NULL;
+  if (err == HS_SUCCESS) {
+    *bytes = Database_stream_bytes(db);
+    memory_stats_update(HS_OBJ_STREAM, 1, *bytes, 0);
+  }
+  return err;
+}
+
+/* Expands a compressed stream, carving its state from the database's
+ * arena if it has one, and records the size of that state in *bytes. */
+static hs_error_t Database_expand_stream(
+  Database *db,
+  hs_stream_t **stream,
+  const char *buf,
+  size_t buf_size,
+  size_t *bytes)
+{
+  g_stream_arena_active = db->stream_arena;
+  hs_error_t err = hs_expand_stream(db->hs_db, stream, buf, buf_size);
+  g_stream_arena_active = NULL;
+  if (err == HS_SUCCESS) {
+    *bytes = Database_stream_bytes(db);
+    memory_stats_update(HS_OBJ_STREAM, 1, *bytes, 0);
+  }
+  return err;
+}
+
+/* Replaces the database's stream arena with one sized for its current
+ * stream state, or removes it when capacity is 0. */
+static int Database_reset_stream_arena(Database *self, size_t capacity)
+{
+  hs_stream_arena *arena = NULL;
+  if (capacity > 0) {
+    size_t stream_size;
+    hs_error_t hs_err = hs_stream_size(self->hs_db, &stream_size);
+    if (hs_err != HS_SUCCESS) {
+      PyErr_Format(HyperscanErrors[abs(hs_err)], "error code %i", hs_err);
+      return -1;
     }
+    arena = stream_arena_new(stream_size, capacity);
+    if (arena == NULL) {
+      PyErr_NoMemory();
+      return -1;
+    }
+  }
+  stream_arena_orphan(self->stream_arena);
+  self->stream_arena = arena;
+  return 0;
+}
+
+/* Fails if a stream engine is running on the database, which must then
+ * not be recompiled or have its stream arena replaced. */
+static int Database_check_engines(Database *self)
+{
+  PyThread_acquire_lock(g_alloc_lock, WAIT_LOCK);
+  Py_ssize_t engines = self->engines;
+  PyThread_release_lock(g_alloc_lock);
+  if (engines > 0) {
+    PyErr_SetString(
+      PyExc_RuntimeError, "database is in use by a running StreamEngine");
+    return -1;
+  }
+  return 0;
+}
+
+/* Fails if streams opened on the database are still open, as their
+ * state would outlive the compiled database it points into. */
+static int Database_check_streams(Database *self)
+{
+  PyThread_acquire_lock(g_alloc_lock, WAIT_LOCK);
+  Py_ssize_t streams = self->streams;
+  PyThread_release_lock(g_alloc_lock);
+  if (streams > 0) {
+    PyErr_SetString(
+      PyExc_RuntimeError, "cannot recompile a database with open streams");
+    return -1;
   }
+  return 0;
+}
+
+static void Database_count_streams(Database *self, Py_ssize_t delta)
+{
+  PyThread_acquire_lock(g_alloc_lock, WAIT_LOCK);
+  self->streams += delta;
+  PyThread_release_lock(g_alloc_lock);
+}
+
+static void Database_dealloc(Database *self)
+{
+  if (self->weakreflist != NULL)
+    PyObject_ClearWeakRefs((PyObject *)self);
+  stream_arena_orphan(self->stream_arena);
+  self->stream_arena = NULL;
+  Database_free_db(self);
+  // The scratch space is released by the Scratch object itself.
+  Py_XDECREF(self->scratch);
 
   Py_TYPE(self)->tp_free((PyObject *)self);
 }
@@ -321,6 +1132,7 @@ static PyObject *Database_new(
 
   self = (Database *)type->tp_alloc(type, 0);
   if (self != NULL) {
+    self->scratch = Py_NewRef(Py_None);
     self->mode = HS_MODE_BLOCK;
     self->chimera = 0;
   }
@@ -331,19 +1143,122 @@ static PyObject *Database_new(
 static int Database_init(Database *self, PyObject *args, PyObject *kwds)
 {
   static char *kwlist[] = {"scratch", "mode", "chimera", NULL};
-  self->scratch = Py_None;
+  PyObject *oscratch = Py_None;
   if (!PyArg_ParseTupleAndKeywords(
         args,
         kwds,
         "|OIp",
         kwlist,
-        &self->scratch,
+        &oscratch,
         &self->mode,
         &self->chimera))
     return -1;
+  Py_XSETREF(self->scratch, Py_NewRef(oscratch));
+  self->owns_scratch = 0;
   return 0;
 }
 
+/* Compacts identical expressions (same bytes, flags and extended
+ * parameters) so each is compiled once under an internal id, and builds
+ * the table mapping those ids back to the original ones. Leaves *out
+ * NULL if there is nothing to fold. Logical combinations refer to
+ * sub-expressions by id, so sets using them are never folded. */
+static int fold_duplicates(
+  PyObject **encoded,
+  const char **expressions,
+  size_t *lens,
+  uint32_t *flags,
+  uint32_t *ids,
+  const hs_expr_ext_t **ext,
+  uint64_t *elements,
+  hs_fanout **out)
+{
+  uint64_t count = *elements;
+  *out = NULL;
+  for (uint64_t i = 0; i < count; i++) {
+    if (flags[i] & HS_FLAG_COMBINATION)
+      return 0;
+  }
+
+  uint32_t *owner = PyMem_Malloc((count + 1) * sizeof(uint32_t));
+  uint32_t *first = PyMem_Malloc((count + 1) * sizeof(uint32_t));
+  PyObject *seen = PyDict_New();
+  uint32_t unique = 0;
+  int rv = -1;
+  if (owner == NULL || first == NULL || seen == NULL) {
+    PyErr_NoMemory();
+    goto done;
+  }
+  for (uint64_t i = 0; i < count; i++) {
+    PyObject *oext = ext == NULL ? Py_NewRef(Py_None)
+                                 : PyBytes_FromStringAndSize(
+                                     (const char *)ext[i], sizeof(**ext));
+    PyObject *key =
+      oext == NULL ? NULL : Py_BuildValue("(OIN)", encoded[i], flags[i], oext);
+    if (key == NULL)
+      goto done;
+    PyObject *oindex = PyDict_GetItemWithError(seen, key);
+    if (oindex != NULL) {
+      owner[i] = (uint32_t)PyLong_AsUnsignedLong(oindex);
+    } else if (PyErr_Occurred()) {
+      Py_DECREF(key);
+      goto done;
+    } else {
+      PyObject *onew = PyLong_FromUnsignedLong(unique);
+      if (onew == NULL || PyDict_SetItem(seen, key, onew) < 0) {
+        Py_XDECREF(onew);
+        Py_DECREF(key);
+        goto done;
+      }
+      Py_DECREF(onew);
+      first[unique] = (uint32_t)i;
+      owner[i] = unique++;
+    }
+    Py_DECREF(key);
+  }
+  rv = 0;
+  if (unique == count)
+    goto done;
+
+  hs_fanout *fanout = malloc(
+    sizeof(hs_fanout) + (unique + 1 + count) * sizeof(uint32_t));
+  if (fanout == NULL) {
+    PyErr_NoMemory();
+    rv = -1;
+    goto done;
+  }
+  fanout->count = unique;
+  fanout->offsets = (uint32_t *)(fanout + 1);
+  fanout->ids = fanout->offsets + unique + 1;
+  memset(fanout->offsets, 0, (unique + 1) * sizeof(uint32_t));
+  for (uint64_t i = 0; i < count; i++)
+    fanout->offsets[owner[i] + 1]++;
+  for (uint32_t u = 0; u < unique; u++)
+    fanout->offsets[u + 1] += fanout->offsets[u];
+  // Reuse first[] as the fill cursor once the survivors are compacted.
+  for (uint32_t u = 0; u < unique; u++) {
+    uint32_t i = first[u];
+    expressions[u] = expressions[i];
+    lens[u] = lens[i];
+    flags[u] = flags[i];
+    if (ext != NULL)
+      ext[u] = ext[i];
+    first[u] = fanout->offsets[u];
+  }
+  for (uint64_t i = 0; i < count; i++)
+    fanout->ids[first[owner[i]]++] = ids[i];
+  for (uint32_t u = 0; u < unique; u++)
+    ids[u] = u;
+  *elements = unique;
+  *out = fanout;
+
+done:
+  PyMem_Free(owner);
+  PyMem_Free(first);
+  Py_XDECREF(seen);
+  return rv;
+}
+
 static PyObject *Database_compile(
   Database *self, PyObject *args, PyObject *kwds)
 {
@@ -352,10 +1267,11 @@ static PyObject *Database_compile(
 
   PyObject *oexpressions;
   PyObject *oflags = Py_None;
-  PyObject *oflag = Py_None;
   PyObject *oids = Py_None;
   PyObject *oext = Py_None;
+  PyObject *oplatform = Py_None;
   uint32_t literal = 0;
+  int fold = 0;
   uint64_t elements = 0;
 
   static char *kwlist[] = {
@@ -365,20 +1281,42 @@ static PyObject *Database_compile(
     "flags",
     "literal",
     "ext",
+    "platform",
+    "fold_duplicates",
     NULL,
   };
   if (!PyArg_ParseTupleAndKeywords(
         args,
         kwds,
-        "O|OKOpO",
+        "O|OKOpOOp",
         kwlist,
         &oexpressions,
         &oids,
         &elements,
         &oflags,
         &literal,
-        &oext))
+        &oext,
+        &oplatform,
+        &fold))
     HS_LOCK_RETURN_NULL();
+  if (Database_check_engines(self) < 0 || Database_check_streams(self) < 0)
+    HS_LOCK_RETURN_NULL();
+
+  // Target platform; NULL compiles for the current host.
+  hs_platform_info_t target = {0};
+  hs_platform_info_t *platform = NULL;
+  if (oplatform != Py_None) {
+    unsigned long long cpu_features;
+    if (
+      !PyTuple_Check(oplatform) ||
+      !PyArg_ParseTuple(oplatform, "IK", &target.tune, &cpu_features)) {
+      PyErr_SetString(
+        PyExc_TypeError, "platform must be a (tune, cpu_features) tuple");
+      HS_LOCK_RETURN_NULL();
+    }
+    target.cpu_features = cpu_features;
+    platform = &target;
+  }
 
   if (elements == 0) {
     Py_ssize_t expressions_size = PySequence_Size(oexpressions);
@@ -390,255 +1328,288 @@ static PyObject *Database_compile(
     }
   }
 
-  PyObject *oexpr = NULL;
-  PyObject *oid = NULL;
-  const char **expressions;
-  uint32_t *flags;
-  uint32_t *ids;
-  size_t *lens;
-  uint32_t globalflag;
-
-  if (self->chimera && self->ch_db != NULL)
-    ch_free_database(self->ch_db);
-  else if (!self->chimera && self->hs_db != NULL) {
-    hs_free_database(self->hs_db);
+  if (literal && self->chimera) {
+    PyErr_Format(
+      PyExc_RuntimeError, "chimera does not support pure literal expressions");
+    HS_LOCK_RETURN_NULL();
   }
 
-  expressions = malloc(elements * sizeof(char *));
-  if (expressions == NULL)
-    goto memory_error;
-
-  flags = malloc(elements * sizeof(uint32_t));
-  if (flags == NULL)
-    goto memory_error;
+  // Encoded expressions are owned here, not borrowed from the caller's
+  // sequence, so they stay valid while the GIL is released to compile.
+  PyObject **encoded = calloc(elements + 1, sizeof(PyObject *));
+  const char **expressions = calloc(elements + 1, sizeof(char *));
+  size_t *lens = calloc(elements + 1, sizeof(size_t));
+  uint32_t *flags = calloc(elements + 1, sizeof(uint32_t));
+  uint32_t *ids = calloc(elements + 1, sizeof(uint32_t));
+  hs_expr_ext_t *ext_items = NULL;
+  const hs_expr_ext_t **ext = NULL;
+  // Built alongside the current database, which stays usable by other
+  // threads until the new one is swapped in.
+  hs_database_t *hs_db = NULL;
+  ch_database_t *ch_db = NULL;
+  hs_compile_error_t *hs_compile_err = NULL;
+  ch_compile_error_t *ch_compile_err = NULL;
+  hs_error_t hs_err = HS_SUCCESS;
+  ch_error_t ch_err = CH_SUCCESS;
+  hs_fanout *fanout = NULL;
+  uint64_t compiled = elements;
 
-  ids = malloc(elements * sizeof(uint32_t));
-  if (ids == NULL)
-    goto memory_error;
-
-  globalflag = (oflags == Py_None ? 0 : PyLong_AsUnsignedLong(oflags));
+  if (
+    encoded == NULL || expressions == NULL || lens == NULL || flags == NULL ||
+    ids == NULL) {
+    PyErr_NoMemory();
+    goto cleanup;
+  }
 
-  PyErr_Clear();
+  uint32_t globalflag = 0;
+  if (oflags != Py_None && !PySequence_Check(oflags)) {
+    globalflag = PyLong_AsUnsignedLong(oflags);
+    if (PyErr_Occurred())
+      goto cleanup;
+  }
+  int have_ids = PyObject_IsTrue(oids);
+  if (have_ids < 0)
+    goto cleanup;
 
   for (uint64_t i = 0; i < elements; i++) {
-    const char *expression;
-    uint32_t expr_flags;
-    uint32_t expr_id;
-
-    oexpr = PySequence_ITEM(oexpressions, i);
-
-    // Handle both bytes and unicode strings
+    PyObject *oexpr = PySequence_ITEM(oexpressions, i);
+    if (oexpr == NULL)
+      goto cleanup;
     if (PyBytes_Check(oexpr)) {
-      expression = PyBytes_AsString(oexpr);
+      encoded[i] = oexpr;
     } else if (PyUnicode_Check(oexpr)) {
-      // Convert unicode to UTF-8 bytes
-      PyObject *temp_bytes = PyUnicode_AsUTF8String(oexpr);
-      if (temp_bytes == NULL) {
-        break;
-      }
-      expression = PyBytes_AsString(temp_bytes);
-      // Replace the original object with the encoded version
+      encoded[i] = PyUnicode_AsUTF8String(oexpr);
       Py_DECREF(oexpr);
-      oexpr = temp_bytes;
+      if (encoded[i] == NULL)
+        goto cleanup;
     } else {
+      Py_DECREF(oexpr);
       PyErr_SetString(PyExc_TypeError, "expressions must be bytes or str");
-      break;
+      goto cleanup;
+    }
+    expressions[i] = PyBytes_AS_STRING(encoded[i]);
+    // Literals may contain NUL bytes, so use the true length.
+    lens[i] = (size_t)PyBytes_GET_SIZE(encoded[i]);
+    if (!literal && strlen(expressions[i]) != lens[i]) {
+      PyErr_SetString(
+        PyExc_ValueError,
+        "expressions must not contain NUL bytes unless literal=True");
+      goto cleanup;
     }
 
-    if (PyErr_Occurred())
-      break;
-
-    if (PyObject_IsTrue(oids)) {
-      oid = PySequence_ITEM(oids, i);
-      expr_id = PyLong_AsUnsignedLong(oid);
+    if (have_ids) {
+      PyObject *oid = PySequence_ITEM(oids, i);
+      if (oid == NULL)
+        goto cleanup;
+      ids[i] = PyLong_AsUnsignedLong(oid);
+      Py_DECREF(oid);
       if (PyErr_Occurred())
-        break;
+        goto cleanup;
     } else {
-      expr_id = i;
+      ids[i] = i;
     }
 
-    if (PySequence_Check(oflags)) {
-      oflag = PySequence_ITEM(oflags, i);
-      if (PyErr_Occurred())
-        break;
-      expr_flags = PyLong_AsUnsignedLong(oflag);
+    if (oflags != Py_None && PySequence_Check(oflags)) {
+      PyObject *oflag = PySequence_ITEM(oflags, i);
+      if (oflag == NULL)
+        goto cleanup;
+      flags[i] = PyLong_AsUnsignedLong(oflag);
+      Py_DECREF(oflag);
       if (PyErr_Occurred())
-        break;
+        goto cleanup;
     } else {
-      expr_flags = globalflag;
+      flags[i] = globalflag;
     }
-
-    expressions[i] = expression;
-    ids[i] = expr_id;
-    flags[i] = expr_flags;
-
-    Py_XDECREF(oexpr);
   }
 
-  if (oflag != Py_None)
-    Py_XDECREF(oflag);
-  if (oid != Py_None)
-    Py_XDECREF(oid);
-
-  if (PyErr_Occurred()) {
-    goto python_error;
+  if (!literal && !self->chimera && oext != Py_None) {
+    ext_items = calloc(elements + 1, sizeof(hs_expr_ext_t));
+    ext = calloc(elements + 1, sizeof(hs_expr_ext_t *));
+    if (ext_items == NULL || ext == NULL) {
+      PyErr_NoMemory();
+      goto cleanup;
+    }
+    for (uint64_t i = 0; i < elements; i++) {
+      PyObject *oext_item = PySequence_GetItem(oext, i);
+      if (oext_item == NULL) {
+        PyErr_Format(
+          PyExc_RuntimeError,
+          "failed to get ext item at index: %llu",
+          (unsigned long long)i);
+        goto cleanup;
+      }
+      if (!PyArg_ParseTuple(
+            oext_item,
+            "KKKKII",
+            &ext_items[i].flags,
+            &ext_items[i].min_offset,
+            &ext_items[i].max_offset,
+            &ext_items[i].min_length,
+            &ext_items[i].edit_distance,
+            &ext_items[i].hamming_distance)) {
+        PyErr_SetString(PyExc_TypeError, "invalid ext info");
+        Py_DECREF(oext_item);
+        goto cleanup;
+      }
+      Py_DECREF(oext_item);
+      ext[i] = &ext_items[i];
+    }
   }
 
-  struct hs_expr_ext **ext = NULL;
-  hs_compile_error_t *hs_compile_err;
-  ch_compile_error_t *ch_compile_err;
+  if (
+    fold &&
+    fold_duplicates(
+      encoded, expressions, lens, flags, ids, ext, &compiled, &fanout) < 0)
+    goto cleanup;
 
+  Py_BEGIN_ALLOW_THREADS;
   if (literal) {
-    if (self->chimera) {
-      PyErr_Format(
-        PyExc_RuntimeError,
-        "chimera does not support pure literal expressions");
-      goto python_error;
-    }
-    lens = malloc(elements * sizeof(size_t));
-    if (lens == NULL)
-      goto memory_error;
-    for (uint64_t i = 0; i < elements; i++) {
-      lens[i] = strlen(expressions[i]);
-    }
-    hs_error_t hs_err;
-    Py_BEGIN_ALLOW_THREADS;
     hs_err = hs_compile_lit_multi(
       expressions,
       flags,
       ids,
       lens,
-      elements,
+      compiled,
       self->mode,
-      NULL,
-      &self->hs_db,
+      platform,
+      &hs_db,
       &hs_compile_err);
-    free(lens);
-    Py_END_ALLOW_THREADS;
-    free(expressions);
-    free(flags);
-    free(ids);
+  } else if (self->chimera) {
+    ch_err = ch_compile_ext_multi(
+      expressions,
+      flags,
+      ids,
+      compiled,
+      self->mode,
+      0,
+      0,
+      platform,
+      &ch_db,
+      &ch_compile_err);
+  } else {
+    hs_err = hs_compile_ext_multi(
+      expressions,
+      flags,
+      ids,
+      (const struct hs_expr_ext *const *)ext,
+      compiled,
+      self->mode,
+      platform,
+      &hs_db,
+      &hs_compile_err);
+  }
+  Py_END_ALLOW_THREADS;
 
-    if (hs_err != HS_SUCCESS) {
+  if (hs_err != HS_SUCCESS) {
+    if (hs_compile_err == NULL) {
+      PyErr_Format(HyperscanErrors[abs(hs_err)], "error code %i", hs_err);
+    } else if (literal) {
       PyErr_Format(
         HyperscanError,
         "%s (id:%d)",
         hs_compile_err->message,
         hs_compile_err->expression);
-      hs_free_compile_error(hs_compile_err);
-      HS_LOCK_RETURN_NULL();
+    } else {
+      PyErr_SetString(HyperscanError, hs_compile_err->message);
     }
-  } else {
+  } else if (ch_err != CH_SUCCESS) {
+    if (ch_compile_err == NULL)
+      PyErr_Format(HyperscanErrors[abs(ch_err)], "error code %i", ch_err);
+    else
+      PyErr_SetString(HyperscanError, ch_compile_err->message);
+  }
+  if (hs_compile_err != NULL)
+    hs_free_compile_error(hs_compile_err);
+  if (ch_compile_err != NULL)
+    ch_free_compile_error(ch_compile_err);
+
+cleanup:
+  if (encoded != NULL) {
+    for (uint64_t i = 0; i < elements; i++)
+      Py_XDECREF(encoded[i]);
+  }
+  free(encoded);
+  free(expressions);
+  free(lens);
+  free(flags);
+  free(ids);
+  free(ext);
+  free(ext_items);
+  // The GIL was released while compiling, so check again.
+  if (!PyErr_Occurred() && Database_check_engines(self) == 0)
+    Database_check_streams(self);
+
+  // Allocate a fresh scratch space rather than resizing the current one,
+  // which scans of the previous database may still be using. It is
+  // allocated before the database is replaced, so that a failure, e.g.
+  // for a platform this host cannot scan, leaves it unchanged.
+  Scratch *scratch =
+    self->scratch == Py_None ? NULL : (Scratch *)self->scratch;
+  hs_scratch_t *hs_scratch = NULL;
+  ch_scratch_t *ch_scratch = NULL;
+  if (!PyErr_Occurred() && scratch != NULL) {
     if (self->chimera) {
-      ch_error_t ch_err;
-      Py_BEGIN_ALLOW_THREADS;
-      ch_err = ch_compile_ext_multi(
-        expressions,
-        flags,
-        ids,
-        elements,
-        self->mode,
-        0,
-        0,
-        NULL,
-        &self->ch_db,
-        &ch_compile_err);
-      Py_END_ALLOW_THREADS;
-      free(expressions);
-      free(flags);
-      free(ids);
-      HANDLE_CHIMERA_ERR(ch_err, NULL);
+      ch_error_t ch_err = tracked_ch_alloc_scratch(ch_db, &ch_scratch);
+      if (ch_err != CH_SUCCESS)
+        PyErr_Format(HyperscanErrors[abs(ch_err)], "error code %i", ch_err);
     } else {
-      if (oext != Py_None) {
-        ext = malloc(elements * sizeof(struct hs_expr_ext *));
-        for (uint64_t i = 0; i < elements; i++) {
-          ext[i] = malloc(sizeof(struct hs_expr_ext));
-          PyObject *oext_item = PySequence_GetItem(oext, i);
-          if (oext_item == NULL) {
-            PyErr_Format(
-              PyExc_RuntimeError, "failed to get ext item at index: %d", i);
-            goto python_error;
-          }
-          if (!PyArg_ParseTuple(
-                oext_item,
-                "KKKKII",
-                &(ext[i]->flags),
-                &(ext[i]->min_offset),
-                &(ext[i]->max_offset),
-                &(ext[i]->min_length),
-                &(ext[i]->edit_distance),
-                &(ext[i]->hamming_distance))) {
-            PyErr_SetString(PyExc_TypeError, "invalid ext info");
-            Py_XDECREF(oext_item);
-            goto python_error;
-          }
-          Py_XDECREF(oext_item);
-        }
-      }
-      hs_error_t hs_err;
-      Py_BEGIN_ALLOW_THREADS;
-      hs_err = hs_compile_ext_multi(
-        expressions,
-        flags,
-        ids,
-        (const struct hs_expr_ext *const *)ext,
-        elements,
-        self->mode,
-        NULL,
-        &self->hs_db,
-        &hs_compile_err);
-      Py_END_ALLOW_THREADS;
-
-      free(expressions);
-      free(flags);
-      free(ids);
-      if (hs_err != HS_SUCCESS) {
-        PyErr_SetString(HyperscanError, hs_compile_err->message);
-        hs_free_compile_error(hs_compile_err);
-        HS_LOCK_RETURN_NULL();
-      }
+      hs_error_t hs_err = tracked_alloc_scratch(hs_db, &hs_scratch);
+      if (hs_err != HS_SUCCESS)
+        PyErr_Format(HyperscanErrors[abs(hs_err)], "error code %i", hs_err);
     }
-    free(ext);
   }
-
-  if (self->scratch == Py_None) {
-    self->scratch =
-      PyObject_CallFunction((PyObject *)&ScratchType, "O", (PyObject *)self, 0);
+  if (PyErr_Occurred()) {
+    if (hs_db != NULL)
+      hs_free_database(hs_db);
+    if (ch_db != NULL)
+      ch_free_database(ch_db);
+    free(fanout);
+    HS_LOCK_RETURN_NULL();
   }
 
-  Scratch *scratch = ((Scratch *)self->scratch);
-
-  if (self->chimera) {
-    ch_error_t ch_err;
-    if (scratch->ch_scratch != NULL) {
-      ch_err = ch_free_scratch(scratch->ch_scratch);
-      HANDLE_CHIMERA_ERR(ch_err, NULL);
-      scratch->ch_scratch = NULL;
-    }
-    ch_err = ch_alloc_scratch(self->ch_db, &scratch->ch_scratch);
-    HANDLE_CHIMERA_ERR(ch_err, NULL);
-  } else {
-    hs_error_t hs_err;
-    if (scratch->hs_scratch != NULL) {
-      hs_err = hs_free_scratch(scratch->hs_scratch);
-      HANDLE_HYPERSCAN_ERR(hs_err, NULL);
-      scratch->hs_scratch = NULL;
+  // Publish the new database and scratch together, without releasing
+  // the GIL, so that a scan never sees one without the other; the ones
+  // replaced are only retired afterwards.
+  hs_retired replaced = {
+    self->hs_db,
+    self->ch_db,
+    self->region,
+    NULL,
+    NULL,
+    self->fanout,
+    self->shared};
+  memset(&self->region, 0, sizeof(self->region));
+  self->shared = NULL;
+  self->hs_db = hs_db;
+  self->ch_db = ch_db;
+  self->fanout = fanout;
+  if (scratch != NULL) {
+    if (self->chimera) {
+      replaced.ch_scratch = scratch->ch_scratch;
+      scratch->ch_scratch = ch_scratch;
+    } else {
+      replaced.hs_scratch = scratch->hs_scratch;
+      scratch->hs_scratch = hs_scratch;
     }
-    hs_err = hs_alloc_scratch(self->hs_db, &scratch->hs_scratch);
-    HANDLE_HYPERSCAN_ERR(hs_err, NULL);
+  }
+  Database_retire(self, &replaced);
+  Database_track(self);
+
+  if (scratch == NULL && platform == NULL) {
+    // A new scratch object is already sized for the new database. One
+    // for another platform may not be scannable here, so its scratch is
+    // left to be allocated on first use.
+    if (Database_scratch(self) == NULL)
+      HS_LOCK_RETURN_NULL();
   }
 
-  HS_LOCK_RETURN(Py_NewRef(Py_None));
-
-memory_error:
-  PyErr_NoMemory();
-  HS_LOCK_RETURN_NULL();
+  // Stream state size depends on the patterns, so resize the arena.
+  if (
+    !self->chimera && self->stream_arena != NULL &&
+    Database_reset_stream_arena(self, self->stream_arena->capacity) < 0)
+    HS_LOCK_RETURN_NULL();
 
-python_error:
-  free(expressions);
-  free(flags);
-  free(ids);
-  HS_LOCK_RETURN_NULL();
+  HS_LOCK_RETURN(Py_NewRef(Py_None));
 }
 
 static PyObject *Database_info(Database *self, PyObject *args)
@@ -657,7 +1628,7 @@ static PyObject *Database_info(Database *self, PyObject *args)
 
   PyObject *oinfo = PyBytes_FromString(info);
   Py_INCREF(oinfo);
-  free(info);
+  hs_tracked_free(info);
   HS_LOCK_RETURN(oinfo);
 }
 
@@ -680,7 +1651,128 @@ static PyObject *Database_size(Database *self, PyObject *args)
   HS_LOCK_RETURN(odatabase_size);
 }
 
-static PyObject *Database_scan(Database *self, PyObject *args, PyObject *kwds)
+static PyObject *Database_share(Database *self, PyObject *args)
+{
+  HS_LOCK_DECLARE();
+  HS_LOCK_ACQUIRE_OR_RETURN_NULL();
+
+  if (self->chimera) {
+    PyErr_SetString(PyExc_TypeError, "chimera databases cannot be shared");
+    HS_LOCK_RETURN_NULL();
+  }
+  if (self->hs_db == NULL) {
+    PyErr_SetString(PyExc_RuntimeError, "database is not compiled");
+    HS_LOCK_RETURN_NULL();
+  }
+  if (self->region.obj != NULL) {
+    PyErr_SetString(
+      PyExc_TypeError,
+      "databases backed by a caller-provided buffer cannot be shared");
+    HS_LOCK_RETURN_NULL();
+  }
+
+  Database *other = (Database *)PyObject_CallFunction(
+    (PyObject *)Py_TYPE(self), "OI", Py_None, self->mode);
+  if (other == NULL)
+    HS_LOCK_RETURN_NULL();
+  if (self->fanout != NULL) {
+    const hs_fanout *fanout = self->fanout;
+    size_t length = sizeof(hs_fanout) +
+      (fanout->count + 1 + fanout->offsets[fanout->count]) * sizeof(uint32_t);
+    other->fanout = malloc(length);
+    if (other->fanout == NULL) {
+      Py_DECREF(other);
+      PyErr_NoMemory();
+      HS_LOCK_RETURN_NULL();
+    }
+    memcpy(other->fanout, fanout, length);
+    other->fanout->offsets = (uint32_t *)(other->fanout + 1);
+    other->fanout->ids = other->fanout->offsets + fanout->count + 1;
+  }
+
+  if (self->shared == NULL) {
+    hs_shared_db *shared = PyMem_RawMalloc(sizeof(hs_shared_db));
+    if (shared == NULL) {
+      Py_DECREF(other);
+      PyErr_NoMemory();
+      HS_LOCK_RETURN_NULL();
+    }
+    shared->refs = 1;
+    shared->hs_db = self->hs_db;
+    shared->size = self->tracked_size;
+    // The count moves from this database to the shared holder.
+    memory_stats_update(HS_OBJ_DATABASE, 1, shared->size, 0);
+    self->shared = shared;
+    Database_track(self);
+  }
+  PyThread_acquire_lock(g_alloc_lock, WAIT_LOCK);
+  self->shared->refs++;
+  PyThread_release_lock(g_alloc_lock);
+  other->shared = self->shared;
+  other->hs_db = self->hs_db;
+  HS_LOCK_RETURN((PyObject *)other);
+}
+
+static PyObject *Database_set_stream_arena(
+  Database *self, PyObject *args, PyObject *kwds)
+{
+  HS_LOCK_DECLARE();
+  HS_LOCK_ACQUIRE_OR_RETURN_NULL();
+
+  Py_ssize_t capacity;
+  static char *kwlist[] = {"capacity", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "n", kwlist, &capacity))
+    HS_LOCK_RETURN_NULL();
+  if (capacity < 0) {
+    PyErr_SetString(PyExc_ValueError, "capacity must not be negative");
+    HS_LOCK_RETURN_NULL();
+  }
+  if (self->chimera || !(self->mode & HS_MODE_STREAM)) {
+    PyErr_SetString(
+      PyExc_RuntimeError, "stream arenas require a streaming database");
+    HS_LOCK_RETURN_NULL();
+  }
+  if (self->hs_db == NULL) {
+    PyErr_SetString(PyExc_RuntimeError, "database has not been compiled");
+    HS_LOCK_RETURN_NULL();
+  }
+  if (Database_check_engines(self) < 0)
+    HS_LOCK_RETURN_NULL();
+  if (Database_reset_stream_arena(self, (size_t)capacity) < 0)
+    HS_LOCK_RETURN_NULL();
+  HS_LOCK_RETURN(Py_NewRef(Py_None));
+}
+
+static PyObject *Database_stream_arena_stats(Database *self, PyObject *args)
+{
+  HS_LOCK_DECLARE();
+  HS_LOCK_ACQUIRE_OR_RETURN_NULL();
+
+  hs_stream_arena *arena = self->stream_arena;
+  if (arena == NULL)
+    HS_LOCK_RETURN(Py_NewRef(Py_None));
+  PyThread_acquire_lock(g_alloc_lock, WAIT_LOCK);
+  size_t in_use = arena->in_use;
+  size_t peak = arena->peak;
+  size_t fallbacks = arena->fallbacks;
+  PyThread_release_lock(g_alloc_lock);
+  PyObject *ostats = Py_BuildValue(
+    "{s:n,s:n,s:n,s:n,s:n}",
+    "capacity",
+    (Py_ssize_t)arena->capacity,
+    "block_size",
+    (Py_ssize_t)arena->block_size,
+    "in_use",
+    (Py_ssize_t)in_use,
+    "peak",
+    (Py_ssize_t)peak,
+    "fallbacks",
+    (Py_ssize_t)fallbacks);
+  HS_LOCK_RETURN(ostats);
+}
+
+static PyObject *Database_scan_pinned(
+  Database *self, PyObject *args, PyObject *kwds)
 {
   HS_LOCK_DECLARE();
   HS_LOCK_ACQUIRE_OR_RETURN_NULL();
@@ -711,7 +1803,14 @@ static PyObject *Database_scan(Database *self, PyObject *args, PyObject *kwds)
         &octx,
         &oscratch))
     HS_LOCK_RETURN_NULL();
-  py_scan_callback_ctx cctx = {ocallback, octx, 1};
+  // The fanout, database and scratch are read just before the GIL is
+  // released: a concurrent compile() swaps them in together, and the pin
+  // keeps the ones read alive until the scan returns.
+  py_scan_callback_ctx cctx = {ocallback, octx, 1, NULL};
+  Scratch *scratch =
+    oscratch == Py_None ? Database_scratch(self) : (Scratch *)oscratch;
+  if (scratch == NULL)
+    HS_LOCK_RETURN_NULL();
 
   if (self->mode == HS_MODE_VECTORED) {
     char **data;
@@ -757,15 +1856,17 @@ static PyObject *Database_scan(Database *self, PyObject *args, PyObject *kwds)
     }
 
     hs_error_t hs_err;
+    hs_database_t *hs_db = self->hs_db;
+    hs_scratch_t *hs_scratch = scratch->hs_scratch;
+    cctx.fanout = self->fanout;
     Py_BEGIN_ALLOW_THREADS;
     hs_err = hs_scan_vector(
-      self->hs_db,
+      hs_db,
       (const char *const *)data,
       lengths,
       num_buffers,
       flags,
-      oscratch == Py_None ? ((Scratch *)self->scratch)->hs_scratch
-                          : ((Scratch *)oscratch)->hs_scratch,
+      hs_scratch,
       ocallback == Py_None ? NULL : hs_match_handler,
       ocallback == Py_None ? NULL : (void *)&cctx);
     Py_END_ALLOW_THREADS;
@@ -789,14 +1890,16 @@ static PyObject *Database_scan(Database *self, PyObject *args, PyObject *kwds)
 
     if (self->chimera) {
       ch_error_t ch_err;
+      ch_database_t *ch_db = self->ch_db;
+      ch_scratch_t *ch_scratch = scratch->ch_scratch;
+      cctx.fanout = self->fanout;
       Py_BEGIN_ALLOW_THREADS;
       ch_err = ch_scan(
-        self->ch_db,
+        ch_db,
         data,
         length,
         flags,
-        oscratch == Py_None ? ((Scratch *)self->scratch)->ch_scratch
-                            : ((Scratch *)oscratch)->ch_scratch,
+        ch_scratch,
         ocallback == Py_None ? NULL : ch_match_handler,
         NULL,
         ocallback == Py_None ? NULL : (void *)&cctx);
@@ -808,14 +1911,16 @@ static PyObject *Database_scan(Database *self, PyObject *args, PyObject *kwds)
       HANDLE_CHIMERA_ERR(ch_err, NULL);
     } else {
       hs_error_t hs_err;
+      hs_database_t *hs_db = self->hs_db;
+      hs_scratch_t *hs_scratch = scratch->hs_scratch;
+      cctx.fanout = self->fanout;
       Py_BEGIN_ALLOW_THREADS;
       hs_err = hs_scan(
-        self->hs_db,
+        hs_db,
         data,
         length,
         flags,
-        oscratch == Py_None ? ((Scratch *)self->scratch)->hs_scratch
-                            : ((Scratch *)oscratch)->hs_scratch,
+        hs_scratch,
         ocallback == Py_None ? NULL : hs_match_handler,
         ocallback == Py_None ? NULL : (void *)&cctx);
       Py_END_ALLOW_THREADS;
@@ -832,6 +1937,151 @@ static PyObject *Database_scan(Database *self, PyObject *args, PyObject *kwds)
   HS_LOCK_RETURN(Py_NewRef(Py_None));
 }
 
+/* Faults in the pages backing [addr, addr + length) ahead of use, and
+ * for writable memory makes them private, so the first scan does not
+ * pay for it. */
+static void hs_prefault(const void *addr, size_t length, int writable)
+{
+  if (length == 0)
+    return;
+#ifdef HS_HAVE_MMAP
+  uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+  uintptr_t start = (uintptr_t)addr & ~(page - 1);
+  size_t span = (uintptr_t)addr + length - start;
+#if defined(MADV_POPULATE_READ) && defined(MADV_POPULATE_WRITE)
+  if (
+    madvise(
+      (void *)start,
+      span,
+      writable ? MADV_POPULATE_WRITE : MADV_POPULATE_READ) == 0)
+    return;
+#endif
+#ifdef MADV_WILLNEED
+  madvise((void *)start, span, MADV_WILLNEED);
+#endif
+#else
+  (void)writable;
+#endif
+  // Reading faults in file-backed and already written pages; fresh
+  // anonymous pages only get their final copy on the first write, which
+  // is left to the scan rather than risk racing one.
+  const volatile char *p = addr;
+  for (size_t i = 0; i < length; i += 4096)
+    (void)p[i];
+  (void)p[length - 1];
+}
+
+/* Prefaults the database and a scratch space for it, then scans a
+ * synthetic block to bring the engine's hot paths into the caches. Must
+ * be called with the database pinned or otherwise private. */
+static int Database_warm(Database *self, Scratch *scratch)
+{
+  if (self->hs_db == NULL && self->ch_db == NULL) {
+    PyErr_SetString(PyExc_RuntimeError, "database is not compiled");
+    return -1;
+  }
+  if (scratch == NULL && (scratch = Database_scratch(self)) == NULL)
+    return -1;
+
+  // Read together under the GIL, as a concurrent compile() swaps them.
+  hs_database_t *hs_db = self->hs_db;
+  ch_database_t *ch_db = self->ch_db;
+  hs_scratch_t *hs_scratch = scratch->hs_scratch;
+  ch_scratch_t *ch_scratch = scratch->ch_scratch;
+  size_t db_size = 0;
+  size_t scratch_size = 0;
+  if (!self->chimera) {
+    hs_database_size(hs_db, &db_size);
+    // hs_scratch_size() includes alignment padding in front of the
+    // structure, which must not be read past its end.
+    scratch_size = hs_scratch_bytes(hs_scratch);
+    scratch_size = scratch_size > 64 ? scratch_size - 64 : 0;
+  }
+
+  char block[4096];
+  for (size_t i = 0; i < sizeof(block); i++)
+    block[i] = (char)i;
+  const char *blocks[] = {block};
+  unsigned int lengths[] = {sizeof(block)};
+
+  hs_error_t hs_err = HS_SUCCESS;
+  ch_error_t ch_err = CH_SUCCESS;
+  Py_BEGIN_ALLOW_THREADS;
+  if (self->chimera) {
+    ch_err =
+      ch_scan(ch_db, block, sizeof(block), 0, ch_scratch, NULL, NULL, NULL);
+  } else {
+    hs_prefault(hs_db, db_size, 0);
+    hs_prefault(hs_scratch, scratch_size, 1);
+    if (self->mode & HS_MODE_STREAM) {
+      hs_stream_t *stream = NULL;
+      hs_err = hs_open_stream(hs_db, 0, &stream);
+      if (hs_err == HS_SUCCESS) {
+        hs_err = hs_scan_stream(
+          stream, block, sizeof(block), 0, hs_scratch, NULL, NULL);
+        hs_error_t close_err = hs_close_stream(stream, hs_scratch, NULL, NULL);
+        if (hs_err == HS_SUCCESS)
+          hs_err = close_err;
+      }
+    } else if (self->mode & HS_MODE_VECTORED) {
+      hs_err =
+        hs_scan_vector(hs_db, blocks, lengths, 1, 0, hs_scratch, NULL, NULL);
+    } else {
+      hs_err =
+        hs_scan(hs_db, block, sizeof(block), 0, hs_scratch, NULL, NULL);
+    }
+  }
+  Py_END_ALLOW_THREADS;
+  if (ch_err != CH_SUCCESS) {
+    PyErr_Format(HyperscanErrors[abs(ch_err)], "error code %i", ch_err);
+    return -1;
+  }
+  if (hs_err != HS_SUCCESS) {
+    PyErr_Format(HyperscanErrors[abs(hs_err)], "error code %i", hs_err);
+    return -1;
+  }
+  return 0;
+}
+
+static PyObject *Database_warmup_pinned(
+  Database *self, PyObject *args, PyObject *kwds)
+{
+  HS_LOCK_DECLARE();
+  HS_LOCK_ACQUIRE_OR_RETURN_NULL();
+
+  PyObject *oscratch = Py_None;
+  static char *kwlist[] = {"scratch", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &oscratch))
+    HS_LOCK_RETURN_NULL();
+  if (oscratch != Py_None && !PyObject_TypeCheck(oscratch, &ScratchType)) {
+    PyErr_SetString(PyExc_TypeError, "scratch must be a Scratch");
+    HS_LOCK_RETURN_NULL();
+  }
+  Scratch *scratch = oscratch == Py_None ? NULL : (Scratch *)oscratch;
+  if (Database_warm(self, scratch) < 0)
+    HS_LOCK_RETURN_NULL();
+  HS_LOCK_RETURN(Py_NewRef(Py_None));
+}
+
+static PyObject *Database_warmup(
+  Database *self, PyObject *args, PyObject *kwds)
+{
+  Database_pin(self);
+  PyObject *result = Database_warmup_pinned(self, args, kwds);
+  Database_unpin(self);
+  return result;
+}
+
+static PyObject *Database_scan(Database *self, PyObject *args, PyObject *kwds)
+{
+  // Keeps the database and scratch in use alive across a concurrent
+  // compile, which swaps in new ones and retires these.
+  Database_pin(self);
+  PyObject *result = Database_scan_pinned(self, args, kwds);
+  Database_unpin(self);
+  return result;
+}
+
 static PyObject *Database_stream(Database *self, PyObject *args, PyObject *kwds)
 {
   HS_LOCK_DECLARE();
@@ -840,37 +2090,163 @@ static PyObject *Database_stream(Database *self, PyObject *args, PyObject *kwds)
   uint32_t flags = 0;
   PyObject *ocallback = Py_None;
   PyObject *octx = Py_None;
+  PyObject *oscratch = Py_None;
+  Py_ssize_t coalesce_size = 0;
+  uint32_t coalesce_writes = 0;
   static char *kwlist[] = {
     "match_event_handler",
     "flags",
     "context",
+    "coalesce_size",
+    "coalesce_writes",
+    "scratch",
     NULL,
   };
   if (!PyArg_ParseTupleAndKeywords(
-        args, kwds, "O|IO", kwlist, &ocallback, &flags, &octx))
+        args,
+        kwds,
+        "O|IOnIO",
+        kwlist,
+        &ocallback,
+        &flags,
+        &octx,
+        &coalesce_size,
+        &coalesce_writes,
+        &oscratch))
     HS_LOCK_RETURN_NULL();
-  PyObject *stream = PyObject_CallFunction(
-    (PyObject *)&StreamType, "OIOO", (PyObject *)self, flags, ocallback, octx);
-  if (PyErr_Occurred())
+  PyObject *ostream_args = Py_BuildValue(
+    "(OIOO)", (PyObject *)self, flags, ocallback, octx);
+  PyObject *ostream_kwds = Py_BuildValue(
+    "{s:n,s:I}",
+    "coalesce_size",
+    coalesce_size,
+    "coalesce_writes",
+    coalesce_writes);
+  if (
+    ostream_kwds != NULL && oscratch != Py_None &&
+    PyDict_SetItemString(ostream_kwds, "scratch", oscratch) < 0)
+    Py_CLEAR(ostream_kwds);
+  PyObject *stream = NULL;
+  if (ostream_args != NULL && ostream_kwds != NULL)
+    stream =
+      PyObject_Call((PyObject *)&StreamType, ostream_args, ostream_kwds);
+  Py_XDECREF(ostream_args);
+  Py_XDECREF(ostream_kwds);
+  if (stream == NULL)
     HS_LOCK_RETURN_NULL();
-  Py_INCREF(stream);
   HS_LOCK_RETURN(stream);
 }
 
+static PyObject *Database_reduce_ex(Database *self, PyObject *args)
+{
+  HS_LOCK_DECLARE();
+  HS_LOCK_ACQUIRE_OR_RETURN_NULL();
+
+  int protocol;
+  if (!PyArg_ParseTuple(args, "i", &protocol))
+    HS_LOCK_RETURN_NULL();
+
+  // Databases that were never compiled are rebuilt empty.
+  if (self->hs_db == NULL && self->ch_db == NULL)
+    HS_LOCK_RETURN(Py_BuildValue(
+      "(O(OIO))",
+      (PyObject *)Py_TYPE(self),
+      Py_None,
+      self->mode,
+      self->chimera ? Py_True : Py_False));
+  if (self->chimera) {
+    PyErr_SetString(
+      PyExc_TypeError, "cannot pickle a compiled chimera database");
+    HS_LOCK_RETURN_NULL();
+  }
+  if (self->fanout != NULL) {
+    PyErr_SetString(
+      PyExc_TypeError,
+      "cannot pickle a database compiled with fold_duplicates");
+    HS_LOCK_RETURN_NULL();
+  }
+
+  char *buf;
+  size_t length;
+  hs_error_t hs_err;
+  Py_BEGIN_ALLOW_THREADS;
+  hs_err = hs_serialize_database(self->hs_db, &buf, &length);
+  Py_END_ALLOW_THREADS;
+  HANDLE_HYPERSCAN_ERR(hs_err, NULL);
+  PyObject *obytes = PyBytes_FromStringAndSize(buf, length);
+  hs_tracked_free(buf);
+  if (obytes == NULL)
+    HS_LOCK_RETURN_NULL();
+
+  // With protocol 5 the serialized database can be sent out-of-band,
+  // e.g. straight into shared memory, instead of being copied into the
+  // pickle stream.
+  PyObject *odata = obytes;
+  if (protocol >= 5) {
+    odata = PyPickleBuffer_FromObject(obytes);
+    Py_DECREF(obytes);
+    if (odata == NULL)
+      HS_LOCK_RETURN_NULL();
+  }
+
+  PyObject *oloadb = NULL;
+  PyObject *omodule = PyImport_ImportModule("hyperscan._hs_ext");
+  if (omodule != NULL) {
+    oloadb = PyObject_GetAttrString(omodule, "loadb");
+    Py_DECREF(omodule);
+  }
+  PyObject *oreduced = NULL;
+  if (oloadb != NULL) {
+    oreduced = Py_BuildValue("(O(NI))", oloadb, odata, self->mode);
+    Py_DECREF(oloadb);
+  } else {
+    Py_DECREF(odata);
+  }
+  HS_LOCK_RETURN(oreduced);
+}
+
+static PyObject *Database_get_chimera(Database *self, void *closure)
+{
+  return PyBool_FromLong(self->chimera);
+}
+
+static PyObject *Database_get_scratch(Database *self, void *closure)
+{
+  return Py_NewRef(self->scratch);
+}
+
+static int Database_set_scratch(
+  Database *self, PyObject *value, void *closure)
+{
+  Py_XSETREF(self->scratch, Py_NewRef(value != NULL ? value : Py_None));
+  self->owns_scratch = 0;
+  return 0;
+}
+
 static PyMemberDef Database_members[] = {
   {"mode", T_INT, offsetof(Database, mode), 0, "int: Scanning mode."},
+  {NULL}};
+
+static PyGetSetDef Database_getset[] = {
+  {"chimera",
+   (getter)Database_get_chimera,
+   NULL,
+   "bool: Indicates if Chimera support is enabled.",
+   NULL},
   {"scratch",
-   T_OBJECT_EX,
-   offsetof(Database, scratch),
-   0,
-   ":class:`Scratch`: Scratch space object."},
+   (getter)Database_get_scratch,
+   (setter)Database_set_scratch,
+   ":class:`Scratch`: Scratch space object, allocated on first use if\n"
+   "not provided.",
+   NULL},
   {NULL}};
 
 static PyMethodDef Database_methods[] = {
   {"compile",
    (PyCFunction)Database_compile,
    METH_VARARGS | METH_KEYWORDS,
-   "compile(expressions, ids=None, elements=None, flags=0, literal=False)\n\n"
+   "compile(expressions, ids=None, elements=None, flags=0, literal=False,\n"
+   "        ext=None, platform=None, fold_duplicates=False)\n\n"
    "    Compiles regular expressions.\n\n"
    "    Args:\n"
    "        expressions (sequence of str): A sequence of regular\n"
@@ -883,12 +2259,33 @@ static PyMethodDef Database_methods[] = {
    "            Sequence of flags associated with each expression, or a\n"
    "            single value which is applied to all expressions.\n"
    "        literal (bool, optional): If True, uses the pure literal\n"
-   "            expression compiler introduced in Hyperscan 5.2.0.\n\n"
+   "            expression compiler introduced in Hyperscan 5.2.0.\n"
+   "            Literals are matched byte for byte and may contain NUL\n"
+   "            bytes.\n"
    "        ext (sequence of tuple, optional): A list of tuples used to "
    "            define extended behavior for each pattern. Tuples must \n"
    "            contain **flags**, **min_offset**, **max_offset**, \n"
    "            **min_length**, **edit_distance**, and **hamming_distance**.\n"
-   "            See hyperscan documentation for more information.\n\n"},
+   "            See hyperscan documentation for more information.\n"
+   "        platform (tuple, optional): The **tune** family and\n"
+   "            **cpu_features** bitmask of the CPU the database will\n"
+   "            run on, e.g. a :class:`Platform`. Defaults to the\n"
+   "            current host.\n"
+   "        fold_duplicates (bool, optional): If True, compiles each\n"
+   "            distinct expression (by bytes, flags and **ext**) once\n"
+   "            and reports its matches under the ids of all of its\n"
+   "            duplicates, in order. Ignored for sets using\n"
+   "            :const:`HS_FLAG_COMBINATION`. Folded databases cannot\n"
+   "            be serialized.\n\n"},
+  {"__reduce_ex__",
+   (PyCFunction)Database_reduce_ex,
+   METH_VARARGS,
+   "__reduce_ex__(protocol)\n\n"
+   "    Supports pickling compiled block, stream and vectored databases.\n\n"
+   "    The database is serialized with ``hs_serialize_database``. With\n"
+   "    pickle protocol 5 the serialized bytes are wrapped in a\n"
+   "    :class:`pickle.PickleBuffer` so they can be transferred\n"
+   "    out-of-band. Compiled Chimera databases cannot be pickled.\n\n"},
   {"info",
    (PyCFunction)Database_info,
    METH_VARARGS,
@@ -924,8 +2321,10 @@ static PyMethodDef Database_methods[] = {
   {"stream",
    (PyCFunction)Database_stream,
    METH_VARARGS | METH_KEYWORDS,
-   "stream(match_event_handler=None, flags=0, context=None)\n\n"
+   "stream(match_event_handler=None, flags=0, context=None,\n"
+   "       coalesce_size=0, coalesce_writes=0, scratch=None)\n\n"
    "    Returns a new stream context manager.\n\n"
+   "    The database cannot be recompiled while the stream is open.\n\n"
    "    Args:\n"
    "        match_event_handler (callable, optional): The match callback,\n"
    "            which is invoked for each match result, and passed the\n"
@@ -935,15 +2334,67 @@ static PyMethodDef Database_methods[] = {
    "            :class:`Database` instance.\n"
    "        flags (int): Currently unused.\n"
    "        context (:obj:`object`): A context object passed as the last\n"
-   "            arg to **match_event_handler**.\n\n"},
-  {NULL}};
-
-static PyTypeObject DatabaseType = {
-  PyVarObject_HEAD_INIT(NULL, 0) "hyperscan.Database", /* tp_name */
-  sizeof(Database),                                    /* tp_basicsize */
-  0,                                                   /* tp_itemsize */
-  (destructor)Database_dealloc,                        /* tp_dealloc */
-  0,                                                   /* tp_print */
+   "            arg to **match_event_handler**.\n"
+   "        coalesce_size (int, optional): If non-zero, writes shorter\n"
+   "            than this many bytes are buffered and scanned together\n"
+   "            once the buffer fills.\n"
+   "        coalesce_writes (int, optional): If non-zero, the buffer is\n"
+   "            also scanned after this many buffered writes.\n"
+   "        scratch (:class:`Scratch`, optional): Scratch space used by\n"
+   "            calls on the stream that do not pass their own.\n\n"},
+  {"warmup",
+   (PyCFunction)Database_warmup,
+   METH_VARARGS | METH_KEYWORDS,
+   "warmup(scratch=None)\n\n"
+   "    Prepares the database for low-latency scanning.\n\n"
+   "    Faults in the pages of the database and of the scratch space,\n"
+   "    which are otherwise loaded lazily by the first scans after\n"
+   "    :func:`loadb` or :meth:`compile`, then scans a synthetic block\n"
+   "    (or stream) to bring the matching engine into the CPU caches.\n"
+   "    No matches are reported.\n\n"
+   "    Args:\n"
+   "        scratch (:class:`Scratch`, optional): Scratch space to warm\n"
+   "            up instead of the database's own, e.g. the one a\n"
+   "            worker thread will scan with.\n\n"},
+  {"share",
+   (PyCFunction)Database_share,
+   METH_NOARGS,
+   "share()\n\n"
+   "    Returns a new database that uses the same compiled database.\n\n"
+   "    The compiled bytes are held once, and freed when neither this\n"
+   "    database nor any of its shares uses them any more. The new\n"
+   "    database has its own scratch space and stream arena, and\n"
+   "    recompiling either database leaves the other unchanged.\n\n"
+   "    Returns:\n"
+   "        :class:`Database`: A database of the same type and mode.\n\n"},
+  {"set_stream_arena",
+   (PyCFunction)Database_set_stream_arena,
+   METH_VARARGS | METH_KEYWORDS,
+   "set_stream_arena(capacity)\n\n"
+   "    Preallocates stream state for streams opened on this database.\n\n"
+   "    Stream state is carved from a slab of **capacity** fixed-size\n"
+   "    blocks instead of a heap allocation per stream. Streams opened\n"
+   "    while the slab is exhausted fall back to the heap.\n\n"
+   "    Args:\n"
+   "        capacity (int): Number of stream states to preallocate, or\n"
+   "            0 to remove the arena.\n\n"},
+  {"stream_arena_stats",
+   (PyCFunction)Database_stream_arena_stats,
+   METH_NOARGS,
+   "stream_arena_stats()\n\n"
+   "    Returns stream arena usage statistics.\n\n"
+   "    Returns:\n"
+   "        dict: **capacity**, **block_size**, **in_use**, **peak**, and\n"
+   "        **fallbacks** (heap allocations made because the arena was\n"
+   "        full), or None if no arena is set.\n\n"},
+  {NULL}};
+
+static PyTypeObject DatabaseType = {
+  PyVarObject_HEAD_INIT(NULL, 0) "hyperscan.Database", /* tp_name */
+  sizeof(Database),                                    /* tp_basicsize */
+  0,                                                   /* tp_itemsize */
+  (destructor)Database_dealloc,                        /* tp_dealloc */
+  0,                                                   /* tp_print */
   0,                                                   /* tp_getattr */
   0,                                                   /* tp_setattr */
   0,                                                   /* tp_reserved */
@@ -970,12 +2421,12 @@ static PyTypeObject DatabaseType = {
   0,                       /* tp_traverse */
   0,                       /* tp_clear */
   0,                       /* tp_richcompare */
-  0,                       /* tp_weaklistoffset */
+  offsetof(Database, weakreflist), /* tp_weaklistoffset */
   0,                       /* tp_iter */
   0,                       /* tp_iternext */
   Database_methods,        /* tp_methods */
   Database_members,        /* tp_members */
-  0,                       /* tp_getset */
+  Database_getset,         /* tp_getset */
   0,                       /* tp_base */
   0,                       /* tp_dict */
   0,                       /* tp_descr_get */
@@ -988,8 +2439,21 @@ static PyTypeObject DatabaseType = {
 
 static void Stream_dealloc(Stream *self)
 {
-  if (self->cctx != NULL)
+  // Release the state of a stream that was never closed; without a
+  // scratch space no matches are reported.
+  if (self->identifier != NULL) {
+    tracked_close_stream(
+      self->identifier, self->state_bytes, NULL, NULL, NULL);
+    Database_count_streams((Database *)self->database, -1);
+  }
+  Py_XDECREF(self->database);
+  Py_XDECREF(self->scratch);
+  PyMem_RawFree(self->coalesce_buf);
+  if (self->cctx != NULL) {
+    Py_DECREF(self->cctx->callback);
+    Py_DECREF(self->cctx->ctx);
     free(self->cctx);
+  }
   Py_TYPE(self)->tp_free((PyObject *)self);
 }
 
@@ -1000,13 +2464,24 @@ static PyObject *Stream_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
   self = (Stream *)type->tp_alloc(type, 0);
   if (self != NULL) {
     self->flags = 0;
-    self->database = Py_None;
-    self->scratch = Py_None;
+    self->database = Py_NewRef(Py_None);
+    self->scratch = Py_NewRef(Py_None);
   }
 
   return (PyObject *)self;
 }
 
+/* Returns the scratch space for a stream call: the one passed in, else
+ * the one the stream was created with, else the database's own. */
+static Scratch *Stream_scratch(Stream *self, PyObject *oscratch)
+{
+  if (oscratch == Py_None)
+    oscratch = self->scratch;
+  if (oscratch != NULL && oscratch != Py_None)
+    return (Scratch *)oscratch;
+  return Database_scratch((Database *)self->database);
+}
+
 static int Stream_init(Stream *self, PyObject *args, PyObject *kwds)
 {
   static char *kwlist[] = {
@@ -1015,26 +2490,67 @@ static int Stream_init(Stream *self, PyObject *args, PyObject *kwds)
     "match_event_handler",
     "context",
     "scratch",
+    "coalesce_size",
+    "coalesce_writes",
     NULL,
   };
-  self->cctx = malloc(sizeof(py_scan_callback_ctx));
+  PyObject *odatabase, *ocallback = Py_None, *octx = Py_None;
+  PyObject *oscratch = Py_None;
+  Py_ssize_t coalesce_size = 0;
+  uint32_t coalesce_writes = 0;
   if (!PyArg_ParseTupleAndKeywords(
         args,
         kwds,
-        "O|IOOO!",
+        "O|IOOO!nI",
         kwlist,
-        &self->database,
+        &odatabase,
         &self->flags,
-        &self->cctx->callback,
-        &self->cctx->ctx,
-        &self->scratch,
-        &ScratchType))
+        &ocallback,
+        &octx,
+        &ScratchType,
+        &oscratch,
+        &coalesce_size,
+        &coalesce_writes))
+    return -1;
+  if (coalesce_size < 0 || (size_t)coalesce_size > UINT_MAX) {
+    PyErr_SetString(PyExc_ValueError, "coalesce_size is out of range");
     return -1;
-  if (!PyObject_IsInstance(self->database, (PyObject *)&DatabaseType)) {
+  }
+  if (self->coalesce_len > 0) {
+    PyErr_SetString(PyExc_RuntimeError, "stream has unflushed data");
+    return -1;
+  }
+  if ((size_t)coalesce_size != self->coalesce_size) {
+    char *buf = NULL;
+    if (coalesce_size > 0 && (buf = PyMem_RawMalloc(coalesce_size)) == NULL) {
+      PyErr_NoMemory();
+      return -1;
+    }
+    PyMem_RawFree(self->coalesce_buf);
+    self->coalesce_buf = buf;
+    self->coalesce_size = (size_t)coalesce_size;
+  }
+  self->coalesce_writes = coalesce_writes;
+  if (!PyObject_IsInstance(odatabase, (PyObject *)&DatabaseType)) {
     PyErr_SetString(
       PyExc_TypeError, "database must be a hyperscan.Database instance");
     return -1;
   }
+  if (self->cctx == NULL) {
+    self->cctx = malloc(sizeof(py_scan_callback_ctx));
+    if (self->cctx == NULL) {
+      PyErr_NoMemory();
+      return -1;
+    }
+  } else {
+    Py_DECREF(self->cctx->callback);
+    Py_DECREF(self->cctx->ctx);
+  }
+  self->cctx->callback = Py_NewRef(ocallback);
+  self->cctx->ctx = Py_NewRef(octx);
+  // The stream state must not outlive its database.
+  Py_SETREF(self->database, Py_NewRef(odatabase));
+  Py_SETREF(self->scratch, Py_NewRef(oscratch));
   return 0;
 }
 
@@ -1051,25 +2567,44 @@ static PyObject *Stream_close(Stream *self, PyObject *args, PyObject *kwds)
         kwds,
         "|O!OO",
         kwlist,
-        &oscratch,
         &ScratchType,
+        &oscratch,
         &ocallback,
         &octx))
     HS_LOCK_RETURN_NULL();
   Database *db = (Database *)self->database;
   Scratch *scratch;
-  if (PyObject_Not(oscratch))
-    oscratch = ((Database *)self->database)->scratch;
   cctx.callback = PyObject_IsTrue(ocallback) ? ocallback : self->cctx->callback;
   cctx.ctx = PyObject_IsTrue(octx) ? octx : self->cctx->ctx;
-  if (PyObject_IsTrue(oscratch) && cctx.callback != NULL)
-    scratch = (Scratch *)oscratch;
-  else
-    scratch = (Scratch *)db->scratch;
+  cctx.fanout = db->fanout;
+  if ((scratch = Stream_scratch(self, oscratch)) == NULL)
+    HS_LOCK_RETURN_NULL();
 
-  hs_scratch_t *hs_scratch = scratch->hs_scratch;
-  hs_error_t hs_err = hs_close_stream(
-    self->identifier, hs_scratch, hs_match_handler, (void *)&cctx);
+  // Without a match handler the stream is released without reporting
+  // end-of-data matches.
+  hs_error_t hs_err;
+  if (cctx.callback == NULL || cctx.callback == Py_None) {
+    self->coalesce_len = 0;
+    self->pending_writes = 0;
+    hs_err = tracked_close_stream(
+      self->identifier, self->state_bytes, NULL, NULL, NULL);
+  } else {
+    hs_err = Stream_scan_pending(
+      self, scratch->hs_scratch, hs_match_handler, (void *)&cctx);
+    if (hs_err == HS_SUCCESS)
+      hs_err = tracked_close_stream(
+        self->identifier,
+        self->state_bytes,
+        scratch->hs_scratch,
+        hs_match_handler,
+        (void *)&cctx);
+    else
+      tracked_close_stream(
+        self->identifier, self->state_bytes, NULL, NULL, NULL);
+  }
+  if (self->identifier != NULL)
+    Database_count_streams(db, -1);
+  self->identifier = NULL;
   HANDLE_HYPERSCAN_ERR(hs_err, NULL);
 
   HS_LOCK_RETURN(Py_NewRef(Py_None));
@@ -1103,9 +2638,13 @@ static PyObject *Stream_enter(Stream *self)
     PyErr_SetString(PyExc_RuntimeError, "chimera does not support streams");
     HS_LOCK_RETURN_NULL();
   }
-  hs_error_t err = hs_open_stream(db->hs_db, 0, &self->identifier);
+  int was_open = self->identifier != NULL;
+  hs_error_t err =
+    Database_open_stream(db, 0, &self->identifier, &self->state_bytes);
   HANDLE_HYPERSCAN_ERR(err, NULL);
-  HS_LOCK_RETURN((PyObject *)self);
+  if (!was_open)
+    Database_count_streams(db, 1);
+  HS_LOCK_RETURN(Py_NewRef((PyObject *)self));
 }
 
 static PyObject *Stream_exit(Stream *self)
@@ -1119,7 +2658,8 @@ static PyObject *Stream_exit(Stream *self)
   HS_LOCK_RETURN(Py_NewRef(Py_None));
 }
 
-static PyObject *Stream_scan(Stream *self, PyObject *args, PyObject *kwds)
+static PyObject *Stream_scan_pinned(
+  Stream *self, PyObject *args, PyObject *kwds)
 {
   HS_LOCK_DECLARE();
   HS_LOCK_ACQUIRE_OR_RETURN_NULL();
@@ -1149,37 +2689,61 @@ static PyObject *Stream_scan(Stream *self, PyObject *args, PyObject *kwds)
     octx = self->cctx->ctx;
 
   Database *db = (Database *)self->database;
-  Scratch *scratch;
-
-  if (PyObject_Not(oscratch))
-    scratch = (Scratch *)db->scratch;
-  else {
-    if (!PyObject_IsInstance(oscratch, (PyObject *)&ScratchType)) {
-      PyErr_SetString(
-        PyExc_TypeError, "scratch must be a hyperscan.Scratch instance");
-      PyBuffer_Release(&view);
-      HS_LOCK_RETURN_NULL();
-    }
-    scratch = (Scratch *)oscratch;
+  if (
+    oscratch != Py_None &&
+    !PyObject_IsInstance(oscratch, (PyObject *)&ScratchType)) {
+    PyErr_SetString(
+      PyExc_TypeError, "scratch must be a hyperscan.Scratch instance");
+    PyBuffer_Release(&view);
+    HS_LOCK_RETURN_NULL();
+  }
+  Scratch *scratch = Stream_scratch(self, oscratch);
+  if (scratch == NULL) {
+    PyBuffer_Release(&view);
+    HS_LOCK_RETURN_NULL();
   }
 
-  py_scan_callback_ctx cctx = {ocallback, octx};
+  py_scan_callback_ctx cctx = {ocallback, octx, 1, db->fanout};
 
   if (db->chimera) {
     PyBuffer_Release(&view);
     PyErr_SetString(PyExc_RuntimeError, "chimera does not support streams");
     HS_LOCK_RETURN_NULL();
   } else {
-    hs_error_t hs_err;
+    hs_error_t hs_err = HS_SUCCESS;
+    match_event_handler onEvent =
+      ocallback == Py_None ? NULL : hs_match_handler;
+    void *context = ocallback == Py_None ? NULL : (void *)&cctx;
     Py_BEGIN_ALLOW_THREADS;
-    hs_err = hs_scan_stream(
-      self->identifier,
-      (char *)view.buf,
-      view.len,
-      flags,
-      scratch->hs_scratch,
-      ocallback == Py_None ? NULL : hs_match_handler,
-      ocallback == Py_None ? NULL : (void *)&cctx);
+    if (self->identifier == NULL) {
+      hs_err = HS_INVALID;
+    } else if ((size_t)view.len < self->coalesce_size) {
+      if (self->coalesce_len + view.len > self->coalesce_size)
+        hs_err =
+          Stream_scan_pending(self, scratch->hs_scratch, onEvent, context);
+      if (hs_err == HS_SUCCESS) {
+        memcpy(self->coalesce_buf + self->coalesce_len, view.buf, view.len);
+        self->coalesce_len += view.len;
+        self->pending_writes++;
+        if (
+          self->coalesce_len == self->coalesce_size ||
+          (self->coalesce_writes &&
+           self->pending_writes >= self->coalesce_writes))
+          hs_err =
+            Stream_scan_pending(self, scratch->hs_scratch, onEvent, context);
+      }
+    } else {
+      hs_err = Stream_scan_pending(self, scratch->hs_scratch, onEvent, context);
+      if (hs_err == HS_SUCCESS)
+        hs_err = hs_scan_stream(
+          self->identifier,
+          (char *)view.buf,
+          view.len,
+          flags,
+          scratch->hs_scratch,
+          onEvent,
+          context);
+    }
     Py_END_ALLOW_THREADS;
     PyBuffer_Release(&view);
     HANDLE_HYPERSCAN_ERR(hs_err, NULL);
@@ -1188,6 +2752,126 @@ static PyObject *Stream_scan(Stream *self, PyObject *args, PyObject *kwds)
   HS_LOCK_RETURN(Py_NewRef(Py_None));
 }
 
+static PyObject *Stream_scan(Stream *self, PyObject *args, PyObject *kwds)
+{
+  if (!PyObject_TypeCheck(self->database, &DatabaseType))
+    return Stream_scan_pinned(self, args, kwds);
+  Database *db = (Database *)Py_NewRef(self->database);
+  Database_pin(db);
+  PyObject *result = Stream_scan_pinned(self, args, kwds);
+  Database_unpin(db);
+  Py_DECREF(db);
+  return result;
+}
+
+static PyObject *Stream_flush(Stream *self, PyObject *args, PyObject *kwds)
+{
+  HS_LOCK_DECLARE();
+  HS_LOCK_ACQUIRE_OR_RETURN_NULL();
+
+  PyObject *ocallback = Py_None, *octx = Py_None, *oscratch = Py_None;
+  static char *kwlist[] = {
+    "scratch", "match_event_handler", "context", NULL};
+  if (!PyArg_ParseTupleAndKeywords(
+        args,
+        kwds,
+        "|O!OO",
+        kwlist,
+        &ScratchType,
+        &oscratch,
+        &ocallback,
+        &octx))
+    HS_LOCK_RETURN_NULL();
+  if (self->coalesce_len == 0)
+    HS_LOCK_RETURN(Py_NewRef(Py_None));
+
+  if (PyObject_Not(ocallback))
+    ocallback = self->cctx->callback;
+  if (PyObject_Not(octx))
+    octx = self->cctx->ctx;
+  Scratch *scratch = Stream_scratch(self, oscratch);
+  if (scratch == NULL)
+    HS_LOCK_RETURN_NULL();
+  py_scan_callback_ctx cctx = {
+    ocallback, octx, 1, ((Database *)self->database)->fanout};
+
+  hs_error_t hs_err;
+  Py_BEGIN_ALLOW_THREADS;
+  hs_err = Stream_scan_pending(
+    self,
+    scratch->hs_scratch,
+    ocallback == Py_None ? NULL : hs_match_handler,
+    ocallback == Py_None ? NULL : (void *)&cctx);
+  Py_END_ALLOW_THREADS;
+  HANDLE_HYPERSCAN_ERR(hs_err, NULL);
+  HS_LOCK_RETURN(Py_NewRef(Py_None));
+}
+
+static PyObject *Stream_compress(Stream *self)
+{
+  HS_LOCK_DECLARE();
+  HS_LOCK_ACQUIRE_OR_RETURN_NULL();
+
+  if (self->identifier == NULL) {
+    PyErr_SetString(PyExc_RuntimeError, "stream is not open");
+    HS_LOCK_RETURN_NULL();
+  }
+  if (self->coalesce_len > 0) {
+    PyErr_SetString(PyExc_RuntimeError, "stream has unflushed data");
+    HS_LOCK_RETURN_NULL();
+  }
+  size_t used_space = 0;
+  hs_error_t hs_err =
+    hs_compress_stream(self->identifier, NULL, 0, &used_space);
+  if (hs_err != HS_INSUFFICIENT_SPACE)
+    HANDLE_HYPERSCAN_ERR(hs_err, NULL);
+  PyObject *obuf = PyBytes_FromStringAndSize(NULL, used_space);
+  if (obuf == NULL)
+    HS_LOCK_RETURN_NULL();
+  hs_err = hs_compress_stream(
+    self->identifier, PyBytes_AS_STRING(obuf), used_space, &used_space);
+  if (hs_err != HS_SUCCESS) {
+    Py_DECREF(obuf);
+    HANDLE_HYPERSCAN_ERR(hs_err, NULL);
+  }
+  HS_LOCK_RETURN(obuf);
+}
+
+static PyObject *Stream_expand(Stream *self, PyObject *args, PyObject *kwds)
+{
+  HS_LOCK_DECLARE();
+  HS_LOCK_ACQUIRE_OR_RETURN_NULL();
+
+  Py_buffer view;
+  static char *kwlist[] = {"buf", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*", kwlist, &view))
+    HS_LOCK_RETURN_NULL();
+  Database *db = (Database *)self->database;
+  if (db->chimera) {
+    PyBuffer_Release(&view);
+    PyErr_SetString(PyExc_RuntimeError, "chimera does not support streams");
+    HS_LOCK_RETURN_NULL();
+  }
+  hs_error_t hs_err;
+  self->coalesce_len = 0;
+  self->pending_writes = 0;
+  if (self->identifier == NULL) {
+    hs_err = Database_expand_stream(
+      db,
+      &self->identifier,
+      (const char *)view.buf,
+      view.len,
+      &self->state_bytes);
+    if (hs_err == HS_SUCCESS)
+      Database_count_streams(db, 1);
+  } else
+    hs_err = hs_reset_and_expand_stream(
+      self->identifier, (const char *)view.buf, view.len, NULL, NULL, NULL);
+  PyBuffer_Release(&view);
+  HANDLE_HYPERSCAN_ERR(hs_err, NULL);
+  HS_LOCK_RETURN(Py_NewRef(Py_None));
+}
+
 static PyMemberDef Stream_members[] = {
   {"database",
    T_OBJECT_EX,
@@ -1205,11 +2889,43 @@ static PyMethodDef Stream_methods[] = {
    METH_VARARGS | METH_KEYWORDS,
    "close(scratch=None, match_event_handler=None, context=None)\n\n"
    "    Closes the stream.\n\n"
+   "    If neither this call nor the stream has a match handler, the\n"
+   "    stream is released without reporting end-of-data matches.\n\n"
    "    Args:\n"
    "        scratch (:class:`Scratch`, optional): Scratch space.\n"
-   "            If a **match_event_handler** is provided and a scratch\n"
-   "            space is not, the scratch space of the associated\n"
-   "            database will be used.\n"
+   "            Defaults to the stream's, or else the database's.\n"
+   "        match_event_handler (callable, optional): The match \n"
+   "            callback, which is invoked for each match result, and\n"
+   "            passed the expression id, start offset, end offset,\n"
+   "            flags, and a context object.\n"
+   "        context (:obj:`object`, optional): A context object passed\n"
+   "            as the last arg to **match_event_handler**.\n\n"},
+  {"compress",
+   (PyCFunction)Stream_compress,
+   METH_NOARGS,
+   "compress()\n\n"
+   "    Compresses the stream state.\n\n"
+   "    Returns:\n"
+   "        bytes: A compact representation of the stream state, which\n"
+   "        can be restored with :meth:`expand`.\n\n"},
+  {"expand",
+   (PyCFunction)Stream_expand,
+   METH_VARARGS | METH_KEYWORDS,
+   "expand(buf)\n\n"
+   "    Restores a stream state produced by :meth:`compress`.\n\n"
+   "    If the stream is open, its current state is discarded without\n"
+   "    reporting end-of-data matches. Otherwise the stream is opened\n"
+   "    with the restored state.\n\n"
+   "    Args:\n"
+   "        buf (bytes): A compressed stream state for a stream of the\n"
+   "            same database.\n\n"},
+  {"flush",
+   (PyCFunction)Stream_flush,
+   METH_VARARGS | METH_KEYWORDS,
+   "flush(scratch=None, match_event_handler=None, context=None)\n\n"
+   "    Scans any data held in the coalescing buffer.\n\n"
+   "    Args:\n"
+   "        scratch (:obj:`Scratch`, optional): Scratch space.\n"
    "        match_event_handler (callable, optional): The match \n"
    "            callback, which is invoked for each match result, and\n"
    "            passed the expression id, start offset, end offset,\n"
@@ -1222,6 +2938,9 @@ static PyMethodDef Stream_methods[] = {
    "scan(data, flags=0, scratch=None, match_event_handler=None, "
    "context=None)\n\n"
    "    Scans streaming text.\n\n"
+   "    If the stream coalesces small writes, data shorter than\n"
+   "    **coalesce_size** is buffered, and matches in it are reported\n"
+   "    to the handler of the call that flushes the buffer.\n\n"
    "    Args:\n"
    "        data (str): The block of text to scan.\n"
    "        flags (int, optional): Currently unused.\n"
@@ -1271,7 +2990,14 @@ static PyTypeObject StreamType = {
   "        match_event_handler (callable, optional): The match callback,\n"
   "            which is invoked for each match result, and passed the\n"
   "            expression id, start offset, end offset, flags, and a\n"
-  "            context object."
+  "            context object.\n"
+  "        coalesce_size (int, optional): If non-zero, writes shorter\n"
+  "            than this many bytes are buffered and scanned together\n"
+  "            once the buffer fills. Match offsets are unaffected.\n"
+  "        coalesce_writes (int, optional): If non-zero, the buffer is\n"
+  "            also scanned after this many buffered writes.\n"
+  "        scratch (:class:`Scratch`, optional): Scratch space used by\n"
+  "            calls that do not pass their own."
   "\n\n",                /* tp_doc */
   0,                     /* tp_traverse */
   0,                     /* tp_clear */
@@ -1294,10 +3020,8 @@ static PyTypeObject StreamType = {
 
 static void Scratch_dealloc(Scratch *self)
 {
-  if (self->hs_scratch != NULL)
-    hs_free_scratch(self->hs_scratch);
-  if (self->ch_scratch != NULL)
-    ch_free_scratch(self->ch_scratch);
+  tracked_free_scratch(self->hs_scratch);
+  tracked_ch_free_scratch(self->ch_scratch);
   Py_TYPE(self)->tp_free((PyObject *)self);
 }
 
@@ -1317,16 +3041,59 @@ static PyObject *Scratch_set_database(
   Database *db = (Database *)self->database;
   if (db->chimera) {
     ch_database_t *ch_db = db->ch_db;
-    ch_error_t ch_err = ch_alloc_scratch(ch_db, &self->ch_scratch);
+    ch_error_t ch_err = tracked_ch_alloc_scratch(ch_db, &self->ch_scratch);
     HANDLE_CHIMERA_ERR(ch_err, NULL);
   } else {
     hs_database_t *hs_db = db->hs_db;
-    hs_error_t hs_err = hs_alloc_scratch(hs_db, &self->hs_scratch);
+    hs_error_t hs_err = tracked_alloc_scratch(hs_db, &self->hs_scratch);
+    HANDLE_HYPERSCAN_ERR(hs_err, NULL);
+  }
+  HS_LOCK_RETURN(Py_NewRef(Py_None));
+}
+
+static PyObject *Scratch_extend(Scratch *self, PyObject *args, PyObject *kwds)
+{
+  HS_LOCK_DECLARE();
+  HS_LOCK_ACQUIRE_OR_RETURN_NULL();
+
+  Database *db;
+  static char *kwlist[] = {"database", NULL};
+  if (!PyArg_ParseTupleAndKeywords(
+        args, kwds, "O!", kwlist, &DatabaseType, &db))
+    HS_LOCK_RETURN_NULL();
+  if (db->hs_db == NULL && db->ch_db == NULL) {
+    PyErr_SetString(PyExc_RuntimeError, "database is not compiled");
+    HS_LOCK_RETURN_NULL();
+  }
+  if (db->chimera ? self->hs_scratch != NULL : self->ch_scratch != NULL) {
+    PyErr_SetString(
+      PyExc_ValueError,
+      "cannot share scratch between chimera and non-chimera databases");
+    HS_LOCK_RETURN_NULL();
+  }
+  if (self->database == Py_None)
+    self->database = (PyObject *)db;
+  // Allocating again over an existing scratch grows it in place to fit
+  // both databases.
+  if (db->chimera) {
+    ch_error_t ch_err = tracked_ch_alloc_scratch(db->ch_db, &self->ch_scratch);
+    HANDLE_CHIMERA_ERR(ch_err, NULL);
+  } else {
+    hs_error_t hs_err = tracked_alloc_scratch(db->hs_db, &self->hs_scratch);
     HANDLE_HYPERSCAN_ERR(hs_err, NULL);
   }
   HS_LOCK_RETURN(Py_NewRef(Py_None));
 }
 
+static PyObject *Scratch_size(Scratch *self, PyObject *args)
+{
+  HS_LOCK_DECLARE();
+  HS_LOCK_ACQUIRE_OR_RETURN_NULL();
+  size_t size =
+    hs_scratch_bytes(self->hs_scratch) + ch_scratch_bytes(self->ch_scratch);
+  HS_LOCK_RETURN(PyLong_FromSize_t(size));
+}
+
 static int Scratch_init(Scratch *self, PyObject *args, PyObject *kwds)
 {
   static char *kwlist[] = {"database", NULL};
@@ -1354,10 +3121,12 @@ static PyObject *Scratch_clone(Scratch *self)
   }
 
   if (chimera) {
-    ch_error_t ch_err = ch_clone_scratch(self->ch_scratch, &dest->ch_scratch);
+    ch_error_t ch_err =
+      tracked_ch_clone_scratch(self->ch_scratch, &dest->ch_scratch);
     HANDLE_CHIMERA_ERR(ch_err, NULL);
   } else {
-    hs_error_t hs_err = hs_clone_scratch(self->hs_scratch, &dest->hs_scratch);
+    hs_error_t hs_err =
+      tracked_clone_scratch(self->hs_scratch, &dest->hs_scratch);
     HANDLE_HYPERSCAN_ERR(hs_err, NULL);
   }
 
@@ -1385,6 +3154,21 @@ static PyMethodDef Scratch_methods[] = {
    METH_VARARGS | METH_KEYWORDS,
    "set_database(database)\n\n"
    "    Allocates a scratch with the given database.\n\n"},
+  {"extend",
+   (PyCFunction)Scratch_extend,
+   METH_VARARGS | METH_KEYWORDS,
+   "extend(database)\n\n"
+   "    Grows the scratch space so it can also be used with another\n"
+   "    database, as if allocated for each database in turn.\n\n"
+   "    Args:\n"
+   "        database (:class:`Database`): A compiled database.\n\n"},
+  {"size",
+   (PyCFunction)Scratch_size,
+   METH_NOARGS,
+   "size()\n\n"
+   "    Returns the size of the scratch space in bytes.\n\n"
+   "    Returns:\n"
+   "        int: The size in bytes, or 0 if nothing is allocated.\n\n"},
   {NULL}};
 
 static PyTypeObject ScratchType = {
@@ -1429,96 +3213,1661 @@ static PyTypeObject ScratchType = {
   (initproc)Scratch_init, /* tp_init */
 };
 
-static PyObject *dumpb(PyObject *self, PyObject *args, PyObject *kwds)
-{
-  HS_LOCK_DECLARE();
-  HS_LOCK_ACQUIRE_OR_RETURN_NULL();
+#define HS_ENGINE_SCAN 0
+#define HS_ENGINE_END 1
 
-  Database *db;
-  char *buf;
+typedef struct {
+  unsigned long long flow;
+  char *data;
   size_t length;
-  static char *kwlist[] = {"database", NULL};
+  int op;
+} hs_engine_item;
 
-  if (!PyArg_ParseTupleAndKeywords(
-        args, kwds, "O!", kwlist, &DatabaseType, &db))
-    HS_LOCK_RETURN_NULL();
-  if (db->chimera) {
-    PyErr_SetString(
-      PyExc_RuntimeError, "chimera does not support serialization");
-    HS_LOCK_RETURN_NULL();
-  }
-  hs_error_t err = hs_serialize_database(db->hs_db, &buf, &length);
-  HANDLE_HYPERSCAN_ERR(err, NULL);
-  PyObject *bytes = PyBytes_FromStringAndSize(buf, length);
-  if (!bytes) {
-    PyErr_SetString(HyperscanError, "failed to serialize database");
-    HS_LOCK_RETURN_NULL();
-  }
-  free(buf);
-  HS_LOCK_RETURN(bytes);
-}
+typedef struct {
+  unsigned long long flow;
+  hs_error_t error;
+} hs_engine_error;
 
-static PyObject *loadb(PyObject *self, PyObject *args, PyObject *kwds)
+/* Open-addressing map of flow identifiers to the streams a worker owns. */
+typedef struct {
+  unsigned long long *flows;
+  hs_stream_t **streams;
+  size_t capacity;
+  size_t count;
+} hs_flow_table;
+
+typedef struct hs_engine_worker {
+  struct StreamEngine *engine;
+  hs_scratch_t *scratch;
+  hs_flow_table table;
+  // Single-producer ring: submissions are serialized by the engine.
+  hs_engine_item *ring;
+  size_t head;
+  size_t tail;
+  PyThread_type_lock mutex;
+  // Held while the worker sleeps on an empty ring.
+  PyThread_type_lock wake;
+  // Held while the producer sleeps on a full ring.
+  PyThread_type_lock space;
+  // Held until the worker thread has exited.
+  PyThread_type_lock exited;
+  int sleeping;
+  int producer_waiting;
+  int stopping;
+  int started;
+} hs_engine_worker;
+
+typedef struct StreamEngine {
+  PyObject_HEAD PyObject *database;
+  hs_engine_worker *workers;
+  Py_ssize_t num_workers;
+  size_t queue_size;
+  PyThread_type_lock submit_lock;
+  // Guards everything below.
+  PyThread_type_lock done_mutex;
+  // Held while flush() waits for pending work.
+  PyThread_type_lock idle;
+  size_t pending;
+  int flush_waiting;
+  hs_match_collector completions;
+  // Failed work, by flow, drained by errors().
+  hs_engine_error *errors;
+  size_t error_count;
+  size_t error_capacity;
+  // Set when an error could not be recorded for lack of memory.
+  int errors_lost;
+  int running;
+  unsigned long generation;
+  // Set while counted in the database's engines.
+  int attached;
+  // Size of every flow's stream state; the database cannot be recompiled
+  // while the engine is attached.
+  size_t stream_bytes;
+} StreamEngine;
+
+static inline unsigned long long flow_hash(unsigned long long x)
 {
-  HS_LOCK_DECLARE();
-  HS_LOCK_ACQUIRE_OR_RETURN_NULL();
+  // splitmix64 finalizer
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
 
-  char *buf;
-  PyObject *obuf = Py_None;
-  PyObject *odb;
-  odb = PyObject_CallFunctionObjArgs((PyObject *)&DatabaseType, NULL);
-  Database *db = (Database *)odb;
+static size_t flow_table_find(hs_flow_table *table, unsigned long long flow)
+{
+  size_t mask = table->capacity - 1;
+  size_t i = (size_t)(flow_hash(flow) >> 32) & mask;
+  while (table->streams[i] != NULL && table->flows[i] != flow)
+    i = (i + 1) & mask;
+  return i;
+}
 
-  static char *kwlist[] = {"buf", "mode", NULL};
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, "OI", kwlist, &obuf, &db->mode))
-    HS_LOCK_RETURN_NULL();
-  if (!PyBytes_Check(obuf)) {
-    PyErr_SetString(PyExc_TypeError, "buf must be a bytestring");
-    HS_LOCK_RETURN_NULL();
+static int flow_table_grow(hs_flow_table *table)
+{
+  hs_flow_table grown;
+  grown.capacity = table->capacity ? table->capacity * 2 : 64;
+  grown.count = table->count;
+  grown.flows = PyMem_RawCalloc(grown.capacity, sizeof(unsigned long long));
+  grown.streams = PyMem_RawCalloc(grown.capacity, sizeof(hs_stream_t *));
+  if (grown.flows == NULL || grown.streams == NULL) {
+    PyMem_RawFree(grown.flows);
+    PyMem_RawFree(grown.streams);
+    return -1;
+  }
+  for (size_t i = 0; i < table->capacity; i++) {
+    if (table->streams[i] == NULL)
+      continue;
+    size_t j = flow_table_find(&grown, table->flows[i]);
+    grown.flows[j] = table->flows[i];
+    grown.streams[j] = table->streams[i];
   }
+  PyMem_RawFree(table->flows);
+  PyMem_RawFree(table->streams);
+  *table = grown;
+  return 0;
+}
 
-  Py_ssize_t length = PyBytes_Size(obuf);
-  buf = PyBytes_AsString(obuf);
-  hs_error_t err = hs_deserialize_database(buf, length, &db->hs_db);
-  HANDLE_HYPERSCAN_ERR(err, NULL);
-  if (PyErr_Occurred())
-    HS_LOCK_RETURN_NULL();
-  HS_LOCK_RETURN(odb);
+static void flow_table_remove(hs_flow_table *table, size_t i)
+{
+  // Backward-shift deletion keeps probe sequences intact without
+  // tombstones.
+  size_t mask = table->capacity - 1;
+  size_t j = i;
+  table->streams[i] = NULL;
+  table->count--;
+  for (;;) {
+    j = (j + 1) & mask;
+    if (table->streams[j] == NULL)
+      return;
+    size_t home = (size_t)(flow_hash(table->flows[j]) >> 32) & mask;
+    if (((j - home) & mask) < ((j - i) & mask))
+      continue;
+    table->flows[i] = table->flows[j];
+    table->streams[i] = table->streams[j];
+    table->streams[j] = NULL;
+    i = j;
+  }
 }
 
-static PyMethodDef HyperscanMethods[] = {
-  {"dumpb",
-   (PyCFunction)dumpb,
-   METH_VARARGS | METH_KEYWORDS,
-   "dumpb(database)\n"
-   "    Serializes a Hyperscan database.\n\n"
-   "    Args:\n"
-   "        database (:class:`Database`): A Hyperscan database.\n\n"
-   "    Returns:\n"
-   "        bytes: A serialized representation of the database.\n\n"},
-  {"loadb",
-   (PyCFunction)loadb,
-   METH_VARARGS | METH_KEYWORDS,
-   "loadb(buf, mode)\n"
-   "    Deserializes a Hyperscan database.\n\n"
-   "    Args:\n"
-   "        buf (:obj:`bytearray`): A serialized Hyperscan database.\n"
-   "        mode (int): The expected mode of the database.\n\n"
-   "    Returns:\n"
-   "        :class:`Database`: The deserialized database instance.\n\n"},
-  {NULL}};
+static hs_error_t stream_engine_process(
+  hs_engine_worker *worker, hs_engine_item *item, hs_match_collector *mc)
+{
+  Database *db = (Database *)worker->engine->database;
+  hs_flow_table *table = &worker->table;
+  mc->key = item->flow;
+  mc->fanout = db->fanout;
+  if (table->capacity == 0 && flow_table_grow(table) < 0)
+    return HS_NOMEM;
+  size_t i = flow_table_find(table, item->flow);
+
+  if (item->op == HS_ENGINE_END) {
+    if (table->streams[i] == NULL)
+      return HS_SUCCESS;
+    hs_error_t hs_err = tracked_close_stream(
+      table->streams[i],
+      worker->engine->stream_bytes,
+      worker->scratch,
+      hs_collect_handler,
+      (void *)mc);
+    flow_table_remove(table, i);
+    return hs_err;
+  }
 
-static struct PyModuleDef hyperscanmodule = {
-  PyModuleDef_HEAD_INIT,
-  "_hs_ext",
-  "Hyperscan bindings for CPython.",
-  -1,
-  HyperscanMethods,
-};
+  if (table->streams[i] == NULL) {
+    if ((table->count + 1) * 2 > table->capacity) {
+      if (flow_table_grow(table) < 0)
+        return HS_NOMEM;
+      i = flow_table_find(table, item->flow);
+    }
+    size_t bytes;
+    hs_error_t hs_err =
+      Database_open_stream(db, 0, &table->streams[i], &bytes);
+    if (hs_err != HS_SUCCESS)
+      return hs_err;
+    table->flows[i] = item->flow;
+    table->count++;
+  }
+  // An empty chunk only opens the stream: hs_scan_stream() rejects the
+  // NULL buffer it is queued with.
+  if (item->length == 0)
+    return HS_SUCCESS;
+  return hs_scan_stream(
+    table->streams[i],
+    item->data,
+    (unsigned int)item->length,
+    0,
+    worker->scratch,
+    hs_collect_handler,
+    (void *)mc);
+}
 
-PyMODINIT_FUNC PyInit__hs_ext(void)
+/* Records that work on a flow failed. Called holding done_mutex. */
+static void stream_engine_fail(
+  StreamEngine *engine, unsigned long long flow, hs_error_t hs_err)
 {
-  PyObject *m;
+  if (engine->error_count == engine->error_capacity) {
+    size_t capacity = engine->error_capacity ? engine->error_capacity * 2 : 16;
+    hs_engine_error *errors =
+      PyMem_RawRealloc(engine->errors, capacity * sizeof(hs_engine_error));
+    if (errors == NULL) {
+      engine->errors_lost = 1;
+      return;
+    }
+    engine->errors = errors;
+    engine->error_capacity = capacity;
+  }
+  engine->errors[engine->error_count].flow = flow;
+  engine->errors[engine->error_count].error = hs_err;
+  engine->error_count++;
+}
+
+/* Publishes a worker's matches to the completion queue, and its error, if
+ * any, to the flow's errors. */
+static void stream_engine_complete(
+  StreamEngine *engine, hs_match_collector *mc, hs_error_t hs_err)
+{
+  PyThread_acquire_lock(engine->done_mutex, WAIT_LOCK);
+  if (mc->failed)
+    hs_err = HS_NOMEM;
+  hs_match_collector *out = &engine->completions;
+  if (mc->count > 0 && out->count + mc->count > out->capacity) {
+    size_t capacity = out->capacity ? out->capacity : 64;
+    while (capacity < out->count + mc->count)
+      capacity *= 2;
+    hs_match_record *records =
+      PyMem_RawRealloc(out->records, capacity * sizeof(hs_match_record));
+    if (records == NULL) {
+      hs_err = HS_NOMEM;
+      mc->count = 0;
+    } else {
+      out->records = records;
+      out->capacity = capacity;
+    }
+  }
+  if (mc->count > 0) {
+    memcpy(
+      out->records + out->count,
+      mc->records,
+      mc->count * sizeof(hs_match_record));
+    out->count += mc->count;
+  }
+  if (hs_err != HS_SUCCESS)
+    stream_engine_fail(engine, mc->key, hs_err);
+  mc->count = 0;
+  mc->failed = 0;
+  engine->pending--;
+  if (engine->pending == 0 && engine->flush_waiting) {
+    engine->flush_waiting = 0;
+    PyThread_release_lock(engine->idle);
+  }
+  PyThread_release_lock(engine->done_mutex);
+}
+
+static void stream_engine_worker(void *arg)
+{
+  hs_engine_worker *worker = arg;
+  hs_match_collector mc = {NULL, 0, 0, 0, 0};
+  size_t queue_size = worker->engine->queue_size;
+
+  for (;;) {
+    PyThread_acquire_lock(worker->mutex, WAIT_LOCK);
+    while (worker->head == worker->tail && !worker->stopping) {
+      worker->sleeping = 1;
+      PyThread_release_lock(worker->mutex);
+      PyThread_acquire_lock(worker->wake, WAIT_LOCK);
+      PyThread_acquire_lock(worker->mutex, WAIT_LOCK);
+    }
+    if (worker->head == worker->tail) {
+      PyThread_release_lock(worker->mutex);
+      break;
+    }
+    hs_engine_item item = worker->ring[worker->head % queue_size];
+    worker->head++;
+    if (worker->producer_waiting) {
+      worker->producer_waiting = 0;
+      PyThread_release_lock(worker->space);
+    }
+    PyThread_release_lock(worker->mutex);
+
+    hs_error_t hs_err = stream_engine_process(worker, &item, &mc);
+    PyMem_RawFree(item.data);
+    stream_engine_complete(worker->engine, &mc, hs_err);
+  }
+
+  PyMem_RawFree(mc.records);
+  PyThread_release_lock(worker->exited);
+}
+
+/* Queues an item for the worker owning its flow. Called without the GIL
+ * while holding the engine's submit lock. */
+static void stream_engine_push(StreamEngine *engine, hs_engine_item *item)
+{
+  hs_engine_worker *worker =
+    &engine->workers[flow_hash(item->flow) % (size_t)engine->num_workers];
+
+  PyThread_acquire_lock(engine->done_mutex, WAIT_LOCK);
+  engine->pending++;
+  PyThread_release_lock(engine->done_mutex);
+
+  PyThread_acquire_lock(worker->mutex, WAIT_LOCK);
+  while (worker->tail - worker->head == engine->queue_size) {
+    worker->producer_waiting = 1;
+    PyThread_release_lock(worker->mutex);
+    PyThread_acquire_lock(worker->space, WAIT_LOCK);
+    PyThread_acquire_lock(worker->mutex, WAIT_LOCK);
+  }
+  worker->ring[worker->tail % engine->queue_size] = *item;
+  worker->tail++;
+  if (worker->sleeping) {
+    worker->sleeping = 0;
+    PyThread_release_lock(worker->wake);
+  }
+  PyThread_release_lock(worker->mutex);
+}
+
+/* Allows the database to be recompiled again once the engine's streams
+ * are closed or abandoned. */
+static void stream_engine_detach(StreamEngine *self)
+{
+  if (!self->attached)
+    return;
+  self->attached = 0;
+  Database *db = (Database *)self->database;
+  PyThread_acquire_lock(g_alloc_lock, WAIT_LOCK);
+  db->engines--;
+  PyThread_release_lock(g_alloc_lock);
+}
+
+/* Abandons an engine inherited across fork(). Its worker threads did not
+ * survive and may have held its locks, so nothing can be joined or freed
+ * safely. */
+static void stream_engine_check_fork(StreamEngine *self)
+{
+  if (self->generation == g_fork_generation)
+    return;
+  self->generation = g_fork_generation;
+  stream_engine_detach(self);
+  self->workers = NULL;
+  self->running = 0;
+  self->submit_lock = NULL;
+  self->done_mutex = NULL;
+  self->idle = NULL;
+}
+
+static void StreamEngine_shutdown(StreamEngine *self)
+{
+  stream_engine_check_fork(self);
+  if (self->workers == NULL) {
+    stream_engine_detach(self);
+    return;
+  }
+  for (Py_ssize_t i = 0; i < self->num_workers; i++) {
+    hs_engine_worker *worker = &self->workers[i];
+    if (!worker->started)
+      continue;
+    PyThread_acquire_lock(worker->mutex, WAIT_LOCK);
+    worker->stopping = 1;
+    if (worker->sleeping) {
+      worker->sleeping = 0;
+      PyThread_release_lock(worker->wake);
+    }
+    PyThread_release_lock(worker->mutex);
+  }
+  for (Py_ssize_t i = 0; i < self->num_workers; i++) {
+    hs_engine_worker *worker = &self->workers[i];
+    if (worker->started) {
+      Py_BEGIN_ALLOW_THREADS;
+      PyThread_acquire_lock(worker->exited, WAIT_LOCK);
+      Py_END_ALLOW_THREADS;
+    }
+    for (size_t j = 0; j < worker->table.capacity; j++) {
+      if (worker->table.streams[j] != NULL)
+        tracked_close_stream(
+          worker->table.streams[j],
+          self->stream_bytes,
+          NULL,
+          NULL,
+          NULL);
+    }
+    PyMem_RawFree(worker->table.flows);
+    PyMem_RawFree(worker->table.streams);
+    PyMem_RawFree(worker->ring);
+    tracked_free_scratch(worker->scratch);
+    if (worker->mutex != NULL)
+      PyThread_free_lock(worker->mutex);
+    if (worker->wake != NULL)
+      PyThread_free_lock(worker->wake);
+    if (worker->space != NULL)
+      PyThread_free_lock(worker->space);
+    if (worker->exited != NULL)
+      PyThread_free_lock(worker->exited);
+  }
+  PyMem_RawFree(self->workers);
+  self->workers = NULL;
+  self->running = 0;
+  stream_engine_detach(self);
+}
+
+static void StreamEngine_dealloc(StreamEngine *self)
+{
+  StreamEngine_shutdown(self);
+  if (self->submit_lock != NULL)
+    PyThread_free_lock(self->submit_lock);
+  if (self->done_mutex != NULL)
+    PyThread_free_lock(self->done_mutex);
+  if (self->idle != NULL)
+    PyThread_free_lock(self->idle);
+  PyMem_RawFree(self->completions.records);
+  PyMem_RawFree(self->errors);
+  Py_XDECREF(self->database);
+  Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyThread_type_lock stream_engine_held_lock(void)
+{
+  PyThread_type_lock lock = PyThread_allocate_lock();
+  if (lock != NULL)
+    PyThread_acquire_lock(lock, WAIT_LOCK);
+  return lock;
+}
+
+static int StreamEngine_init(StreamEngine *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"database", "workers", "queue_size", NULL};
+  PyObject *odatabase;
+  Py_ssize_t num_workers;
+  Py_ssize_t queue_size = 1024;
+  if (!PyArg_ParseTupleAndKeywords(
+        args,
+        kwds,
+        "O!n|n",
+        kwlist,
+        &DatabaseType,
+        &odatabase,
+        &num_workers,
+        &queue_size))
+    return -1;
+  if (self->workers != NULL) {
+    PyErr_SetString(PyExc_RuntimeError, "engine is already running");
+    return -1;
+  }
+  self->generation = g_fork_generation;
+  if (num_workers < 1 || queue_size < 1) {
+    PyErr_SetString(
+      PyExc_ValueError, "workers and queue_size must be positive");
+    return -1;
+  }
+  Database *db = (Database *)odatabase;
+  // Serialized with compile(), which must not swap out the database
+  // between the check and the attach.
+  HS_LOCK_DECLARE();
+  HS_LOCK_ACQUIRE_OR_RETURN_NEG1();
+  if (db->chimera || !(db->mode & HS_MODE_STREAM) || db->hs_db == NULL) {
+    PyErr_SetString(
+      PyExc_RuntimeError, "engine requires a compiled streaming database");
+    HS_LOCK_RETURN_INT(-1);
+  }
+  Py_XSETREF(self->database, Py_NewRef(odatabase));
+  PyThread_acquire_lock(g_alloc_lock, WAIT_LOCK);
+  db->engines++;
+  PyThread_release_lock(g_alloc_lock);
+  self->attached = 1;
+  self->stream_bytes = Database_stream_bytes(db);
+  HS_LOCK_RELEASE_IF_HELD();
+  self->num_workers = num_workers;
+  self->queue_size = (size_t)queue_size;
+  self->error_count = 0;
+  self->errors_lost = 0;
+
+  if (self->submit_lock == NULL)
+    self->submit_lock = PyThread_allocate_lock();
+  if (self->done_mutex == NULL)
+    self->done_mutex = PyThread_allocate_lock();
+  if (self->idle == NULL)
+    self->idle = stream_engine_held_lock();
+  self->workers = PyMem_RawCalloc(num_workers, sizeof(hs_engine_worker));
+  if (
+    self->submit_lock == NULL || self->done_mutex == NULL ||
+    self->idle == NULL || self->workers == NULL) {
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  for (Py_ssize_t i = 0; i < num_workers; i++) {
+    hs_engine_worker *worker = &self->workers[i];
+    worker->engine = self;
+    hs_error_t hs_err = tracked_alloc_scratch(db->hs_db, &worker->scratch);
+    if (hs_err != HS_SUCCESS) {
+      PyErr_Format(HyperscanErrors[abs(hs_err)], "error code %i", hs_err);
+      StreamEngine_shutdown(self);
+      return -1;
+    }
+    worker->ring = PyMem_RawMalloc(self->queue_size * sizeof(hs_engine_item));
+    worker->mutex = PyThread_allocate_lock();
+    worker->wake = stream_engine_held_lock();
+    worker->space = stream_engine_held_lock();
+    worker->exited = stream_engine_held_lock();
+    if (
+      worker->ring == NULL || worker->mutex == NULL || worker->wake == NULL ||
+      worker->space == NULL || worker->exited == NULL) {
+      PyErr_NoMemory();
+      StreamEngine_shutdown(self);
+      return -1;
+    }
+    if (PyThread_start_new_thread(stream_engine_worker, worker) ==
+        PYTHREAD_INVALID_THREAD_ID) {
+      PyErr_SetString(PyExc_RuntimeError, "failed to start worker thread");
+      StreamEngine_shutdown(self);
+      return -1;
+    }
+    worker->started = 1;
+  }
+  self->running = 1;
+  return 0;
+}
+
+static int StreamEngine_submit(
+  StreamEngine *self, unsigned long long flow, Py_buffer *view, int op)
+{
+  stream_engine_check_fork(self);
+  if (!self->running) {
+    PyErr_SetString(PyExc_RuntimeError, "engine is closed");
+    return -1;
+  }
+  hs_engine_item item = {flow, NULL, 0, op};
+  if (view != NULL && view->len > 0) {
+    item.data = PyMem_RawMalloc(view->len);
+    if (item.data == NULL) {
+      PyErr_NoMemory();
+      return -1;
+    }
+    memcpy(item.data, view->buf, view->len);
+    item.length = view->len;
+  }
+  int running;
+  Py_BEGIN_ALLOW_THREADS;
+  PyThread_acquire_lock(self->submit_lock, WAIT_LOCK);
+  // Re-checked under the lock in case another thread closed the engine.
+  running = self->running;
+  if (running)
+    stream_engine_push(self, &item);
+  PyThread_release_lock(self->submit_lock);
+  Py_END_ALLOW_THREADS;
+  if (!running) {
+    PyMem_RawFree(item.data);
+    PyErr_SetString(PyExc_RuntimeError, "engine is closed");
+    return -1;
+  }
+  return 0;
+}
+
+static PyObject *StreamEngine_scan(
+  StreamEngine *self, PyObject *args, PyObject *kwds)
+{
+  unsigned long long flow;
+  Py_buffer view;
+  static char *kwlist[] = {"flow", "data", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "Ky*", kwlist, &flow, &view))
+    return NULL;
+  if ((unsigned long long)view.len > UINT_MAX) {
+    PyBuffer_Release(&view);
+    PyErr_SetString(PyExc_OverflowError, "data is too large");
+    return NULL;
+  }
+  int rv = StreamEngine_submit(self, flow, &view, HS_ENGINE_SCAN);
+  PyBuffer_Release(&view);
+  if (rv < 0)
+    return NULL;
+  Py_RETURN_NONE;
+}
+
+static PyObject *StreamEngine_end(
+  StreamEngine *self, PyObject *args, PyObject *kwds)
+{
+  unsigned long long flow;
+  static char *kwlist[] = {"flow", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "K", kwlist, &flow))
+    return NULL;
+  if (StreamEngine_submit(self, flow, NULL, HS_ENGINE_END) < 0)
+    return NULL;
+  Py_RETURN_NONE;
+}
+
+static PyObject *StreamEngine_poll(StreamEngine *self)
+{
+  stream_engine_check_fork(self);
+  if (self->done_mutex == NULL)
+    return PyList_New(0);
+
+  // Failed work is reported by errors(), so that it never costs the
+  // matches of other flows.
+  hs_match_collector out;
+  Py_BEGIN_ALLOW_THREADS;
+  PyThread_acquire_lock(self->done_mutex, WAIT_LOCK);
+  out = self->completions;
+  self->completions.records = NULL;
+  self->completions.count = 0;
+  self->completions.capacity = 0;
+  PyThread_release_lock(self->done_mutex);
+  Py_END_ALLOW_THREADS;
+
+  PyObject *omatches = PyList_New((Py_ssize_t)out.count);
+  if (omatches == NULL)
+    goto cleanup;
+  for (size_t i = 0; i < out.count; i++) {
+    hs_match_record *record = &out.records[i];
+    PyObject *omatch = Py_BuildValue(
+      "(KIKKI)",
+      record->key,
+      record->id,
+      record->from,
+      record->to,
+      record->flags);
+    if (omatch == NULL) {
+      Py_CLEAR(omatches);
+      goto cleanup;
+    }
+    PyList_SET_ITEM(omatches, (Py_ssize_t)i, omatch);
+  }
+
+cleanup:
+  PyMem_RawFree(out.records);
+  return omatches;
+}
+
+static PyObject *StreamEngine_errors(StreamEngine *self)
+{
+  stream_engine_check_fork(self);
+  if (self->done_mutex == NULL)
+    return PyList_New(0);
+
+  hs_engine_error *errors;
+  size_t count;
+  int lost;
+  Py_BEGIN_ALLOW_THREADS;
+  PyThread_acquire_lock(self->done_mutex, WAIT_LOCK);
+  errors = self->errors;
+  count = self->error_count;
+  lost = self->errors_lost;
+  self->errors = NULL;
+  self->error_count = 0;
+  self->error_capacity = 0;
+  self->errors_lost = 0;
+  PyThread_release_lock(self->done_mutex);
+  Py_END_ALLOW_THREADS;
+
+  PyObject *oerrors = NULL;
+  if (lost) {
+    PyErr_Format(
+      HyperscanErrors[abs(HS_NOMEM)], "error code %i", (int)HS_NOMEM);
+    goto cleanup;
+  }
+  oerrors = PyList_New((Py_ssize_t)count);
+  if (oerrors == NULL)
+    goto cleanup;
+  for (size_t i = 0; i < count; i++) {
+    PyObject *oerror = Py_BuildValue("(Ki)", errors[i].flow, errors[i].error);
+    if (oerror == NULL) {
+      Py_CLEAR(oerrors);
+      goto cleanup;
+    }
+    PyList_SET_ITEM(oerrors, (Py_ssize_t)i, oerror);
+  }
+
+cleanup:
+  PyMem_RawFree(errors);
+  return oerrors;
+}
+
+static PyObject *StreamEngine_flush(StreamEngine *self)
+{
+  stream_engine_check_fork(self);
+  if (!self->running)
+    Py_RETURN_NONE;
+  Py_BEGIN_ALLOW_THREADS;
+  PyThread_acquire_lock(self->submit_lock, WAIT_LOCK);
+  PyThread_acquire_lock(self->done_mutex, WAIT_LOCK);
+  int wait = self->pending > 0;
+  if (wait)
+    self->flush_waiting = 1;
+  PyThread_release_lock(self->done_mutex);
+  if (wait)
+    PyThread_acquire_lock(self->idle, WAIT_LOCK);
+  PyThread_release_lock(self->submit_lock);
+  Py_END_ALLOW_THREADS;
+  Py_RETURN_NONE;
+}
+
+static PyObject *StreamEngine_close(StreamEngine *self)
+{
+  stream_engine_check_fork(self);
+  if (self->running) {
+    Py_BEGIN_ALLOW_THREADS;
+    PyThread_acquire_lock(self->submit_lock, WAIT_LOCK);
+    Py_END_ALLOW_THREADS;
+    self->running = 0;
+    PyThread_release_lock(self->submit_lock);
+  }
+  StreamEngine_shutdown(self);
+  Py_RETURN_NONE;
+}
+
+static PyObject *StreamEngine_enter(StreamEngine *self)
+{
+  return Py_NewRef((PyObject *)self);
+}
+
+static PyObject *StreamEngine_exit(StreamEngine *self, PyObject *args)
+{
+  return StreamEngine_close(self);
+}
+
+static PyMemberDef StreamEngine_members[] = {
+  {"database",
+   T_OBJECT_EX,
+   offsetof(StreamEngine, database),
+   READONLY,
+   ":class:`Database`: The streaming database."},
+  {"workers",
+   T_PYSSIZET,
+   offsetof(StreamEngine, num_workers),
+   READONLY,
+   "int: Number of worker threads."},
+  {NULL}};
+
+static PyMethodDef StreamEngine_methods[] = {
+  {"__enter__", (PyCFunction)StreamEngine_enter, METH_NOARGS},
+  {"__exit__", (PyCFunction)StreamEngine_exit, METH_VARARGS},
+  {"close",
+   (PyCFunction)StreamEngine_close,
+   METH_NOARGS,
+   "close()\n\n"
+   "    Processes queued work, stops the workers, and releases all\n"
+   "    streams without reporting end-of-data matches.\n\n"},
+  {"end",
+   (PyCFunction)StreamEngine_end,
+   METH_VARARGS | METH_KEYWORDS,
+   "end(flow)\n\n"
+   "    Queues closing the stream of a flow, reporting end-of-data\n"
+   "    matches.\n\n"
+   "    Args:\n"
+   "        flow (int): Flow identifier.\n\n"},
+  {"flush",
+   (PyCFunction)StreamEngine_flush,
+   METH_NOARGS,
+   "flush()\n\n"
+   "    Blocks until all queued work has been processed.\n\n"},
+  {"poll",
+   (PyCFunction)StreamEngine_poll,
+   METH_NOARGS,
+   "poll()\n\n"
+   "    Drains the completion queue.\n\n"
+   "    Errors do not discard matches; see :meth:`errors`.\n\n"
+   "    Returns:\n"
+   "        list: ``(flow, id, from, to, flags)`` tuples for matches\n"
+   "        reported since the last call.\n\n"},
+  {"errors",
+   (PyCFunction)StreamEngine_errors,
+   METH_NOARGS,
+   "errors()\n\n"
+   "    Drains the errors of failed work. A flow keeps its stream after\n"
+   "    an error, and its later chunks are still scanned.\n\n"
+   "    Returns:\n"
+   "        list: ``(flow, error)`` tuples, where **error** is the\n"
+   "        Hyperscan error code, e.g. :const:`HS_NOMEM`, for work that\n"
+   "        failed since the last call.\n\n"
+   "    Raises:\n"
+   "        error: If errors were lost for lack of memory.\n\n"},
+  {"scan",
+   (PyCFunction)StreamEngine_scan,
+   METH_VARARGS | METH_KEYWORDS,
+   "scan(flow, data)\n\n"
+   "    Queues a chunk of data for the stream of a flow.\n\n"
+   "    The data is copied, so the buffer may be reused immediately.\n"
+   "    Blocks while the owning worker's queue is full.\n\n"
+   "    Args:\n"
+   "        flow (int): Unsigned 64-bit flow identifier. A stream is\n"
+   "            opened the first time a flow is seen.\n"
+   "        data (bytes): The chunk of data to scan.\n\n"},
+  {NULL}};
+
+static PyTypeObject StreamEngineType = {
+  PyVarObject_HEAD_INIT(NULL, 0) "hyperscan.StreamEngine", /* tp_name */
+  sizeof(StreamEngine),                                    /* tp_basicsize */
+  0,                                                       /* tp_itemsize */
+  (destructor)StreamEngine_dealloc,                        /* tp_dealloc */
+  0,                                                       /* tp_print */
+  0,                                                       /* tp_getattr */
+  0,                                                       /* tp_setattr */
+  0,                                                       /* tp_reserved */
+  0,                                                       /* tp_repr */
+  0,                                                       /* tp_as_number */
+  0,                                                       /* tp_as_sequence */
+  0,                                                       /* tp_as_mapping */
+  0,                                                       /* tp_hash  */
+  0,                                                       /* tp_call */
+  0,                                                       /* tp_str */
+  0,                                                       /* tp_getattro */
+  0,                                                       /* tp_setattro */
+  0,                                                       /* tp_as_buffer */
+  Py_TPFLAGS_DEFAULT,                                      /* tp_flags */
+  "StreamEngine(database, workers, queue_size=1024)\n\n"
+  "    Scans many streams in parallel on native worker threads.\n\n"
+  "    Each flow is pinned to one worker by hashing its identifier, so\n"
+  "    its chunks are scanned in order by a single thread with that\n"
+  "    worker's own scratch space. Matches are collected in a\n"
+  "    completion queue drained with :meth:`poll`.\n\n"
+  "    Args:\n"
+  "        database (:class:`Database`): A database compiled with\n"
+  "            :const:`HS_MODE_STREAM`. It must not be recompiled while\n"
+  "            the engine is running.\n"
+  "        workers (int): Number of worker threads.\n"
+  "        queue_size (int, optional): Capacity of each worker's queue.\n"
+  "\n\n",                      /* tp_doc */
+  0,                           /* tp_traverse */
+  0,                           /* tp_clear */
+  0,                           /* tp_richcompare */
+  0,                           /* tp_weaklistoffset */
+  0,                           /* tp_iter */
+  0,                           /* tp_iternext */
+  StreamEngine_methods,        /* tp_methods */
+  StreamEngine_members,        /* tp_members */
+  0,                           /* tp_getset */
+  0,                           /* tp_base */
+  0,                           /* tp_dict */
+  0,                           /* tp_descr_get */
+  0,                           /* tp_descr_set */
+  0,                           /* tp_dictoffset */
+  (initproc)StreamEngine_init, /* tp_init */
+};
+
+static PyObject *dumpb(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  HS_LOCK_DECLARE();
+  HS_LOCK_ACQUIRE_OR_RETURN_NULL();
+
+  Database *db;
+  char *buf;
+  size_t length;
+  static char *kwlist[] = {"database", NULL};
+
+  if (!PyArg_ParseTupleAndKeywords(
+        args, kwds, "O!", kwlist, &DatabaseType, &db))
+    HS_LOCK_RETURN_NULL();
+  if (db->chimera) {
+    PyErr_SetString(
+      PyExc_RuntimeError, "chimera does not support serialization");
+    HS_LOCK_RETURN_NULL();
+  }
+  if (db->fanout != NULL) {
+    PyErr_SetString(
+      PyExc_RuntimeError,
+      "databases compiled with fold_duplicates cannot be serialized");
+    HS_LOCK_RETURN_NULL();
+  }
+  hs_error_t err = hs_serialize_database(db->hs_db, &buf, &length);
+  HANDLE_HYPERSCAN_ERR(err, NULL);
+  PyObject *bytes = PyBytes_FromStringAndSize(buf, length);
+  hs_tracked_free(buf);
+  if (!bytes) {
+    PyErr_SetString(HyperscanError, "failed to serialize database");
+    HS_LOCK_RETURN_NULL();
+  }
+  HS_LOCK_RETURN(bytes);
+}
+
+static PyObject *loadb(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  HS_LOCK_DECLARE();
+  HS_LOCK_ACQUIRE_OR_RETURN_NULL();
+
+  Py_buffer view;
+  uint32_t mode;
+  PyObject *ointo = Py_None;
+  int warmup = 0;
+  static char *kwlist[] = {"buf", "mode", "into", "warmup", NULL};
+  if (!PyArg_ParseTupleAndKeywords(
+        args, kwds, "y*I|Op", kwlist, &view, &mode, &ointo, &warmup))
+    HS_LOCK_RETURN_NULL();
+
+  Database *db =
+    (Database *)PyObject_CallFunctionObjArgs((PyObject *)&DatabaseType, NULL);
+  if (db == NULL) {
+    PyBuffer_Release(&view);
+    HS_LOCK_RETURN_NULL();
+  }
+  db->mode = mode;
+
+  hs_error_t hs_err;
+  if (ointo == Py_None) {
+    Py_BEGIN_ALLOW_THREADS;
+    hs_err = hs_deserialize_database(view.buf, view.len, &db->hs_db);
+    Py_END_ALLOW_THREADS;
+  } else {
+    // The exported buffer keeps the region alive and unresizable for as
+    // long as the database uses it.
+    if (PyObject_GetBuffer(ointo, &db->region, PyBUF_WRITABLE) < 0)
+      goto error;
+    size_t size;
+    hs_err = hs_serialized_database_size(view.buf, view.len, &size);
+    if (hs_err == HS_SUCCESS && (size_t)db->region.len < size) {
+      PyErr_Format(
+        PyExc_ValueError,
+        "into must be at least %zu bytes, got %zd",
+        size,
+        db->region.len);
+      goto error;
+    }
+    if (hs_err == HS_SUCCESS) {
+      Py_BEGIN_ALLOW_THREADS;
+      hs_err = hs_deserialize_database_at(
+        view.buf, view.len, (hs_database_t *)db->region.buf);
+      Py_END_ALLOW_THREADS;
+    }
+    if (hs_err == HS_SUCCESS)
+      db->hs_db = (hs_database_t *)db->region.buf;
+  }
+  if (hs_err != HS_SUCCESS) {
+    PyErr_Format(HyperscanErrors[abs(hs_err)], "error code %i", hs_err);
+    goto error;
+  }
+  PyBuffer_Release(&view);
+  Database_track(db);
+  if (warmup && Database_warm(db, NULL) < 0) {
+    Py_DECREF(db);
+    HS_LOCK_RETURN_NULL();
+  }
+  HS_LOCK_RETURN((PyObject *)db);
+
+error:
+  PyBuffer_Release(&view);
+  Py_DECREF(db);
+  HS_LOCK_RETURN_NULL();
+}
+
+static PyObject *attach(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  HS_LOCK_DECLARE();
+  HS_LOCK_ACQUIRE_OR_RETURN_NULL();
+
+  PyObject *obuf;
+  uint32_t mode;
+  static char *kwlist[] = {"buf", "mode", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "OI", kwlist, &obuf, &mode))
+    HS_LOCK_RETURN_NULL();
+
+  Database *db =
+    (Database *)PyObject_CallFunctionObjArgs((PyObject *)&DatabaseType, NULL);
+  if (db == NULL)
+    HS_LOCK_RETURN_NULL();
+  db->mode = mode;
+  if (PyObject_GetBuffer(obuf, &db->region, PyBUF_SIMPLE) < 0)
+    goto error;
+
+  // The region is only ever read, so it may be mapped read-only and
+  // shared between processes.
+  hs_database_t *hs_db = (hs_database_t *)db->region.buf;
+  size_t size = 0;
+  hs_error_t hs_err = (uintptr_t)hs_db % 8 ? HS_BAD_ALIGN
+                                            : hs_database_size(hs_db, &size);
+  if (hs_err == HS_SUCCESS && size > (size_t)db->region.len)
+    hs_err = HS_INVALID;
+  if (hs_err != HS_SUCCESS) {
+    PyErr_Format(HyperscanErrors[abs(hs_err)], "error code %i", hs_err);
+    goto error;
+  }
+  db->hs_db = hs_db;
+  Database_track(db);
+  HS_LOCK_RETURN((PyObject *)db);
+
+error:
+  Py_DECREF(db);
+  HS_LOCK_RETURN_NULL();
+}
+
+typedef struct {
+  hs_expr_info_t *info;
+  char *error;
+} hs_expression_result;
+
+static PyObject *expression_info(
+  PyObject *self, PyObject *args, PyObject *kwds)
+{
+  PyObject *oexpressions;
+  PyObject *oflags = Py_None;
+  PyObject *oext = Py_None;
+  static char *kwlist[] = {"expressions", "flags", "ext", NULL};
+  if (!PyArg_ParseTupleAndKeywords(
+        args, kwds, "O|OO", kwlist, &oexpressions, &oflags, &oext))
+    return NULL;
+
+  PyObject *oseq = PySequence_Fast(
+    oexpressions, "expressions must be a sequence");
+  if (oseq == NULL)
+    return NULL;
+  Py_ssize_t count = PySequence_Fast_GET_SIZE(oseq);
+
+  PyObject **encoded = PyMem_Calloc(count + 1, sizeof(PyObject *));
+  unsigned int *flags = PyMem_Calloc(count + 1, sizeof(unsigned int));
+  hs_expr_ext_t *ext = PyMem_Calloc(count + 1, sizeof(hs_expr_ext_t));
+  char *has_ext = PyMem_Calloc(count + 1, 1);
+  hs_expression_result *results =
+    PyMem_Calloc(count + 1, sizeof(hs_expression_result));
+  PyObject *oresult = NULL;
+  if (
+    encoded == NULL || flags == NULL || ext == NULL || has_ext == NULL ||
+    results == NULL) {
+    PyErr_NoMemory();
+    goto cleanup;
+  }
+
+  unsigned int globalflag = 0;
+  if (oflags != Py_None && !PySequence_Check(oflags)) {
+    globalflag = PyLong_AsUnsignedLong(oflags);
+    if (PyErr_Occurred())
+      goto cleanup;
+  }
+
+  for (Py_ssize_t i = 0; i < count; i++) {
+    PyObject *oexpr = PySequence_Fast_GET_ITEM(oseq, i);
+    if (PyBytes_Check(oexpr)) {
+      encoded[i] = Py_NewRef(oexpr);
+    } else if (PyUnicode_Check(oexpr)) {
+      encoded[i] = PyUnicode_AsUTF8String(oexpr);
+      if (encoded[i] == NULL)
+        goto cleanup;
+    } else {
+      PyErr_SetString(PyExc_TypeError, "expressions must be bytes or str");
+      goto cleanup;
+    }
+
+    flags[i] = globalflag;
+    if (oflags != Py_None && PySequence_Check(oflags)) {
+      PyObject *oflag = PySequence_GetItem(oflags, i);
+      if (oflag == NULL)
+        goto cleanup;
+      flags[i] = PyLong_AsUnsignedLong(oflag);
+      Py_DECREF(oflag);
+      if (PyErr_Occurred())
+        goto cleanup;
+    }
+
+    if (oext == Py_None)
+      continue;
+    PyObject *oext_item = PySequence_GetItem(oext, i);
+    if (oext_item == NULL)
+      goto cleanup;
+    if (oext_item != Py_None) {
+      has_ext[i] = 1;
+      if (!PyArg_ParseTuple(
+            oext_item,
+            "KKKKII",
+            &ext[i].flags,
+            &ext[i].min_offset,
+            &ext[i].max_offset,
+            &ext[i].min_length,
+            &ext[i].edit_distance,
+            &ext[i].hamming_distance)) {
+        PyErr_SetString(PyExc_TypeError, "invalid ext info");
+        Py_DECREF(oext_item);
+        goto cleanup;
+      }
+    }
+    Py_DECREF(oext_item);
+  }
+
+  // The encoded expressions are owned above, so the whole batch can be
+  // analyzed without the GIL.
+  Py_BEGIN_ALLOW_THREADS;
+  for (Py_ssize_t i = 0; i < count; i++) {
+    hs_compile_error_t *compile_err = NULL;
+    hs_error_t hs_err = hs_expression_ext_info(
+      PyBytes_AS_STRING(encoded[i]),
+      flags[i],
+      has_ext[i] ? &ext[i] : NULL,
+      &results[i].info,
+      &compile_err);
+    if (hs_err != HS_SUCCESS) {
+      results[i].info = NULL;
+      const char *message =
+        compile_err != NULL ? compile_err->message : "unknown error";
+      results[i].error = malloc(strlen(message) + 1);
+      if (results[i].error != NULL)
+        strcpy(results[i].error, message);
+      if (compile_err != NULL)
+        hs_free_compile_error(compile_err);
+    }
+  }
+  Py_END_ALLOW_THREADS;
+
+  oresult = PyList_New(count);
+  if (oresult == NULL)
+    goto cleanup;
+  for (Py_ssize_t i = 0; i < count; i++) {
+    hs_expr_info_t *info = results[i].info;
+    PyObject *oitem;
+    if (info != NULL) {
+      PyObject *omax_width = info->max_width == UINT_MAX
+                               ? Py_NewRef(Py_None)
+                               : PyLong_FromUnsignedLong(info->max_width);
+      oitem = Py_BuildValue(
+        "(INNNNO)",
+        info->min_width,
+        omax_width,
+        PyBool_FromLong(info->unordered_matches),
+        PyBool_FromLong(info->matches_at_eod),
+        PyBool_FromLong(info->matches_only_at_eod),
+        Py_None);
+    } else {
+      oitem = Py_BuildValue(
+        "(OOOOOs)",
+        Py_None,
+        Py_None,
+        Py_None,
+        Py_None,
+        Py_None,
+        results[i].error != NULL ? results[i].error : "out of memory");
+    }
+    if (oitem == NULL) {
+      Py_CLEAR(oresult);
+      goto cleanup;
+    }
+    PyList_SET_ITEM(oresult, i, oitem);
+  }
+
+cleanup:
+  if (results != NULL) {
+    for (Py_ssize_t i = 0; i < count; i++) {
+      hs_tracked_free(results[i].info);
+      free(results[i].error);
+    }
+  }
+  if (encoded != NULL) {
+    for (Py_ssize_t i = 0; i < count; i++)
+      Py_XDECREF(encoded[i]);
+  }
+  PyMem_Free(encoded);
+  PyMem_Free(flags);
+  PyMem_Free(ext);
+  PyMem_Free(has_ext);
+  PyMem_Free(results);
+  Py_DECREF(oseq);
+  return oresult;
+}
+
+static PyObject *serialized_database_size(
+  PyObject *self, PyObject *args, PyObject *kwds)
+{
+  HS_LOCK_DECLARE();
+  Py_buffer view;
+  static char *kwlist[] = {"buf", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*", kwlist, &view))
+    return NULL;
+
+  size_t size;
+  hs_error_t hs_err = hs_serialized_database_size(view.buf, view.len, &size);
+  PyBuffer_Release(&view);
+  HANDLE_HYPERSCAN_ERR(hs_err, NULL);
+  return PyLong_FromSize_t(size);
+}
+
+static PyObject *serialized_database_info(
+  PyObject *self, PyObject *args, PyObject *kwds)
+{
+  HS_LOCK_DECLARE();
+  Py_buffer view;
+  static char *kwlist[] = {"buf", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*", kwlist, &view))
+    return NULL;
+
+  char *info;
+  hs_error_t hs_err;
+  Py_BEGIN_ALLOW_THREADS;
+  hs_err = hs_serialized_database_info(view.buf, view.len, &info);
+  Py_END_ALLOW_THREADS;
+  PyBuffer_Release(&view);
+  HANDLE_HYPERSCAN_ERR(hs_err, NULL);
+
+  PyObject *oinfo = PyBytes_FromString(info);
+  hs_tracked_free(info);
+  return oinfo;
+}
+
+static PyObject *populate_platform(PyObject *self, PyObject *args)
+{
+  HS_LOCK_DECLARE();
+  hs_platform_info_t platform;
+  hs_error_t hs_err = hs_populate_platform(&platform);
+  HANDLE_HYPERSCAN_ERR(hs_err, NULL);
+  return Py_BuildValue(
+    "(IK)", platform.tune, (unsigned long long)platform.cpu_features);
+}
+
+static PyObject *set_allocator(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  const char *backend = "malloc";
+  const char *huge_pages = "off";
+  Py_ssize_t limit = 0;
+  Py_ssize_t huge_page_threshold = HS_HUGE_PAGE_SIZE / 2;
+  static char *kwlist[] = {
+    "backend", "limit", "huge_pages", "huge_page_threshold", NULL};
+  if (!PyArg_ParseTupleAndKeywords(
+        args,
+        kwds,
+        "|snsn",
+        kwlist,
+        &backend,
+        &limit,
+        &huge_pages,
+        &huge_page_threshold))
+    return NULL;
+  int ihuge_pages;
+  if (strcmp(huge_pages, "off") == 0) {
+    ihuge_pages = HS_HUGE_PAGES_OFF;
+  } else if (strcmp(huge_pages, "transparent") == 0) {
+    ihuge_pages = HS_HUGE_PAGES_TRANSPARENT;
+  } else if (strcmp(huge_pages, "explicit") == 0) {
+    ihuge_pages = HS_HUGE_PAGES_EXPLICIT;
+  } else {
+    PyErr_Format(PyExc_ValueError, "unknown huge page mode: %s", huge_pages);
+    return NULL;
+  }
+#ifndef HS_HAVE_MMAP
+  if (ihuge_pages != HS_HUGE_PAGES_OFF) {
+    PyErr_SetString(
+      PyExc_NotImplementedError, "huge pages are not supported on this platform");
+    return NULL;
+  }
+#endif
+  if (huge_page_threshold < 0) {
+    PyErr_SetString(
+      PyExc_ValueError, "huge_page_threshold must not be negative");
+    return NULL;
+  }
+  int ibackend;
+  if (strcmp(backend, "malloc") == 0) {
+    ibackend = HS_BACKEND_MALLOC;
+  } else if (strcmp(backend, "pymem") == 0) {
+    ibackend = HS_BACKEND_PYMEM;
+  } else {
+    PyErr_Format(PyExc_ValueError, "unknown allocator backend: %s", backend);
+    return NULL;
+  }
+  if (limit < 0) {
+    PyErr_SetString(PyExc_ValueError, "limit must not be negative");
+    return NULL;
+  }
+  PyThread_acquire_lock(g_alloc_lock, WAIT_LOCK);
+  g_alloc_backend = ibackend;
+  g_alloc_limit = (size_t)limit;
+  g_huge_pages = ihuge_pages;
+  g_huge_page_threshold = (size_t)huge_page_threshold;
+  PyThread_release_lock(g_alloc_lock);
+  Py_RETURN_NONE;
+}
+
+static PyObject *allocator_stats(PyObject *self, PyObject *args)
+{
+  size_t bytes[HS_ALLOC_CATEGORIES];
+  PyThread_acquire_lock(g_alloc_lock, WAIT_LOCK);
+  memcpy(bytes, g_alloc_bytes, sizeof(bytes));
+  size_t total = g_alloc_total;
+  size_t peak = g_alloc_peak;
+  size_t limit = g_alloc_limit;
+  size_t failures = g_alloc_failures;
+  int backend = g_alloc_backend;
+  int huge_pages = g_huge_pages;
+  size_t huge_page_bytes = g_huge_page_bytes;
+  size_t huge_page_fallbacks = g_huge_page_fallbacks;
+  PyThread_release_lock(g_alloc_lock);
+  static const char *huge_page_modes[] = {"off", "transparent", "explicit"};
+  return Py_BuildValue(
+    "{s:s,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:s,s:n,s:n}",
+    "backend",
+    backend == HS_BACKEND_PYMEM ? "pymem" : "malloc",
+    "database",
+    (Py_ssize_t)bytes[HS_ALLOC_DATABASE],
+    "scratch",
+    (Py_ssize_t)bytes[HS_ALLOC_SCRATCH],
+    "stream",
+    (Py_ssize_t)bytes[HS_ALLOC_STREAM],
+    "misc",
+    (Py_ssize_t)bytes[HS_ALLOC_MISC],
+    "total",
+    (Py_ssize_t)total,
+    "peak",
+    (Py_ssize_t)peak,
+    "limit",
+    (Py_ssize_t)limit,
+    "failures",
+    (Py_ssize_t)failures,
+    "huge_pages",
+    huge_page_modes[huge_pages],
+    "huge_page_bytes",
+    (Py_ssize_t)huge_page_bytes,
+    "huge_page_fallbacks",
+    (Py_ssize_t)huge_page_fallbacks);
+}
+
+static PyObject *memory_stats(PyObject *self, PyObject *args)
+{
+  size_t count[HS_OBJ_KINDS], bytes[HS_OBJ_KINDS];
+  PyThread_acquire_lock(g_alloc_lock, WAIT_LOCK);
+  memcpy(count, g_live_count, sizeof(count));
+  memcpy(bytes, g_live_bytes, sizeof(bytes));
+  PyThread_release_lock(g_alloc_lock);
+  return Py_BuildValue(
+    "{s:n,s:n,s:n,s:n,s:n,s:n}",
+    "databases",
+    (Py_ssize_t)count[HS_OBJ_DATABASE],
+    "database_bytes",
+    (Py_ssize_t)bytes[HS_OBJ_DATABASE],
+    "scratches",
+    (Py_ssize_t)count[HS_OBJ_SCRATCH],
+    "scratch_bytes",
+    (Py_ssize_t)bytes[HS_OBJ_SCRATCH],
+    "streams",
+    (Py_ssize_t)count[HS_OBJ_STREAM],
+    "stream_bytes",
+    (Py_ssize_t)bytes[HS_OBJ_STREAM]);
+}
+
+static PyObject *scan_streams(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  HS_LOCK_DECLARE();
+  HS_LOCK_ACQUIRE_OR_RETURN_NULL();
+
+  uint32_t flags = 0;
+  PyObject *opairs;
+  PyObject *oscratch = Py_None;
+  static char *kwlist[] = {"pairs", "flags", "scratch", NULL};
+  if (!PyArg_ParseTupleAndKeywords(
+        args, kwds, "O|IO", kwlist, &opairs, &flags, &oscratch))
+    HS_LOCK_RETURN_NULL();
+  if (oscratch != Py_None && !PyObject_TypeCheck(oscratch, &ScratchType)) {
+    PyErr_SetString(
+      PyExc_TypeError, "scratch must be a hyperscan.Scratch instance");
+    HS_LOCK_RETURN_NULL();
+  }
+
+  PyObject *fast_seq =
+    PySequence_Fast(opairs, "expected a sequence of (stream, data) tuples");
+  if (fast_seq == NULL)
+    HS_LOCK_RETURN_NULL();
+  Py_ssize_t num_pairs = PySequence_Fast_GET_SIZE(fast_seq);
+  size_t num_alloc = num_pairs > 0 ? (size_t)num_pairs : 1;
+
+  Stream **streams = PyMem_RawCalloc(num_alloc, sizeof(Stream *));
+  hs_scratch_t **scratches = PyMem_RawCalloc(num_alloc, sizeof(hs_scratch_t *));
+  Py_buffer *views = PyMem_RawCalloc(num_alloc, sizeof(Py_buffer));
+  hs_match_collector mc = {NULL, 0, 0, 0, 0};
+  PyObject *omatches = NULL;
+  Py_ssize_t pinned = 0;
+
+  if (streams == NULL || scratches == NULL || views == NULL) {
+    PyErr_NoMemory();
+    goto cleanup;
+  }
+
+  // Pin every buffer and resolve every scratch up front so the scan loop
+  // below can run entirely without the GIL.
+  for (Py_ssize_t i = 0; i < num_pairs; i++) {
+    PyObject *item = PySequence_Fast_GET_ITEM(fast_seq, i);
+    PyObject *ostream;
+    if (!PyTuple_Check(item)) {
+      PyErr_SetString(
+        PyExc_TypeError, "expected a sequence of (stream, data) tuples");
+      goto cleanup;
+    }
+    if (!PyArg_ParseTuple(
+          item, "O!y*", &StreamType, &ostream, &views[pinned]))
+      goto cleanup;
+    streams[pinned++] = (Stream *)Py_NewRef(ostream);
+
+    Stream *stream = (Stream *)ostream;
+    Database *db = (Database *)stream->database;
+    if (db->chimera) {
+      PyErr_SetString(PyExc_RuntimeError, "chimera does not support streams");
+      goto cleanup;
+    }
+    if (stream->identifier == NULL) {
+      PyErr_SetString(PyExc_RuntimeError, "stream is not open");
+      goto cleanup;
+    }
+    Scratch *stream_scratch =
+      oscratch != Py_None ? (Scratch *)oscratch : Database_scratch(db);
+    if (stream_scratch == NULL)
+      goto cleanup;
+    scratches[i] = stream_scratch->hs_scratch;
+  }
+
+  hs_error_t hs_err = HS_SUCCESS;
+  Py_BEGIN_ALLOW_THREADS;
+  for (Py_ssize_t i = 0; i < num_pairs; i++) {
+    mc.key = (unsigned long long)i;
+    mc.fanout = ((Database *)streams[i]->database)->fanout;
+    hs_err = Stream_scan_pending(
+      streams[i], scratches[i], hs_collect_handler, (void *)&mc);
+    if (hs_err != HS_SUCCESS)
+      break;
+    hs_err = hs_scan_stream(
+      streams[i]->identifier,
+      (char *)views[i].buf,
+      views[i].len,
+      flags,
+      scratches[i],
+      hs_collect_handler,
+      (void *)&mc);
+    if (hs_err != HS_SUCCESS)
+      break;
+  }
+  Py_END_ALLOW_THREADS;
+
+  if (mc.failed) {
+    PyErr_NoMemory();
+    goto cleanup;
+  }
+  if (hs_err != HS_SUCCESS) {
+    PyErr_Format(
+      HyperscanErrors[abs(hs_err)] ? HyperscanErrors[abs(hs_err)]
+                                   : HyperscanError,
+      "error code %i",
+      hs_err);
+    goto cleanup;
+  }
+
+  omatches = PyList_New((Py_ssize_t)mc.count);
+  if (omatches == NULL)
+    goto cleanup;
+  for (size_t i = 0; i < mc.count; i++) {
+    hs_match_record *record = &mc.records[i];
+    PyObject *omatch = Py_BuildValue(
+      "(OIKKI)",
+      (PyObject *)streams[record->key],
+      record->id,
+      record->from,
+      record->to,
+      record->flags);
+    if (omatch == NULL) {
+      Py_CLEAR(omatches);
+      goto cleanup;
+    }
+    PyList_SET_ITEM(omatches, (Py_ssize_t)i, omatch);
+  }
+
+cleanup:
+  for (Py_ssize_t i = 0; i < pinned; i++) {
+    PyBuffer_Release(&views[i]);
+    Py_XDECREF(streams[i]);
+  }
+  PyMem_RawFree(mc.records);
+  PyMem_RawFree(views);
+  PyMem_RawFree(scratches);
+  PyMem_RawFree(streams);
+  Py_DECREF(fast_seq);
+  HS_LOCK_RETURN(omatches);
+}
+
+static PyMethodDef HyperscanMethods[] = {
+  {"allocator_stats",
+   (PyCFunction)allocator_stats,
+   METH_NOARGS,
+   "allocator_stats()\n"
+   "    Returns memory held by Hyperscan, by allocation category.\n\n"
+   "    Returns:\n"
+   "        dict: Bytes currently allocated for **database**,\n"
+   "        **scratch**, **stream** and **misc** memory, their\n"
+   "        **total** and **peak**, the configured **backend** and\n"
+   "        **limit**, and the number of allocation **failures**.\n"
+   "        **huge_pages** is the configured mode,\n"
+   "        **huge_page_bytes** the size of huge page mappings, and\n"
+   "        **huge_page_fallbacks** the number of explicit huge page\n"
+   "        mappings that fell back to transparent huge pages.\n\n"},
+  {"memory_stats",
+   (PyCFunction)memory_stats,
+   METH_NOARGS,
+   "memory_stats()\n"
+   "    Returns the number and size of live Hyperscan objects.\n\n"
+   "    Sizes are those reported by ``hs_database_size``,\n"
+   "    ``hs_scratch_size`` and ``hs_stream_size``, so unlike\n"
+   "    :func:`allocator_stats` they exclude allocator overhead.\n\n"
+   "    Returns:\n"
+   "        dict: **databases**, **scratches** and **streams** currently\n"
+   "        alive, and their total **database_bytes**,\n"
+   "        **scratch_bytes** and **stream_bytes**.\n\n"},
+  {"dumpb",
+   (PyCFunction)dumpb,
+   METH_VARARGS | METH_KEYWORDS,
+   "dumpb(database)\n"
+   "    Serializes a Hyperscan database.\n\n"
+   "    Args:\n"
+   "        database (:class:`Database`): A Hyperscan database.\n\n"
+   "    Returns:\n"
+   "        bytes: A serialized representation of the database.\n\n"},
+  {"loadb",
+   (PyCFunction)loadb,
+   METH_VARARGS | METH_KEYWORDS,
+   "loadb(buf, mode, into=None, warmup=False)\n"
+   "    Deserializes a Hyperscan database.\n\n"
+   "    Args:\n"
+   "        buf (bytes-like): A serialized Hyperscan database, e.g.\n"
+   "            :obj:`bytes` or an :class:`mmap.mmap` of a file.\n"
+   "        mode (int): The expected mode of the database.\n"
+   "        into (writable bytes-like, optional): 8-byte aligned\n"
+   "            region of at least :func:`serialized_database_size`\n"
+   "            bytes to deserialize into instead of allocating. It\n"
+   "            stays exported, and so cannot be resized or closed,\n"
+   "            until the database is released or recompiled.\n"
+   "        warmup (bool, optional): Calls :meth:`Database.warmup`\n"
+   "            on the database before returning it.\n\n"
+   "    Returns:\n"
+   "        :class:`Database`: The deserialized database instance.\n\n"},
+  {"serialized_database_info",
+   (PyCFunction)serialized_database_info,
+   METH_VARARGS | METH_KEYWORDS,
+   "serialized_database_info(buf)\n"
+   "    Describes a serialized database without deserializing it.\n\n"
+   "    Args:\n"
+   "        buf (bytes-like): A serialized Hyperscan database.\n\n"
+   "    Returns:\n"
+   "        bytes: Version, platform and mode information, in the\n"
+   "        format of :meth:`Database.info`.\n\n"},
+  {"attach",
+   (PyCFunction)attach,
+   METH_VARARGS | METH_KEYWORDS,
+   "attach(buf, mode)\n"
+   "    Wraps a database already deserialized into memory.\n\n"
+   "    Unlike :func:`loadb`, nothing is copied: the returned database\n"
+   "    scans **buf** directly, typically a shared memory region that\n"
+   "    another process filled with ``loadb(..., into=region)``. The\n"
+   "    region is never written to and may be mapped read-only.\n\n"
+   "    Args:\n"
+   "        buf (bytes-like): An 8-byte aligned deserialized database.\n"
+   "        mode (int): The mode of the database.\n\n"
+   "    Returns:\n"
+   "        :class:`Database`: A database backed by **buf**.\n\n"},
+  {"expression_info",
+   (PyCFunction)expression_info,
+   METH_VARARGS | METH_KEYWORDS,
+   "expression_info(expressions, flags=0, ext=None)\n"
+   "    Analyzes a batch of expressions without compiling a database.\n\n"
+   "    Calls ``hs_expression_ext_info`` for every expression with the\n"
+   "    GIL released once for the whole batch, so batches may be\n"
+   "    analyzed in parallel from several threads.\n\n"
+   "    Args:\n"
+   "        expressions (sequence of str): The expressions to analyze.\n"
+   "        flags (sequence of int or int, optional): Flags for each\n"
+   "            expression, or a single value applied to all of them.\n"
+   "        ext (sequence of tuple, optional): Extended parameters for\n"
+   "            each expression, as in :meth:`Database.compile`, or\n"
+   "            None for expressions without any.\n\n"
+   "    Returns:\n"
+   "        list of tuple: For each expression, its **min_width**,\n"
+   "        **max_width** (None if unbounded), **unordered_matches**,\n"
+   "        **matches_at_eod**, **matches_only_at_eod** and **error**.\n"
+   "        Expressions that fail to compile have only **error** set,\n"
+   "        to the compiler's message.\n\n"},
+  {"serialized_database_size",
+   (PyCFunction)serialized_database_size,
+   METH_VARARGS | METH_KEYWORDS,
+   "serialized_database_size(buf)\n"
+   "    Returns the size a serialized database needs once loaded.\n\n"
+   "    Args:\n"
+   "        buf (bytes-like): A serialized Hyperscan database.\n\n"
+   "    Returns:\n"
+   "        int: Size in bytes of the region :func:`loadb` needs for\n"
+   "        **into**.\n\n"},
+  {"populate_platform",
+   (PyCFunction)populate_platform,
+   METH_NOARGS,
+   "populate_platform()\n"
+   "    Describes the platform of the current host.\n\n"
+   "    Returns:\n"
+   "        tuple: The **tune** family (one of the\n"
+   "        ``HS_TUNE_FAMILY_*`` constants) and the\n"
+   "        **cpu_features** bitmask (``HS_CPU_FEATURES_*``).\n\n"},
+  {"scan_streams",
+   (PyCFunction)scan_streams,
+   METH_VARARGS | METH_KEYWORDS,
+   "scan_streams(pairs, flags=0, scratch=None)\n"
+   "    Scans a batch of chunks across many open streams.\n\n"
+   "    All buffers are pinned and the GIL is released once for the\n"
+   "    whole batch. Chunks are fed to their streams in order, and\n"
+   "    matches are collected natively rather than passed to the\n"
+   "    streams' match event handlers.\n\n"
+   "    Args:\n"
+   "        pairs (sequence of tuple): A sequence of\n"
+   "            ``(stream, data)`` tuples, where **stream** is an open\n"
+   "            :class:`Stream` and **data** is a bytes-like object.\n"
+   "        flags (int, optional): Currently unused.\n"
+   "        scratch (:class:`Scratch`, optional): Scratch space used\n"
+   "            for every stream. Defaults to the scratch space of\n"
+   "            each stream's database.\n\n"
+   "    Returns:\n"
+   "        list: ``(stream, id, from, to, flags)`` tuples, in the\n"
+   "        order the matches were reported.\n\n"},
+  {"set_allocator",
+   (PyCFunction)set_allocator,
+   METH_VARARGS | METH_KEYWORDS,
+   "set_allocator(backend='malloc', limit=0, huge_pages='off',\n"
+   "              huge_page_threshold=1048576)\n"
+   "    Selects where Hyperscan allocates memory.\n\n"
+   "    Blocks already allocated are released by the backend that\n"
+   "    allocated them, so the backend may be switched at any time.\n\n"
+   "    Args:\n"
+   "        backend (str, optional): ``'malloc'`` for the C library\n"
+   "            allocator, or ``'pymem'`` for Python's raw allocator,\n"
+   "            which makes Hyperscan memory visible to\n"
+   "            :mod:`tracemalloc`.\n"
+   "        limit (int, optional): If non-zero, allocations that would\n"
+   "            raise the total above this many bytes fail, and the\n"
+   "            operation needing them raises :class:`error`.\n"
+   "        huge_pages (str, optional): Places database and scratch\n"
+   "            allocations of at least **huge_page_threshold** bytes\n"
+   "            in their own mappings backed by huge pages to reduce\n"
+   "            TLB misses while scanning. ``'transparent'`` advises\n"
+   "            the kernel to use transparent huge pages;\n"
+   "            ``'explicit'`` uses preallocated huge pages\n"
+   "            (``MAP_HUGETLB``), falling back to transparent ones.\n"
+   "            Not supported on Windows.\n"
+   "        huge_page_threshold (int, optional): Minimum allocation\n"
+   "            size placed in huge pages.\n\n"},
+  {NULL}};
+
+static struct PyModuleDef hyperscanmodule = {
+  PyModuleDef_HEAD_INIT,
+  "_hs_ext",
+  "Hyperscan bindings for CPython.",
+  -1,
+  HyperscanMethods,
+};
+
+#ifdef HS_HAVE_FORK
+// g_alloc_lock is held across fork() so that the child never inherits it
+// locked by a thread that no longer exists.
+static void hs_atfork_prepare(void)
+{
+  PyThread_acquire_lock(g_alloc_lock, WAIT_LOCK);
+}
+
+static void hs_atfork_parent(void)
+{
+  PyThread_release_lock(g_alloc_lock);
+}
+
+static void hs_atfork_child(void)
+{
+  g_fork_generation++;
+  PyThread_release_lock(g_alloc_lock);
+}
+#endif
+
+PyMODINIT_FUNC PyInit__hs_ext(void)
+{
+  PyObject *m;
 
   m = PyModule_Create(&hyperscanmodule);
   if (m == NULL)
@@ -1557,6 +4906,8 @@ PyMODINIT_FUNC PyInit__hs_ext(void)
   ADD_INT_CONSTANT(m, CH_SCRATCH_IN_USE);
   ADD_INT_CONSTANT(m, CH_SUCCESS);
   ADD_INT_CONSTANT(m, HS_CPU_FEATURES_AVX2);
+  ADD_INT_CONSTANT(m, HS_CPU_FEATURES_AVX512);
+  ADD_INT_CONSTANT(m, HS_CPU_FEATURES_AVX512VBMI);
   ADD_INT_CONSTANT(m, HS_EXT_FLAG_EDIT_DISTANCE);
   ADD_INT_CONSTANT(m, HS_EXT_FLAG_HAMMING_DISTANCE);
   ADD_INT_CONSTANT(m, HS_EXT_FLAG_MAX_OFFSET);
@@ -1587,6 +4938,8 @@ PyMODINIT_FUNC PyInit__hs_ext(void)
   ADD_INT_CONSTANT(m, HS_TUNE_FAMILY_GENERIC);
   ADD_INT_CONSTANT(m, HS_TUNE_FAMILY_GLM);
   ADD_INT_CONSTANT(m, HS_TUNE_FAMILY_HSW);
+  ADD_INT_CONSTANT(m, HS_TUNE_FAMILY_ICL);
+  ADD_INT_CONSTANT(m, HS_TUNE_FAMILY_ICX);
   ADD_INT_CONSTANT(m, HS_TUNE_FAMILY_IVB);
   ADD_INT_CONSTANT(m, HS_TUNE_FAMILY_SKL);
   ADD_INT_CONSTANT(m, HS_TUNE_FAMILY_SKX);
@@ -1712,9 +5065,43 @@ PyMODINIT_FUNC PyInit__hs_ext(void)
     CH_FAIL_INTERNAL,
     "Unexpected internal error.");
 
+  // Installed up front so that every block Hyperscan allocates carries a
+  // header, which makes switching backends at runtime safe.
+  if (g_alloc_lock == NULL) {
+    g_alloc_lock = PyThread_allocate_lock();
+    if (g_alloc_lock == NULL) {
+      PyErr_NoMemory();
+      goto cleanup_module;
+    }
+    if (
+      hs_set_database_allocator(hs_database_alloc, hs_tracked_free) !=
+        HS_SUCCESS ||
+      hs_set_scratch_allocator(hs_scratch_alloc, hs_tracked_free) !=
+        HS_SUCCESS ||
+      hs_set_stream_allocator(hs_stream_alloc, hs_tracked_free) !=
+        HS_SUCCESS ||
+      hs_set_misc_allocator(hs_misc_alloc, hs_tracked_free) != HS_SUCCESS ||
+      ch_set_database_allocator(hs_database_alloc, hs_tracked_free) !=
+        CH_SUCCESS ||
+      ch_set_scratch_allocator(hs_scratch_alloc, hs_tracked_free) !=
+        CH_SUCCESS ||
+      ch_set_misc_allocator(hs_misc_alloc, hs_tracked_free) != CH_SUCCESS) {
+      PyErr_SetString(HyperscanError, "failed to install allocators");
+      goto cleanup_module;
+    }
+#ifdef HS_HAVE_FORK
+    if (
+      pthread_atfork(hs_atfork_prepare, hs_atfork_parent, hs_atfork_child) !=
+      0) {
+      PyErr_SetString(HyperscanError, "failed to install fork handlers");
+      goto cleanup_module;
+    }
+#endif
+  }
+
   if (
     (PyType_Ready(&DatabaseType) < 0) || (PyType_Ready(&ScratchType) < 0) ||
-    (PyType_Ready(&StreamType) < 0)) {
+    (PyType_Ready(&StreamType) < 0) || (PyType_Ready(&StreamEngineType) < 0)) {
     goto cleanup_module;
   }
 
@@ -1737,6 +5124,15 @@ PyMODINIT_FUNC PyInit__hs_ext(void)
     goto cleanup_module;
   }
 
+  StreamEngineType.tp_new = PyType_GenericNew;
+  Py_XINCREF(&StreamEngineType);
+  if (
+    PyModule_AddObject(m, "StreamEngine", (PyObject *)&StreamEngineType) <
+    0) {
+    Py_XDECREF(&StreamEngineType);
+    goto cleanup_module;
+  }
+
   if (PyModule_AddStringConstant(m, "__version__", hs_version()) < 0) {
     goto cleanup_module;
   }
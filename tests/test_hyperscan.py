@@ -1,3 +1,8 @@
+import mmap
+import os
+import pickle
+import sys
+
 import pytest
 
 import hyperscan
@@ -202,6 +207,256 @@ def test_stream_scan_bytearray(database_stream, mocker):
     )
 
 
+def test_allocator_accounting():
+    import tracemalloc
+
+    hyperscan.set_allocator("pymem")
+    tracemalloc.start()
+    try:
+        before = hyperscan.allocator_stats()
+        db = hyperscan.Database()
+        db.compile(expressions=[b"foo+bar"])
+        stats = hyperscan.allocator_stats()
+        assert stats["backend"] == "pymem"
+        assert stats["database"] - before["database"] >= db.size()
+        assert stats["scratch"] > before["scratch"]
+        assert tracemalloc.get_traced_memory()[0] >= db.size()
+
+        hyperscan.set_allocator("malloc", limit=stats["total"])
+        with pytest.raises(hyperscan.error):
+            hyperscan.Database().compile(expressions=[b"foo+bar"])
+        assert hyperscan.allocator_stats()["failures"] > stats["failures"]
+        del db
+        assert hyperscan.allocator_stats()["total"] < stats["total"]
+    finally:
+        tracemalloc.stop()
+        hyperscan.set_allocator()
+
+
+@pytest.mark.skipif(sys.platform == "win32", reason="requires mmap")
+def test_huge_page_allocations(mocker):
+    hyperscan.set_allocator(huge_pages="explicit", huge_page_threshold=0)
+    try:
+        db = hyperscan.Database()
+        db.compile(expressions=[b"foo+bar"])
+        stats = hyperscan.allocator_stats()
+        assert stats["huge_pages"] == "explicit"
+        assert stats["huge_page_bytes"] >= db.size()
+        callback = mocker.Mock(return_value=None)
+        db.scan(b"xfoooobar", match_event_handler=callback)
+        callback.assert_called_once_with(0, 0, 9, 0, None)
+        del db
+        assert hyperscan.allocator_stats()["huge_page_bytes"] == 0
+    finally:
+        hyperscan.set_allocator()
+
+
+def test_memory_stats():
+    before = hyperscan.memory_stats()
+    db = hyperscan.Database(mode=hyperscan.HS_MODE_STREAM)
+    db.compile(expressions=[b"foo+bar"])
+    stats = hyperscan.memory_stats()
+    assert stats["databases"] == before["databases"] + 1
+    assert stats["database_bytes"] - before["database_bytes"] == db.size()
+    assert stats["scratches"] == before["scratches"] + 1
+
+    stream = db.stream(match_event_handler=None).__enter__()
+    stats = hyperscan.memory_stats()
+    assert stats["streams"] == before["streams"] + 1
+    assert stats["stream_bytes"] - before["stream_bytes"] == len(stream)
+    restored = db.stream(match_event_handler=None)
+    restored.expand(stream.compress())
+    stream.close()
+    assert hyperscan.memory_stats()["streams"] == before["streams"] + 1
+    restored.close()
+    del stream, restored, db
+    assert hyperscan.memory_stats() == before
+
+
+def test_stream_blocks_recompile():
+    """Open streams point into the compiled database, so it must not be
+    freed by a recompile until they are closed."""
+    db = hyperscan.Database(mode=hyperscan.HS_MODE_STREAM)
+    db.compile(expressions=[b"foobar"], ids=[0])
+    matches = []
+    on_match = lambda *m: matches.append(m[:3])  # noqa: E731
+
+    stream = db.stream(match_event_handler=on_match).__enter__()
+    restored = db.stream(match_event_handler=on_match)
+    stream.scan(b"xfoo")
+    restored.expand(stream.compress())
+    stats = hyperscan.memory_stats()
+    with pytest.raises(RuntimeError, match="open streams"):
+        db.compile(expressions=[b"baz"], ids=[1])
+    assert hyperscan.memory_stats() == stats
+    stream.scan(b"bar")
+    stream.close()
+    with pytest.raises(RuntimeError, match="open streams"):
+        db.compile(expressions=[b"baz"], ids=[1])
+    restored.scan(b"bar")
+    restored.close()
+    assert matches == [(0, 0, 7), (0, 0, 7)]
+
+    db.compile(expressions=[b"baz"], ids=[1])
+    with db.stream(match_event_handler=on_match) as stream:
+        stream.scan(b"xbaz")
+    assert matches[2:] == [(1, 0, 4)]
+
+
+def test_scan_streams(database_stream, mocker):
+    callback = mocker.Mock(return_value=None)
+
+    with database_stream.stream(match_event_handler=callback) as s1:
+        with database_stream.stream(match_event_handler=callback) as s2:
+            matches = hyperscan.scan_streams(
+                [(s1, b"foo"), (s2, memoryview(b"xxfoo")), (s1, b"bar")]
+            )
+    assert matches == [
+        (s1, 0, 0, 2, 0),
+        (s1, 0, 0, 3, 0),
+        (s2, 0, 0, 4, 0),
+        (s2, 0, 0, 5, 0),
+        (s1, 1, 0, 6, 0),
+        (s1, 2, 3, 6, 0),
+    ]
+    callback.assert_not_called()
+
+
+def test_scan_streams_rejects_closed_stream(database_stream):
+    stream = database_stream.stream(match_event_handler=None)
+    with pytest.raises(RuntimeError, match="not open"):
+        hyperscan.scan_streams([(stream, b"foo")])
+
+
+def test_stream_arena(database_stream):
+    assert database_stream.stream_arena_stats() is None
+    database_stream.set_stream_arena(2)
+    try:
+        streams = [
+            database_stream.stream(match_event_handler=None) for _ in range(3)
+        ]
+        for stream in streams:
+            stream.__enter__()
+        stats = database_stream.stream_arena_stats()
+        assert stats["capacity"] == 2
+        assert stats["block_size"] >= len(streams[0])
+        assert stats["in_use"] == 2
+        assert stats["fallbacks"] == 1
+        for stream in streams:
+            stream.close()
+        stats = database_stream.stream_arena_stats()
+        assert stats["in_use"] == 0
+        assert stats["peak"] == 2
+    finally:
+        database_stream.set_stream_arena(0)
+    assert database_stream.stream_arena_stats() is None
+
+
+def test_stream_coalesce(database_stream, mocker):
+    callback = mocker.Mock(return_value=None)
+
+    with database_stream.stream(
+        match_event_handler=callback, coalesce_size=16, coalesce_writes=3
+    ) as stream:
+        stream.scan(b"fo")
+        stream.scan(b"ob")
+        callback.assert_not_called()
+        stream.scan(b"ar")
+        assert callback.call_count == 4
+        stream.scan(b"xfoo")
+        stream.flush()
+    callback.assert_has_calls(
+        [
+            mocker.call(0, 0, 2, 0, None),
+            mocker.call(0, 0, 3, 0, None),
+            mocker.call(1, 0, 6, 0, None),
+            mocker.call(2, 3, 6, 0, None),
+            mocker.call(0, 0, 9, 0, None),
+            mocker.call(0, 0, 10, 0, None),
+        ],
+        any_order=True,
+    )
+
+
+def test_stream_compress_expand(database_stream, mocker):
+    callback = mocker.Mock(return_value=None)
+
+    with database_stream.stream(match_event_handler=callback) as stream:
+        stream.scan(b"foob")
+        state = stream.compress()
+    restored = database_stream.stream(match_event_handler=callback)
+    restored.expand(state)
+    callback.reset_mock()
+    restored.scan(b"ar")
+    restored.close()
+    callback.assert_has_calls(
+        [mocker.call(1, 0, 6, 0, None), mocker.call(2, 3, 6, 0, None)],
+        any_order=True,
+    )
+
+
+def test_stream_store_spills_idle_streams(database_stream, tmp_path, mocker):
+    callback = mocker.Mock(return_value=None)
+    store = hyperscan.StreamStore(
+        database_stream,
+        tmp_path / "streams.bin",
+        hot_capacity=1,
+        match_event_handler=callback,
+    )
+    with store:
+        store.scan("a", b"foob", context="a")
+        store.scan("b", b"xxfoob", context="b")
+        assert store.stats()["hot"] == 1
+        assert store.stats()["spilled"] + store.stats()["overflow"] == 1
+        callback.reset_mock()
+        store.scan("a", b"ar", context="a")
+        store.scan("b", b"ar", context="b")
+        assert len(store) == 2
+        store.end("a")
+        assert "a" not in store
+    callback.assert_has_calls(
+        [
+            mocker.call(1, 0, 6, 0, "a"),
+            mocker.call(2, 3, 6, 0, "a"),
+            mocker.call(2, 5, 8, 0, "b"),
+        ],
+        any_order=True,
+    )
+
+
+def test_stream_store_keeps_state_on_failed_expand(
+    database_stream, tmp_path, mocker
+):
+    callback = mocker.Mock(return_value=None)
+    store = hyperscan.StreamStore(
+        database_stream,
+        tmp_path / "streams.bin",
+        hot_capacity=1,
+        match_event_handler=callback,
+    )
+    with store:
+        store.scan("a", b"foob")
+        store.scan("b", b"xx")
+        stats = store.stats()
+        assert stats["spilled"] == 1
+        # Corrupt the spilled state of "a", keeping its length.
+        offset = store._slots["a"] * store.slot_size + 4
+        saved = store._map[offset : offset + 16]
+        store._map[offset : offset + 16] = bytes(16)
+        with pytest.raises(hyperscan.error):
+            store.scan("a", b"ar")
+        assert "a" in store
+        assert store.stats() == stats
+        store._map[offset : offset + 16] = saved
+        callback.reset_mock()
+        store.scan("a", b"ar")
+        assert store.stats() == stats
+    callback.assert_has_calls(
+        [mocker.call(1, 0, 6, 0, None), mocker.call(2, 3, 6, 0, None)],
+        any_order=True,
+    )
+
+
 def test_vectored_scan(database_vector, mocker):
     """Test vectored scanning across multiple buffers.
 
@@ -355,6 +610,217 @@ def test_database_info(database_block):
         assert field + b": " in info_string
 
 
+def test_fold_duplicates(mocker):
+    kwargs = dict(
+        expressions=[b"foo", b"bar", b"foo", "foo", b"foo"],
+        ids=[7, 8, 9, 10, 11],
+        flags=[0, 0, 0, 0, hyperscan.HS_FLAG_CASELESS],
+        fold_duplicates=True,
+    )
+    db = hyperscan.Database()
+    db.compile(**kwargs)
+    callback = mocker.Mock(return_value=None)
+    db.scan(b"foo", match_event_handler=callback)
+    assert [c.args[0] for c in callback.call_args_list] == [7, 9, 10, 11]
+
+    db = hyperscan.Database(mode=hyperscan.HS_MODE_STREAM)
+    db.compile(**kwargs)
+    callback.reset_mock()
+    with db.stream(match_event_handler=callback) as stream:
+        stream.scan(b"xfo")
+        stream.scan(b"o")
+    assert [c.args[0] for c in callback.call_args_list] == [7, 9, 10, 11]
+
+    # Returning True from the handler also stops the fan-out.
+    halt = mocker.Mock(return_value=True)
+    with pytest.raises(hyperscan.ScanTerminated):
+        with db.stream(match_event_handler=halt) as stream:
+            stream.scan(b"foo")
+    assert halt.call_count == 1
+
+    with pytest.raises(RuntimeError):
+        hyperscan.dumpb(db)
+    with pytest.raises(TypeError):
+        pickle.dumps(db)
+
+
+@pytest.mark.parametrize(
+    "mode", [hyperscan.HS_MODE_BLOCK, hyperscan.HS_MODE_STREAM]
+)
+def test_planned_database(mocker, mode):
+    planned = hyperscan.PlannedDatabase(mode=mode)
+    planned.compile(
+        expressions=[b"foo", b"bar", b"baz", b"qux", b"quux"],
+        ids=[1, 2, 3, 4, 5],
+        flags=[0, 0, hyperscan.HS_FLAG_SOM_LEFTMOST, 0, 0],
+        som=[False, False, False, True, False],
+        all_matches=[True, False, True, False, True],
+    )
+    assert [(p.som, p.single_match, p.ids) for p in planned.partitions] == [
+        (False, False, [1, 5]),
+        (False, True, [2]),
+        (True, False, [3]),
+        (True, True, [4]),
+    ]
+    callback = mocker.Mock(return_value=None)
+    data = b"foo bar baz qux foo bar baz qux"
+    if mode == hyperscan.HS_MODE_STREAM:
+        with planned.stream(match_event_handler=callback) as stream:
+            stream.scan(data[:10])
+            stream.scan(data[10:])
+    else:
+        planned.scan(data, match_event_handler=callback)
+    matches = sorted(c.args[:3] for c in callback.call_args_list)
+    assert matches == [
+        (1, 0, 3),
+        (1, 0, 19),
+        (2, 0, 7),
+        (3, 8, 11),
+        (3, 24, 27),
+        (4, 12, 15),
+    ]
+
+
+def test_literal_nul_bytes(mocker):
+    db = hyperscan.Database()
+    db.compile(expressions=[b"\x00\x01\x00", "caf\u00e9"], literal=True)
+    callback = mocker.Mock(return_value=None)
+    db.scan(b"\x00\x00\x01\x00 caf\xc3\xa9", match_event_handler=callback)
+    assert callback.call_args_list == [
+        mocker.call(0, 0, 4, 0, None),
+        mocker.call(1, 0, 10, 0, None),
+    ]
+    with pytest.raises(ValueError):
+        db.compile(expressions=[b"foo\x00bar"])
+
+
+def test_mixed_database(mocker):
+    mixed = hyperscan.MixedDatabase()
+    mixed.compile(
+        expressions=[b"a\x00b", b"fo+", b"a.b"],
+        ids=[10, 20, 30],
+        literal=[True, False, True],
+    )
+    assert len(mixed.databases) == 2
+    callback = mocker.Mock(return_value=None)
+    mixed.scan(b"a\x00b foo a.b", match_event_handler=callback)
+    assert {c.args[0] for c in callback.call_args_list} == {10, 20, 30}
+    with pytest.raises(ValueError):
+        mixed.compile(
+            expressions=[b"foo"],
+            literal=True,
+            ext=[(hyperscan.HS_EXT_FLAG_MIN_OFFSET, 1, 0, 0, 0, 0)],
+        )
+
+
+@pytest.mark.parametrize(
+    "expression, flags, expected",
+    [
+        (rb"foo\.bar", 0, (b"foo.bar", 0)),
+        (b"a\\x00b\\n", hyperscan.HS_FLAG_DOTALL, (b"a\x00b\n", 0)),
+        (
+            b"Foo",
+            hyperscan.HS_FLAG_CASELESS | hyperscan.HS_FLAG_UTF8,
+            (b"Foo", hyperscan.HS_FLAG_CASELESS),
+        ),
+        (b"fo+", 0, None),
+        (rb"\d", 0, None),
+        (b"", 0, None),
+        (b"foo", hyperscan.HS_FLAG_PREFILTER, None),
+        ("caf\u00e9", hyperscan.HS_FLAG_UTF8, None),
+    ],
+)
+def test_as_literal(expression, flags, expected):
+    assert hyperscan.as_literal(expression, flags) == expected
+
+
+def test_mixed_database_auto_literal(mocker):
+    mixed = hyperscan.MixedDatabase()
+    mixed.compile(
+        expressions=[rb"foo\.bar", b"ba+z", b"QUX"],
+        ids=[1, 2, 3],
+        flags=[0, 0, hyperscan.HS_FLAG_CASELESS],
+        auto_literal=True,
+    )
+    literal_db, regex_db = mixed.databases
+    callback = mocker.Mock(return_value=None)
+    literal_db.scan(b"foo.bar fooxbar qux baz", match_event_handler=callback)
+    assert [c.args[:3] for c in callback.call_args_list] == [
+        (1, 0, 7),
+        (3, 0, 19),
+    ]
+    callback.reset_mock()
+    regex_db.scan(b"foo.bar fooxbar qux baz", match_event_handler=callback)
+    assert [c.args[0] for c in callback.call_args_list] == [2]
+
+
+def test_analyze_expressions():
+    expressions = [b"foo", "ba+r", b"baz$", b"qu(ux"] * 50
+    results = hyperscan.analyze_expressions(
+        expressions, flags=hyperscan.HS_FLAG_DOTALL, workers=3
+    )
+    assert len(results) == len(expressions)
+    assert results[:2] == [
+        (3, 3, False, False, False, None),
+        (3, None, False, False, False, None),
+    ]
+    assert results[2].matches_at_eod
+    assert results[3].min_width is None
+    assert isinstance(results[3].error, str)
+    assert results[4:] == results[:-4]
+    min_length = (hyperscan.HS_EXT_FLAG_MIN_LENGTH, 0, 0, 5, 0, 0)
+    assert hyperscan.expression_info(
+        [b"ba+r", b"foo"], ext=[min_length, None]
+    ) == [
+        (5, None, False, False, False, None),
+        (3, 3, False, False, False, None),
+    ]
+
+
+@pytest.mark.parametrize(
+    "cpu_features",
+    [0, hyperscan.HS_CPU_FEATURES_AVX2],
+)
+def test_database_compile_platform(cpu_features):
+    assert hyperscan.Platform.host() == hyperscan.populate_platform()
+    target = hyperscan.Platform(hyperscan.HS_TUNE_FAMILY_HSW, cpu_features)
+    db = hyperscan.Database()
+    db.compile(expressions=[b"foo", b"ba[rz]"], platform=target)
+    assert hyperscan.Platform.of(db).cpu_features == cpu_features
+    serialized = hyperscan.dumpb(db)
+    assert hyperscan.Platform.of(serialized) == (
+        hyperscan.HS_TUNE_FAMILY_GENERIC,
+        cpu_features,
+    )
+    with pytest.raises(TypeError):
+        db.compile(expressions=[b"foo"], platform=1)
+
+
+def test_database_compile_platform_keeps_scratch(mocker):
+    """Compiling for a platform this host cannot scan must fail without
+    replacing the database behind an assigned scratch space."""
+    host = hyperscan.Platform.host()
+    missing = (
+        hyperscan.HS_CPU_FEATURES_AVX2
+        | hyperscan.HS_CPU_FEATURES_AVX512
+        | hyperscan.HS_CPU_FEATURES_AVX512VBMI
+    ) & ~host.cpu_features
+    if not missing:
+        pytest.skip("host supports every CPU feature")
+    db = hyperscan.Database()
+    db.compile(expressions=[b"foo"], ids=[0])
+    db.scratch = hyperscan.Scratch(db)
+    info = db.info()
+
+    target = hyperscan.Platform(host.tune, host.cpu_features | missing)
+    with pytest.raises(hyperscan.DatabasePlatformError):
+        db.compile(expressions=[b"bar"], ids=[1], platform=target)
+    assert db.info() == info
+    callback = mocker.Mock(return_value=None)
+    db.scan(b"foo bar", match_event_handler=callback)
+    callback.assert_called_once_with(0, 0, 3, 0, None)
+
+
 @pytest.mark.parametrize(
     "db_fixture_name",
     ["database_stream", "database_block", "database_vector"],
@@ -397,6 +863,266 @@ def test_database_deserialize_scan(db_fixture_name, request, mocker):
         db.scan(buf, match_event_handler=callback)
 
 
+def test_database_deserialize_in_place(database_block, mocker):
+    serialized = hyperscan.dumpb(database_block)
+    size = hyperscan.serialized_database_size(serialized)
+    with pytest.raises(ValueError):
+        hyperscan.loadb(serialized, database_block.mode, into=bytearray(1))
+
+    region = mmap.mmap(-1, size)
+    db = hyperscan.loadb(
+        memoryview(serialized), database_block.mode, into=region
+    )
+    db.scratch = hyperscan.Scratch(db)
+    callback = mocker.Mock(return_value=None)
+    db.scan(b"foobar", match_event_handler=callback)
+    assert callback.called
+    with pytest.raises(BufferError):
+        region.close()
+    del db
+    region.close()
+
+
+@pytest.mark.parametrize("protocol", [2, pickle.HIGHEST_PROTOCOL])
+def test_database_pickle(database_stream, protocol, mocker):
+    buffers = []
+    kwargs = {"buffer_callback": buffers.append} if protocol >= 5 else {}
+    data = pickle.dumps(database_stream, protocol=protocol, **kwargs)
+    db = pickle.loads(data, buffers=buffers)
+    assert len(buffers) == (1 if protocol >= 5 else 0)
+    assert db.mode == database_stream.mode
+    assert db.info() == database_stream.info()
+    callback = mocker.Mock(return_value=None)
+    with db.stream(match_event_handler=callback) as stream:
+        stream.scan(b"foobar")
+    assert callback.called
+
+    empty = pickle.loads(pickle.dumps(hyperscan.Database(chimera=True)))
+    assert empty.chimera
+
+
+def test_sharded_database(mocker):
+    patterns = [b"foo%d" % i for i in range(20)] + [b"ba+r"]
+    sharded = hyperscan.ShardedDatabase(shards=4)
+    sharded.compile(expressions=patterns, ids=list(range(100, 121)))
+    assert len(sharded.databases) == 4
+    assert all(db.scratch is sharded.scratch for db in sharded.databases)
+
+    callback = mocker.Mock(return_value=None)
+    sharded.scan(b"foo7 baar foo13", match_event_handler=callback)
+    ids = sorted(call.args[0] for call in callback.call_args_list)
+    assert ids == [101, 107, 113, 120]
+
+    streaming = hyperscan.ShardedDatabase(hyperscan.HS_MODE_STREAM, shards=2)
+    streaming.compile(expressions=patterns)
+    callback.reset_mock()
+    with streaming.stream(match_event_handler=callback) as stream:
+        stream.scan(b"fo")
+        stream.scan(b"o3")
+    assert [call.args[0] for call in callback.call_args_list] == [3]
+
+
+def test_sharded_database_updates(tmp_path, mocker):
+    cache = hyperscan.DatabaseCache(tmp_path)
+    sharded = hyperscan.ShardedDatabase(shards=3, cache=cache)
+    sharded.compile(expressions=[b"foo", b"bar", b"baz"], ids=[1, 2, 3])
+    before = list(sharded.databases)
+
+    sharded.add_patterns([b"qux"], ids=[4])
+    changed = [db for db in sharded.databases if db not in before]
+    assert len(changed) == 1 and len(sharded.databases) == 3
+
+    sharded.remove_patterns([2])
+    assert len(sharded.databases) == 2
+    with pytest.raises(hyperscan.error):
+        sharded.add_patterns([b"("], ids=[5])
+    with pytest.raises(ValueError, match="id 3"):
+        sharded.add_patterns([b"quux"], ids=[3])
+    with pytest.raises(ValueError, match="id 6"):
+        sharded.add_patterns([b"quux", b"corge"], ids=[6, 6])
+
+    callback = mocker.Mock(return_value=None)
+    sharded.scan(b"foo bar baz qux", match_event_handler=callback)
+    ids = sorted(call.args[0] for call in callback.call_args_list)
+    assert ids == [1, 3, 4]
+    assert cache.stats()["misses"] == 5
+
+
+def test_database_lazy_scratch(database_block, mocker):
+    db = hyperscan.loadb(hyperscan.dumpb(database_block), database_block.mode)
+    assert db.scratch is None
+    callback = mocker.Mock(return_value=None)
+    db.scan(b"foobar", match_event_handler=callback)
+    assert callback.called
+    assert isinstance(db.scratch, hyperscan.Scratch)
+
+
+@pytest.mark.skipif(not hasattr(os, "fork"), reason="requires fork")
+def test_shared_database(database_block):
+    serialized = hyperscan.dumpb(database_block)
+    with hyperscan.SharedDatabase.create(
+        serialized, database_block.mode
+    ) as shared:
+        attached = hyperscan.SharedDatabase.attach(
+            shared.name, database_block.mode
+        )
+        assert attached.database.info() == database_block.info()
+        attached.close()
+
+        shared.database.scan(b"foobar")
+        pid = os.fork()
+        if pid == 0:
+            matches = []
+            shared.database.scan(
+                b"foobar", match_event_handler=lambda *a: matches.append(a)
+            )
+            os._exit(0 if matches else 1)
+        _, status = os.waitpid(pid, 0)
+        assert os.WIFEXITED(status) and os.WEXITSTATUS(status) == 0
+
+
+def test_database_cache(tmp_path, mocker):
+    cache = hyperscan.DatabaseCache(tmp_path)
+    patterns = dict(expressions=[b"foo+bar", "ba[rz]"], ids=[1, 2])
+    compiled = cache.compile(**patterns)
+    assert cache.stats() == {"hits": 0, "misses": 1, "stale": 0}
+
+    loaded = cache.compile(**patterns)
+    assert cache.stats()["hits"] == 1
+    assert loaded.info() == compiled.info()
+    callback = mocker.Mock(return_value=None)
+    loaded.scan(b"xfoobar", match_event_handler=callback)
+    assert callback.call_count == 2
+
+    (entry,) = tmp_path.iterdir()
+    assert hyperscan.serialized_database_info(entry.read_bytes()).endswith(
+        b"BLOCK"
+    )
+    entry.write_bytes(b"garbage")
+    cache.compile(**patterns)
+    assert cache.stats() == {"hits": 1, "misses": 2, "stale": 1}
+    assert cache.key(**patterns) != cache.key(
+        **patterns, mode=hyperscan.HS_MODE_STREAM
+    )
+
+
+def test_stream_scratch(database_stream, mocker):
+    expected = mocker.Mock(return_value=None)
+    with database_stream.stream(match_event_handler=expected) as stream:
+        stream.scan(b"foo")
+        stream.scan(b"bar")
+    scratch = hyperscan.Scratch(database_stream)
+    callback = mocker.Mock(return_value=None)
+    with database_stream.stream(
+        match_event_handler=callback, scratch=scratch
+    ) as stream:
+        stream.scan(b"foo")
+        stream.scan(b"bar", scratch=scratch)
+    assert callback.call_args_list == expected.call_args_list
+    assert callback.call_count > 0
+    with pytest.raises(TypeError):
+        database_stream.stream(match_event_handler=callback, scratch=b"x")
+    stream = database_stream.stream(match_event_handler=callback)
+    with pytest.raises(TypeError):
+        stream.close(scratch=b"x")
+
+
+@pytest.mark.parametrize(
+    "mode",
+    [
+        hyperscan.HS_MODE_BLOCK,
+        hyperscan.HS_MODE_STREAM,
+        hyperscan.HS_MODE_VECTORED,
+    ],
+)
+def test_database_warmup(mode, mocker):
+    db = hyperscan.Database(mode=mode)
+    db.compile(expressions=[b"\\x01\\x02", b"foo"])
+    serialized = hyperscan.dumpb(db)
+    db.warmup()
+    db.warmup(scratch=hyperscan.Scratch(db))
+
+    loaded = hyperscan.loadb(serialized, mode, warmup=True)
+    callback = mocker.Mock(return_value=None)
+    data = b"xfoo" if mode != hyperscan.HS_MODE_VECTORED else [b"xfoo"]
+    if mode == hyperscan.HS_MODE_STREAM:
+        with loaded.stream(match_event_handler=callback) as stream:
+            stream.scan(data)
+    else:
+        loaded.scan(data, match_event_handler=callback)
+    callback.assert_called_once()
+    with pytest.raises(RuntimeError):
+        hyperscan.Database().warmup()
+
+
+def test_database_registry(tmp_path, mocker):
+    serialized = {}
+    for name, pattern in (("a", b"foo"), ("b", b"bar"), ("c", b"baz")):
+        db = hyperscan.Database()
+        db.compile(expressions=[pattern])
+        serialized[name] = hyperscan.dumpb(db)
+    path = tmp_path / "c.hsdb"
+    path.write_bytes(serialized["c"])
+
+    probe = hyperscan.loadb(serialized["a"], hyperscan.HS_MODE_BLOCK)
+    cost = probe.size() + hyperscan.Scratch(probe).size()
+    registry = hyperscan.DatabaseRegistry(budget=cost * 5 // 2)
+    registry.register("a", serialized["a"])
+    registry.register("b", bytearray(serialized["b"]))
+    registry.register("c", path)
+    assert registry.resident() == []
+
+    callback = mocker.Mock(return_value=None)
+    registry.scan("a", b"xfoo", match_event_handler=callback)
+    registry.scan("b", b"xbar", match_event_handler=callback)
+    registry.scan("a", b"xfoo", match_event_handler=callback)
+    assert callback.call_count == 3
+    assert registry.resident() == ["b", "a"]
+    registry.scan("c", b"xbaz", match_event_handler=callback)
+    assert registry.resident() == ["a", "c"]
+    stats = registry.stats()
+    assert stats["loads"] == 3
+    assert stats["hits"] == 1
+    assert stats["evictions"] == 1
+    assert stats["resident_bytes"] <= stats["budget"]
+
+    registry.unregister("a")
+    assert "a" not in registry and len(registry) == 2
+    assert registry.resident() == ["c"]
+    with pytest.raises(KeyError):
+        registry.get("a")
+
+
+def test_intern_registry(mocker):
+    before = hyperscan.memory_stats()
+    registry = hyperscan.InternRegistry()
+    patterns = dict(expressions=[b"foo+bar", b"foo+bar"], ids=[1, 2])
+    a = registry.compile(**patterns, fold_duplicates=True)
+    b = registry.compile(**patterns, fold_duplicates=True)
+    assert a is not b
+    assert registry.stats() == {
+        "entries": 1,
+        "live": 2,
+        "hits": 1,
+        "misses": 1,
+    }
+    stats = hyperscan.memory_stats()
+    assert stats["databases"] == before["databases"] + 1
+    assert stats["database_bytes"] - before["database_bytes"] == a.size()
+
+    callback = mocker.Mock(return_value=None)
+    b.scan(b"xfoobar", match_event_handler=callback)
+    assert {c.args[0] for c in callback.call_args_list} == {1, 2}
+    a.compile(expressions=[b"baz"])
+    callback.reset_mock()
+    b.scan(b"xfoobar", match_event_handler=callback)
+    assert callback.call_count == 2
+
+    del a, b
+    assert len(registry) == 0
+    assert hyperscan.memory_stats() == before
+
+
 def test_database_exception_in_callback(database_block, mocker):
     callback = mocker.Mock(side_effect=RuntimeError("oops"))
 
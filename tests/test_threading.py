@@ -1,7 +1,7 @@
 import concurrent.futures
 import sys
 import threading
-from typing import List, Tuple
+from typing import List, Set, Tuple
 
 import pytest
 
@@ -107,3 +107,143 @@ def test_per_thread_scratch_allows_parallel_scans(threaded_database):
 
     # Every worker should see the same literal match.
     assert all(match == (0, 0, 6) for match in observed)
+
+
+def test_stream_engine_pins_flows_to_workers():
+    """Chunks of each flow must be scanned in order across worker threads."""
+    db = hyperscan.Database(mode=hyperscan.HS_MODE_STREAM)
+    db.compile(expressions=[b"foobar"], ids=[0], elements=1, flags=0)
+
+    num_flows = 64
+    with hyperscan.StreamEngine(db, workers=4, queue_size=8) as engine:
+        for chunk in (b"xfoo", b"ba", b"r"):
+            for flow in range(num_flows):
+                engine.scan(flow, chunk)
+        engine.flush()
+        matches = engine.poll()
+        for flow in range(num_flows):
+            engine.end(flow)
+        engine.flush()
+        assert engine.poll() == []
+
+    assert sorted(matches) == [(flow, 0, 0, 7, 0) for flow in range(num_flows)]
+    with pytest.raises(RuntimeError, match="closed"):
+        engine.scan(0, b"foobar")
+
+
+def test_stream_engine_empty_chunk():
+    """An empty chunk is valid input: it opens the flow's stream without
+    scanning anything."""
+    db = hyperscan.Database(mode=hyperscan.HS_MODE_STREAM)
+    db.compile(expressions=[b"foobar"], ids=[0], elements=1, flags=0)
+
+    with hyperscan.StreamEngine(db, workers=2) as engine:
+        engine.scan(1, b"")
+        engine.scan(1, b"xfoo")
+        engine.scan(1, bytearray())
+        engine.scan(1, b"bar")
+        engine.scan(2, b"")
+        engine.end(1)
+        engine.end(2)
+        engine.flush()
+        assert engine.poll() == [(1, 0, 0, 7, 0)]
+
+def test_stream_engine_errors():
+    """A failed flow is reported by errors() without costing the other
+    flows their matches."""
+    db = hyperscan.Database(mode=hyperscan.HS_MODE_STREAM)
+    db.compile(expressions=[b"foobar"], ids=[0], elements=1, flags=0)
+    # The arena holds one stream; a limit at the current total makes
+    # opening any other fail.
+    db.set_stream_arena(1)
+    try:
+        with hyperscan.StreamEngine(db, workers=1) as engine:
+            limit = hyperscan.allocator_stats()["total"]
+            hyperscan.set_allocator(limit=limit)
+            try:
+                engine.scan(1, b"xfoobar")
+                engine.scan(2, b"foobar")
+                engine.flush()
+            finally:
+                hyperscan.set_allocator()
+            assert engine.poll() == [(1, 0, 0, 7, 0)]
+            assert engine.errors() == [(2, hyperscan.HS_NOMEM)]
+            assert engine.errors() == []
+
+            engine.scan(2, b"foobar")
+            engine.end(1)
+            engine.end(2)
+            engine.flush()
+            assert engine.poll() == [(2, 0, 0, 6, 0)]
+            assert engine.errors() == []
+    finally:
+        db.set_stream_arena(0)
+
+def test_stream_engine_blocks_recompile():
+    """The engine's workers use the database without locking, so it must
+    not be recompiled or have its arena replaced while they run."""
+    db = hyperscan.Database(mode=hyperscan.HS_MODE_STREAM)
+    db.compile(expressions=[b"foobar"], ids=[0], elements=1, flags=0)
+
+    with hyperscan.StreamEngine(db, workers=2) as engine:
+        engine.scan(1, b"xfoo")
+        with pytest.raises(RuntimeError, match="StreamEngine"):
+            db.compile(expressions=[b"baz"], ids=[1])
+        with pytest.raises(RuntimeError, match="StreamEngine"):
+            db.set_stream_arena(16)
+        engine.scan(1, b"bar")
+        engine.end(1)
+        engine.flush()
+        assert engine.poll() == [(1, 0, 0, 7, 0)]
+
+    db.compile(expressions=[b"baz"], ids=[1])
+    matches = []
+    on_match = lambda *m: matches.append(m[:3])  # noqa: E731
+    with db.stream(match_event_handler=on_match) as stream:
+        stream.scan(b"xbaz")
+    assert matches == [(1, 0, 4)]
+
+
+def test_recompile_while_scanning():
+    """Recompiling must not free the database or scratch of a running scan."""
+    handle = hyperscan.DatabaseHandle()
+    handle.compile(expressions=[b"foobar"], ids=[0])
+    in_place = hyperscan.Database()
+    in_place.compile(expressions=[b"foobar"], ids=[0])
+
+    stop = threading.Event()
+    errors: List[BaseException] = []
+    seen: Set[int] = set()
+
+    def scanner() -> None:
+        try:
+            while not stop.is_set():
+                handle.scan(b"xxfoobarxx", match_event_handler=lambda *a: None)
+                # Each scan sees one compiled version, whole.
+                matches: List[int] = []
+                in_place.scan(
+                    b"xxfoobarxx",
+                    match_event_handler=lambda id, *a: matches.append(id),
+                )
+                assert len(matches) == 1
+                seen.update(matches)
+        except BaseException as exc:  # pragma: no cover - surfaced below
+            errors.append(exc)
+
+    thread = threading.Thread(target=scanner)
+    thread.start()
+    try:
+        for version in range(1, 20):
+            future = handle.recompile_async(
+                expressions=[b"foobar", b"ba+z"], ids=[version, 99]
+            )
+            assert future.result(timeout=30).info() == handle.database.info()
+            in_place.compile(expressions=[b"foobar"], ids=[version])
+    finally:
+        stop.set()
+        thread.join()
+        handle.close()
+
+    assert not errors
+    assert seen <= set(range(20))
+    assert handle.version == 20
@@ -0,0 +1,99 @@
+#!/usr/bin/env python
+"""Benchmark block mode scanning with huge page backed databases.
+
+Compiles a large pattern set once per huge page mode and compares scan
+throughput, reusing the workload from bench_regression.py. Databases in
+the hundreds of megabytes benefit most, since their bytecode otherwise
+spans many small pages and causes TLB misses.
+
+Usage:
+    python tools/bench_hugepages.py
+    python tools/bench_hugepages.py --patterns 20000 --modes off transparent
+"""
+
+import argparse
+import statistics
+
+from bench_regression import generate_document, generate_patterns, run_benchmark
+
+import hyperscan
+
+
+def bench_mode(mode, patterns, document, num_scans, warmup):
+    hyperscan.set_allocator(huge_pages=mode)
+    try:
+        db = hyperscan.Database(mode=hyperscan.HS_MODE_BLOCK)
+        db.compile(
+            expressions=patterns,
+            ids=list(range(len(patterns))),
+            flags=[hyperscan.HS_FLAG_CASELESS | hyperscan.HS_FLAG_SINGLEMATCH]
+            * len(patterns),
+        )
+        stats = hyperscan.allocator_stats()
+        times, match_count = run_benchmark(db, document, num_scans, warmup)
+    finally:
+        hyperscan.set_allocator()
+    return db.size(), stats, times, match_count
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Benchmark huge page backed Hyperscan databases"
+    )
+    parser.add_argument(
+        "--patterns", type=int, default=5000,
+        help="Number of regex patterns (default: 5000)",
+    )
+    parser.add_argument(
+        "--doc-size", type=int, default=1_000_000,
+        help="Document size in bytes (default: 1000000)",
+    )
+    parser.add_argument(
+        "--scans", type=int, default=50,
+        help="Number of scans to perform (default: 50)",
+    )
+    parser.add_argument(
+        "--warmup", type=int, default=5,
+        help="Number of warmup scans (default: 5)",
+    )
+    parser.add_argument(
+        "--modes", nargs="+", default=["off", "transparent", "explicit"],
+        choices=["off", "transparent", "explicit"],
+        help="Huge page modes to compare",
+    )
+    args = parser.parse_args()
+
+    patterns = generate_patterns(args.patterns)
+    document = generate_document(args.doc_size)
+    doc_mb = args.doc_size / (1024 * 1024)
+
+    print("=" * 60)
+    print("hyperscan huge page benchmark")
+    print("=" * 60)
+    print(f"pattern count:   {args.patterns}")
+    print(f"document size:   {args.doc_size:,} bytes")
+    print(f"scan iterations: {args.scans}")
+    print()
+
+    baseline = None
+    for mode in args.modes:
+        db_size, stats, times, match_count = bench_mode(
+            mode, patterns, document, args.scans, args.warmup
+        )
+        median_time = statistics.median(times)
+        throughput = doc_mb / median_time if median_time > 0 else float("inf")
+        if baseline is None:
+            baseline = throughput
+        print(f"[{mode}]")
+        print(f"  database size:      {db_size:,} bytes")
+        print(f"  huge page bytes:    {stats['huge_page_bytes']:,}")
+        print(f"  huge page fallback: {stats['huge_page_fallbacks']}")
+        print(f"  total matches:      {match_count:,}")
+        print(f"  median time/scan:   {median_time * 1000:.3f} ms")
+        print(f"  throughput:         {throughput:.1f} MB/s "
+              f"({throughput / baseline:.2f}x)")
+        print()
+
+
+if __name__ == "__main__":
+    main()
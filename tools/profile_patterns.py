@@ -0,0 +1,231 @@
+#!/usr/bin/env python
+"""Rank patterns by their compile time, size and scan cost.
+
+Splits a pattern set into groups (one pattern per group by default),
+compiles every group on its own in parallel and benchmarks each against
+a sample corpus with the workload from bench_regression.py. With
+--leave-out, each group is instead removed from the full set, so the
+report shows how much faster the remaining set compiles and scans
+without it. Groups are ranked by scan time, most expensive first.
+
+Compile timings of groups built concurrently contend for the same
+cores; pass --workers 1 when comparing compile times precisely.
+
+Usage:
+    python tools/profile_patterns.py
+    python tools/profile_patterns.py --patterns-file rules.txt --corpus sample.log
+    python tools/profile_patterns.py --patterns 500 --group-size 25 --leave-out
+"""
+
+import argparse
+import json
+import os
+import statistics
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+from bench_regression import generate_document, generate_patterns, run_benchmark
+
+import hyperscan
+
+
+def load_patterns(path):
+    """Read one pattern per line, skipping blank lines and comments."""
+    with open(path, "rb") as f:
+        return [
+            line.rstrip(b"\r\n")
+            for line in f
+            if line.strip() and not line.startswith(b"#")
+        ]
+
+
+def compile_subset(patterns, ids, flags):
+    """Compile a subset and return the database and compile time."""
+    db = hyperscan.Database(mode=hyperscan.HS_MODE_BLOCK)
+    t0 = time.perf_counter()
+    db.compile(expressions=patterns, ids=ids, flags=flags)
+    return db, time.perf_counter() - t0
+
+
+def profile(
+    patterns, document, group_size, leave_out, flags, workers, scans, warmup
+):
+    """Compile and benchmark every group, returning a ranked report."""
+    ids = list(range(len(patterns)))
+    groups = [ids[i : i + group_size] for i in range(0, len(ids), group_size)]
+
+    def subset(group):
+        if leave_out:
+            excluded = set(group)
+            return [i for i in ids if i not in excluded]
+        return group
+
+    def build(group):
+        members = subset(group)
+        if not members:
+            return None, 0.0
+        return compile_subset([patterns[i] for i in members], members, flags)
+
+    baseline_db, baseline_compile = compile_subset(patterns, ids, flags)
+    baseline_times, baseline_matches = run_benchmark(
+        baseline_db, document, scans, warmup
+    )
+    baseline = {
+        "compile_ms": baseline_compile * 1000,
+        "size": baseline_db.size(),
+        "scan_ms": statistics.median(baseline_times) * 1000,
+        "matches": baseline_matches,
+    }
+
+    # Hyperscan releases the GIL while compiling, so groups build in
+    # parallel. Scans run one at a time to keep their timings clean.
+    with ThreadPoolExecutor(max_workers=workers) as pool:
+        built = list(pool.map(build, groups))
+
+    rows = []
+    for group, (db, compile_time) in zip(groups, built):
+        if db is None:
+            times, matches, size = [0.0], 0, 0
+        else:
+            times, matches = run_benchmark(db, document, scans, warmup)
+            size = db.size()
+        row = {
+            "ids": group,
+            "patterns": [patterns[i].decode("utf-8", "replace") for i in group],
+            "compile_ms": compile_time * 1000,
+            "size": size,
+            "scan_ms": statistics.median(times) * 1000,
+            "matches": matches,
+        }
+        if leave_out:
+            # Express each figure as what the group adds to the full set.
+            for key in ("compile_ms", "size", "scan_ms", "matches"):
+                row[key] = baseline[key] - row[key]
+        rows.append(row)
+
+    rows.sort(key=lambda row: row["scan_ms"], reverse=True)
+    return baseline, rows
+
+
+def print_report(baseline, rows, doc_size, top, leave_out):
+    doc_mb = doc_size / (1024 * 1024)
+    scan_ms = baseline["scan_ms"]
+    throughput = doc_mb / (scan_ms / 1000) if scan_ms > 0 else float("inf")
+    print("=" * 78)
+    print("pattern cost profile")
+    print("=" * 78)
+    print(f"full set compile:   {baseline['compile_ms']:.1f} ms")
+    print(f"full set size:      {baseline['size']:,} bytes")
+    print(f"full set scan:      {scan_ms:.3f} ms ({throughput:.1f} MB/s)")
+    print(f"groups:             {len(rows)}")
+    print(
+        "figures show each group's "
+        + ("contribution to the full set" if leave_out else "cost on its own")
+    )
+    print()
+    print(
+        f"{'rank':>4}  {'scan ms':>9}  {'share':>6}  {'compile ms':>10}  "
+        f"{'size':>10}  {'matches':>8}  pattern"
+    )
+    print("-" * 78)
+    for rank, row in enumerate(rows[:top], 1):
+        share = row["scan_ms"] / scan_ms * 100 if scan_ms > 0 else 0.0
+        label = row["patterns"][0]
+        if len(row["patterns"]) > 1:
+            label = f"ids {row['ids'][0]}-{row['ids'][-1]}: {label} ..."
+        if len(label) > 40:
+            label = label[:37] + "..."
+        print(
+            f"{rank:>4}  {row['scan_ms']:>9.3f}  {share:>5.1f}%  "
+            f"{row['compile_ms']:>10.1f}  {row['size']:>10,}  "
+            f"{row['matches']:>8,}  {label}"
+        )
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Rank patterns by compile time, size and scan cost"
+    )
+    parser.add_argument(
+        "--patterns-file",
+        help="File with one pattern per line (default: generated patterns)",
+    )
+    parser.add_argument(
+        "--patterns", type=int, default=50,
+        help="Number of generated patterns (default: 50)",
+    )
+    parser.add_argument(
+        "--corpus",
+        help="Sample corpus to scan (default: generated document)",
+    )
+    parser.add_argument(
+        "--doc-size", type=int, default=500_000,
+        help="Generated document size in bytes (default: 500000)",
+    )
+    parser.add_argument(
+        "--group-size", type=int, default=1,
+        help="Patterns per profiled group (default: 1)",
+    )
+    parser.add_argument(
+        "--leave-out", action="store_true",
+        help="Profile the full set without each group instead of each "
+        "group alone",
+    )
+    parser.add_argument(
+        "--caseless", action="store_true",
+        help="Compile with HS_FLAG_CASELESS",
+    )
+    parser.add_argument(
+        "--workers", type=int, default=os.cpu_count() or 1,
+        help="Groups compiled in parallel (default: number of CPUs)",
+    )
+    parser.add_argument(
+        "--scans", type=int, default=20,
+        help="Timed scans per group (default: 20)",
+    )
+    parser.add_argument(
+        "--warmup", type=int, default=2,
+        help="Warmup scans per group (default: 2)",
+    )
+    parser.add_argument(
+        "--top", type=int, default=20,
+        help="Number of groups to print (default: 20)",
+    )
+    parser.add_argument(
+        "--json", metavar="PATH",
+        help="Also write the full report to PATH as JSON",
+    )
+    args = parser.parse_args()
+
+    if args.patterns_file:
+        patterns = load_patterns(args.patterns_file)
+    else:
+        patterns = generate_patterns(args.patterns)
+    if args.corpus:
+        with open(args.corpus, "rb") as f:
+            document = f.read()
+    else:
+        document = generate_document(args.doc_size)
+    flags = hyperscan.HS_FLAG_SINGLEMATCH
+    if args.caseless:
+        flags |= hyperscan.HS_FLAG_CASELESS
+
+    baseline, rows = profile(
+        patterns,
+        document,
+        max(1, args.group_size),
+        args.leave_out,
+        flags,
+        max(1, args.workers),
+        args.scans,
+        args.warmup,
+    )
+    print_report(baseline, rows, len(document), args.top, args.leave_out)
+
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump({"baseline": baseline, "groups": rows}, f, indent=2)
+
+
+if __name__ == "__main__":
+    main()
@@ -24,6 +24,8 @@ def profile_mem(
 
 
 def main() -> None:
+    # Route Hyperscan's allocations through PyMem so tracemalloc sees them.
+    hyperscan.set_allocator("pymem")
     tracemalloc.start()
     os.getpid()
 
@@ -49,6 +51,7 @@ def main() -> None:
             )
         ):
             ...
+        print(callback.__name__, hyperscan.allocator_stats())
 
 
 if __name__ == "__main__":